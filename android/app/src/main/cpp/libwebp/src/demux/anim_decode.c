@@ -54,11 +54,13 @@ struct WebPAnimDecoder {
   int prev_frame_was_keyframe;     // True if previous frame was a keyframe.
   int next_frame;                  // Index of the next frame to be decoded
                                    // (starting from 1).
+  const WebPAllocator* allocator;  // From the options, may be NULL.
 };
 
 static void DefaultDecoderOptions(WebPAnimDecoderOptions* const dec_options) {
   dec_options->color_mode = MODE_RGBA;
   dec_options->use_threads = 0;
+  dec_options->allocator = NULL;
 }
 
 int WebPAnimDecoderOptionsInitInternal(WebPAnimDecoderOptions* dec_options,
@@ -102,6 +104,7 @@ WebPAnimDecoder* WebPAnimDecoderNewInternal(
   WebPAnimDecoderOptions options;
   WebPAnimDecoder* dec = NULL;
   WebPBitstreamFeatures features;
+  const WebPAllocator* previous;
   if (webp_data == NULL ||
       WEBP_ABI_IS_INCOMPATIBLE(abi_version, WEBP_DEMUX_ABI_VERSION)) {
     return NULL;
@@ -114,15 +117,18 @@ WebPAnimDecoder* WebPAnimDecoderNewInternal(
     return NULL;
   }
 
-  // Note: calloc() so that the pointer members are initialized to NULL.
-  dec = (WebPAnimDecoder*)WebPSafeCalloc(1ULL, sizeof(*dec));
-  if (dec == NULL) goto Error;
-
   if (dec_options != NULL) {
     options = *dec_options;
   } else {
     DefaultDecoderOptions(&options);
   }
+  previous = WebPGetAllocator();
+  if (options.allocator != NULL) WebPSetAllocator(options.allocator);
+
+  // Note: calloc() so that the pointer members are initialized to NULL.
+  dec = (WebPAnimDecoder*)WebPSafeCalloc(1ULL, sizeof(*dec));
+  if (dec == NULL) goto Error;
+  dec->allocator = options.allocator;
   if (!ApplyDecoderOptions(&options, dec)) goto Error;
 
   dec->demux = WebPDemux(webp_data);
@@ -143,10 +149,12 @@ WebPAnimDecoder* WebPAnimDecoderNewInternal(
   if (dec->prev_frame_disposed == NULL) goto Error;
 
   WebPAnimDecoderReset(dec);
+  WebPSetAllocator(previous);
   return dec;
 
  Error:
   WebPAnimDecoderDelete(dec);
+  WebPSetAllocator(previous);
   return NULL;
 }
 
@@ -328,8 +336,8 @@ static void FindBlendRangeAtRow(const WebPIterator* const src,
   }
 }
 
-int WebPAnimDecoderGetNext(WebPAnimDecoder* dec,
-                           uint8_t** buf_ptr, int* timestamp_ptr) {
+static int GetNextFrame(WebPAnimDecoder* const dec,
+                        uint8_t** buf_ptr, int* timestamp_ptr) {
   WebPIterator iter;
   uint32_t width;
   uint32_t height;
@@ -337,7 +345,6 @@ int WebPAnimDecoderGetNext(WebPAnimDecoder* dec,
   int timestamp;
   BlendRowFunc blend_row;
 
-  if (dec == NULL || buf_ptr == NULL || timestamp_ptr == NULL) return 0;
   if (!WebPAnimDecoderHasMoreFrames(dec)) return 0;
 
   width = dec->info.canvas_width;
@@ -450,6 +457,17 @@ int WebPAnimDecoderGetNext(WebPAnimDecoder* dec,
   return 0;
 }
 
+int WebPAnimDecoderGetNext(WebPAnimDecoder* dec,
+                           uint8_t** buf_ptr, int* timestamp_ptr) {
+  const WebPAllocator* const previous = WebPGetAllocator();
+  int ok;
+  if (dec == NULL || buf_ptr == NULL || timestamp_ptr == NULL) return 0;
+  if (dec->allocator != NULL) WebPSetAllocator(dec->allocator);
+  ok = GetNextFrame(dec, buf_ptr, timestamp_ptr);
+  WebPSetAllocator(previous);
+  return ok;
+}
+
 int WebPAnimDecoderHasMoreFrames(const WebPAnimDecoder* dec) {
   if (dec == NULL) return 0;
   return (dec->next_frame <= (int)dec->info.frame_count);
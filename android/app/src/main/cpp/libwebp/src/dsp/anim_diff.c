@@ -0,0 +1,154 @@
+// Copyright 2026 Google Inc. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the COPYING file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS. All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+// -----------------------------------------------------------------------------
+//
+// Comparisons between the ARGB canvases of successive animation frames.
+
+#include <assert.h>
+#include <stdlib.h>  // for abs()
+
+#include "src/dsp/cpu.h"
+#include "src/dsp/dsp.h"
+#include "src/webp/types.h"
+
+//------------------------------------------------------------------------------
+
+// Returns true if each channel of 'src' and 'dst' is at most off by
+// 'max_allowed_diff', weighted by the alpha of 'dst'.
+static WEBP_INLINE int PixelsAreSimilar(uint32_t src, uint32_t dst,
+                                        int max_allowed_diff) {
+  const int src_a = (src >> 24) & 0xff;
+  const int src_r = (src >> 16) & 0xff;
+  const int src_g = (src >> 8) & 0xff;
+  const int src_b = (src >> 0) & 0xff;
+  const int dst_a = (dst >> 24) & 0xff;
+  const int dst_r = (dst >> 16) & 0xff;
+  const int dst_g = (dst >> 8) & 0xff;
+  const int dst_b = (dst >> 0) & 0xff;
+
+  return (src_a == dst_a) &&
+         (abs(src_r - dst_r) * dst_a <= (max_allowed_diff * 255)) &&
+         (abs(src_g - dst_g) * dst_a <= (max_allowed_diff * 255)) &&
+         (abs(src_b - dst_b) * dst_a <= (max_allowed_diff * 255));
+}
+
+int WebPAnimFindFirstDiffLossless_C(const uint32_t* src, const uint32_t* dst,
+                                    int len, int max_allowed_diff) {
+  int i;
+  (void)max_allowed_diff;
+  for (i = 0; i < len && src[i] == dst[i]; ++i) {}
+  return i;
+}
+
+int WebPAnimFindLastDiffLossless_C(const uint32_t* src, const uint32_t* dst,
+                                   int len, int max_allowed_diff) {
+  int i;
+  (void)max_allowed_diff;
+  for (i = len - 1; i >= 0 && src[i] == dst[i]; --i) {}
+  return i;
+}
+
+int WebPAnimFindFirstDiffLossy_C(const uint32_t* src, const uint32_t* dst,
+                                 int len, int max_allowed_diff) {
+  int i;
+  for (i = 0; i < len && PixelsAreSimilar(src[i], dst[i], max_allowed_diff);
+       ++i) {}
+  return i;
+}
+
+int WebPAnimFindLastDiffLossy_C(const uint32_t* src, const uint32_t* dst,
+                                int len, int max_allowed_diff) {
+  int i;
+  for (i = len - 1;
+       i >= 0 && PixelsAreSimilar(src[i], dst[i], max_allowed_diff); --i) {}
+  return i;
+}
+
+int WebPAnimIsBlendingPossibleLossless_C(const uint32_t* src,
+                                         const uint32_t* dst, int len,
+                                         int max_allowed_diff) {
+  int i;
+  (void)max_allowed_diff;
+  for (i = 0; i < len; ++i) {
+    // If we use blending, we can't attain a non-opaque 'dst' pixel.
+    if ((dst[i] >> 24) != 0xff && src[i] != dst[i]) return 0;
+  }
+  return 1;
+}
+
+int WebPAnimIsBlendingPossibleLossy_C(const uint32_t* src, const uint32_t* dst,
+                                      int len, int max_allowed_diff) {
+  int i;
+  for (i = 0; i < len; ++i) {
+    if ((dst[i] >> 24) != 0xff &&
+        !PixelsAreSimilar(src[i], dst[i], max_allowed_diff)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int WebPAnimIncreaseTransparency_C(const uint32_t* src, uint32_t* dst,
+                                   int len) {
+  int i;
+  int modified = 0;
+  for (i = 0; i < len; ++i) {
+    if (src[i] == dst[i] && dst[i] != 0x00000000) {
+      dst[i] = 0x00000000;
+      modified = 1;
+    }
+  }
+  return modified;
+}
+
+//------------------------------------------------------------------------------
+
+WebPAnimFindDiffFunc WebPAnimFindFirstDiffLossless;
+WebPAnimFindDiffFunc WebPAnimFindLastDiffLossless;
+WebPAnimFindDiffFunc WebPAnimFindFirstDiffLossy;
+WebPAnimFindDiffFunc WebPAnimFindLastDiffLossy;
+WebPAnimFindDiffFunc WebPAnimIsBlendingPossibleLossless;
+WebPAnimFindDiffFunc WebPAnimIsBlendingPossibleLossy;
+WebPAnimIncreaseTransparencyFunc WebPAnimIncreaseTransparency;
+
+extern VP8CPUInfo VP8GetCPUInfo;
+extern void WebPAnimDiffDspInitSSE2(void);
+extern void WebPAnimDiffDspInitNEON(void);
+
+WEBP_DSP_INIT_FUNC(WebPAnimDiffDspInit) {
+  WebPAnimFindFirstDiffLossless = WebPAnimFindFirstDiffLossless_C;
+  WebPAnimFindLastDiffLossless = WebPAnimFindLastDiffLossless_C;
+  WebPAnimFindFirstDiffLossy = WebPAnimFindFirstDiffLossy_C;
+  WebPAnimFindLastDiffLossy = WebPAnimFindLastDiffLossy_C;
+  WebPAnimIsBlendingPossibleLossless = WebPAnimIsBlendingPossibleLossless_C;
+  WebPAnimIsBlendingPossibleLossy = WebPAnimIsBlendingPossibleLossy_C;
+  WebPAnimIncreaseTransparency = WebPAnimIncreaseTransparency_C;
+
+  if (VP8GetCPUInfo != NULL) {
+#if defined(WEBP_HAVE_SSE2)
+    if (VP8GetCPUInfo(kSSE2)) {
+      WebPAnimDiffDspInitSSE2();
+    }
+#endif
+  }
+
+#if defined(WEBP_HAVE_NEON)
+  if (WEBP_NEON_OMIT_C_CODE ||
+      (VP8GetCPUInfo != NULL && VP8GetCPUInfo(kNEON))) {
+    WebPAnimDiffDspInitNEON();
+  }
+#endif
+
+  assert(WebPAnimFindFirstDiffLossless != NULL);
+  assert(WebPAnimFindLastDiffLossless != NULL);
+  assert(WebPAnimFindFirstDiffLossy != NULL);
+  assert(WebPAnimFindLastDiffLossy != NULL);
+  assert(WebPAnimIsBlendingPossibleLossless != NULL);
+  assert(WebPAnimIsBlendingPossibleLossy != NULL);
+  assert(WebPAnimIncreaseTransparency != NULL);
+}
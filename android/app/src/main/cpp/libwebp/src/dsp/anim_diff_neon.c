@@ -0,0 +1,181 @@
+// Copyright 2026 Google Inc. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the COPYING file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS. All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+// -----------------------------------------------------------------------------
+//
+// NEON version of the animation canvas comparisons.
+
+#include "src/dsp/dsp.h"
+
+#if defined(WEBP_USE_NEON)
+
+#include "src/dsp/neon.h"
+
+//------------------------------------------------------------------------------
+
+// Returns true if all the lanes of 'mask' are set.
+static WEBP_INLINE int AllSet_NEON(const uint32x4_t mask) {
+  const uint32x2_t m = vand_u32(vget_low_u32(mask), vget_high_u32(mask));
+  return (vget_lane_u32(m, 0) & vget_lane_u32(m, 1)) == 0xffffffffu;
+}
+
+// Returns true if any lane of 'mask' is set.
+static WEBP_INLINE int AnySet_NEON(const uint32x4_t mask) {
+  const uint32x2_t m = vorr_u32(vget_low_u32(mask), vget_high_u32(mask));
+  return (vget_lane_u32(m, 0) | vget_lane_u32(m, 1)) != 0;
+}
+
+// Returns the threshold to compare alpha-weighted channel differences against,
+// in each 16b lane of two pixels. Alpha lanes have to be equal.
+static WEBP_INLINE uint16x8_t MaxDiff_NEON(int max_allowed_diff) {
+  const uint64x2_t rgb = vdupq_n_u64(0x0000ffffffffffffull);
+  return vandq_u16(vdupq_n_u16((uint16_t)(max_allowed_diff * 255)),
+                   vreinterpretq_u16_u64(rgb));
+}
+
+// Returns all ones in the lanes of the pixels of 'src' and 'dst' whose channels
+// are within 'max_diff' once weighted by the alpha of 'dst'.
+static WEBP_INLINE uint32x4_t SimilarMask_NEON(const uint32x4_t src,
+                                               const uint32x4_t dst,
+                                               const uint16x8_t max_diff) {
+  const uint8x16_t diff =
+      vabdq_u8(vreinterpretq_u8_u32(src), vreinterpretq_u8_u32(dst));
+  // Alpha of each pixel in its four bytes, and 0xff in the alpha byte so any
+  // alpha difference exceeds its 0 threshold.
+  const uint32x4_t alpha = vmulq_n_u32(vshrq_n_u32(dst, 24), 0x01010101u);
+  const uint8x16_t weight =
+      vreinterpretq_u8_u32(vorrq_u32(alpha, vdupq_n_u32(0xff000000u)));
+  // diff * weight <= 255 * 255 fits in 16 unsigned bits.
+  const uint16x8_t lo = vmull_u8(vget_low_u8(diff), vget_low_u8(weight));
+  const uint16x8_t hi = vmull_u8(vget_high_u8(diff), vget_high_u8(weight));
+  const uint8x16_t channels = vcombine_u8(vmovn_u16(vcleq_u16(lo, max_diff)),
+                                          vmovn_u16(vcleq_u16(hi, max_diff)));
+  return vceqq_u32(vreinterpretq_u32_u8(channels), vdupq_n_u32(0xffffffffu));
+}
+
+static WEBP_INLINE uint32x4_t OpaqueMask_NEON(const uint32x4_t dst) {
+  return vcgeq_u32(dst, vdupq_n_u32(0xff000000u));
+}
+
+static int FindFirstDiffLossless_NEON(const uint32_t* src,
+                                      const uint32_t* dst, int len,
+                                      int max_allowed_diff) {
+  int i;
+  for (i = 0; i + 4 <= len; i += 4) {
+    if (!AllSet_NEON(vceqq_u32(vld1q_u32(src + i), vld1q_u32(dst + i)))) {
+      break;
+    }
+  }
+  return i + WebPAnimFindFirstDiffLossless_C(src + i, dst + i, len - i,
+                                             max_allowed_diff);
+}
+
+static int FindLastDiffLossless_NEON(const uint32_t* src, const uint32_t* dst,
+                                     int len, int max_allowed_diff) {
+  int i;
+  for (i = len; i >= 4; i -= 4) {
+    if (!AllSet_NEON(vceqq_u32(vld1q_u32(src + i - 4),
+                               vld1q_u32(dst + i - 4)))) {
+      break;
+    }
+  }
+  return WebPAnimFindLastDiffLossless_C(src, dst, i, max_allowed_diff);
+}
+
+static int FindFirstDiffLossy_NEON(const uint32_t* src, const uint32_t* dst,
+                                   int len, int max_allowed_diff) {
+  const uint16x8_t max_diff = MaxDiff_NEON(max_allowed_diff);
+  int i;
+  for (i = 0; i + 4 <= len; i += 4) {
+    if (!AllSet_NEON(SimilarMask_NEON(vld1q_u32(src + i), vld1q_u32(dst + i),
+                                      max_diff))) {
+      break;
+    }
+  }
+  return i + WebPAnimFindFirstDiffLossy_C(src + i, dst + i, len - i,
+                                          max_allowed_diff);
+}
+
+static int FindLastDiffLossy_NEON(const uint32_t* src, const uint32_t* dst,
+                                  int len, int max_allowed_diff) {
+  const uint16x8_t max_diff = MaxDiff_NEON(max_allowed_diff);
+  int i;
+  for (i = len; i >= 4; i -= 4) {
+    if (!AllSet_NEON(SimilarMask_NEON(vld1q_u32(src + i - 4),
+                                      vld1q_u32(dst + i - 4), max_diff))) {
+      break;
+    }
+  }
+  return WebPAnimFindLastDiffLossy_C(src, dst, i, max_allowed_diff);
+}
+
+static int IsBlendingPossibleLossless_NEON(const uint32_t* src,
+                                           const uint32_t* dst, int len,
+                                           int max_allowed_diff) {
+  int i;
+  for (i = 0; i + 4 <= len; i += 4) {
+    const uint32x4_t d = vld1q_u32(dst + i);
+    const uint32x4_t equal = vceqq_u32(vld1q_u32(src + i), d);
+    if (!AllSet_NEON(vorrq_u32(equal, OpaqueMask_NEON(d)))) return 0;
+  }
+  return WebPAnimIsBlendingPossibleLossless_C(src + i, dst + i, len - i,
+                                              max_allowed_diff);
+}
+
+static int IsBlendingPossibleLossy_NEON(const uint32_t* src,
+                                        const uint32_t* dst, int len,
+                                        int max_allowed_diff) {
+  const uint16x8_t max_diff = MaxDiff_NEON(max_allowed_diff);
+  int i;
+  for (i = 0; i + 4 <= len; i += 4) {
+    const uint32x4_t d = vld1q_u32(dst + i);
+    const uint32x4_t similar =
+        SimilarMask_NEON(vld1q_u32(src + i), d, max_diff);
+    if (!AllSet_NEON(vorrq_u32(similar, OpaqueMask_NEON(d)))) return 0;
+  }
+  return WebPAnimIsBlendingPossibleLossy_C(src + i, dst + i, len - i,
+                                           max_allowed_diff);
+}
+
+static int IncreaseTransparency_NEON(const uint32_t* src, uint32_t* dst,
+                                     int len) {
+  int i;
+  int modified = 0;
+  for (i = 0; i + 4 <= len; i += 4) {
+    const uint32x4_t d = vld1q_u32(dst + i);
+    // Equal and not already transparent.
+    const uint32x4_t change =
+        vandq_u32(vceqq_u32(vld1q_u32(src + i), d), vtstq_u32(d, d));
+    if (AnySet_NEON(change)) {
+      vst1q_u32(dst + i, vbicq_u32(d, change));
+      modified = 1;
+    }
+  }
+  if (WebPAnimIncreaseTransparency_C(src + i, dst + i, len - i)) modified = 1;
+  return modified;
+}
+
+//------------------------------------------------------------------------------
+// Entry point
+
+extern void WebPAnimDiffDspInitNEON(void);
+
+WEBP_TSAN_IGNORE_FUNCTION void WebPAnimDiffDspInitNEON(void) {
+  WebPAnimFindFirstDiffLossless = FindFirstDiffLossless_NEON;
+  WebPAnimFindLastDiffLossless = FindLastDiffLossless_NEON;
+  WebPAnimFindFirstDiffLossy = FindFirstDiffLossy_NEON;
+  WebPAnimFindLastDiffLossy = FindLastDiffLossy_NEON;
+  WebPAnimIsBlendingPossibleLossless = IsBlendingPossibleLossless_NEON;
+  WebPAnimIsBlendingPossibleLossy = IsBlendingPossibleLossy_NEON;
+  WebPAnimIncreaseTransparency = IncreaseTransparency_NEON;
+}
+
+#else  // !WEBP_USE_NEON
+
+WEBP_DSP_INIT_STUB(WebPAnimDiffDspInitNEON)
+
+#endif  // WEBP_USE_NEON
@@ -0,0 +1,191 @@
+// Copyright 2026 Google Inc. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the COPYING file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS. All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+// -----------------------------------------------------------------------------
+//
+// SSE2 version of the animation canvas comparisons.
+
+#include "src/dsp/dsp.h"
+
+#if defined(WEBP_USE_SSE2)
+#include <emmintrin.h>
+
+#include "src/dsp/cpu.h"
+#include "src/webp/types.h"
+
+//------------------------------------------------------------------------------
+
+// Returns the threshold to compare alpha-weighted channel differences against,
+// in each 16b lane of two pixels. Alpha lanes have to be equal.
+static WEBP_INLINE __m128i MaxDiff_SSE2(int max_allowed_diff) {
+  const short max_diff = (short)(max_allowed_diff * 255);
+  return _mm_set_epi16(0, max_diff, max_diff, max_diff,
+                       0, max_diff, max_diff, max_diff);
+}
+
+// Returns all ones in the 16b lanes of 'diff' (two pixels unpacked to 16b)
+// that are within 'max_diff' once weighted by the alpha of 'dst'.
+static WEBP_INLINE __m128i SimilarHalf_SSE2(const __m128i diff,
+                                            const __m128i dst,
+                                            const __m128i max_diff) {
+  // Alpha of each pixel in its four lanes, and 0xff in the alpha lane so any
+  // alpha difference exceeds its 0 threshold.
+  const __m128i alpha_lanes = _mm_set_epi16(0xff, 0, 0, 0, 0xff, 0, 0, 0);
+  const __m128i alpha =
+      _mm_shufflehi_epi16(_mm_shufflelo_epi16(dst, 0xff), 0xff);
+  const __m128i weight = _mm_or_si128(alpha, alpha_lanes);
+  // diff * weight <= 255 * 255 fits in 16 unsigned bits.
+  const __m128i weighted = _mm_mullo_epi16(diff, weight);
+  const __m128i excess = _mm_subs_epu16(weighted, max_diff);
+  return _mm_cmpeq_epi16(excess, _mm_setzero_si128());
+}
+
+// Returns a 16b mask with a bit per channel of each pixel that is similar.
+static WEBP_INLINE int SimilarMask_SSE2(const __m128i src, const __m128i dst,
+                                        const __m128i max_diff) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i diff =
+      _mm_or_si128(_mm_subs_epu8(src, dst), _mm_subs_epu8(dst, src));
+  const __m128i lo = SimilarHalf_SSE2(_mm_unpacklo_epi8(diff, zero),
+                                      _mm_unpacklo_epi8(dst, zero), max_diff);
+  const __m128i hi = SimilarHalf_SSE2(_mm_unpackhi_epi8(diff, zero),
+                                      _mm_unpackhi_epi8(dst, zero), max_diff);
+  // Back to one byte per channel: a pixel is similar if its 4 bits are set.
+  return _mm_movemask_epi8(_mm_packs_epi16(lo, hi));
+}
+
+// Returns a 16b mask with the 4 bits of each equal pixel set.
+static WEBP_INLINE int EqualMask_SSE2(const __m128i src, const __m128i dst) {
+  return _mm_movemask_epi8(_mm_cmpeq_epi32(src, dst));
+}
+
+// Returns a 16b mask with the 4 bits of each opaque pixel set.
+static WEBP_INLINE int OpaqueMask_SSE2(const __m128i dst) {
+  const __m128i rgb = _mm_set1_epi32(0x00ffffff);
+  return _mm_movemask_epi8(
+      _mm_cmpeq_epi32(_mm_or_si128(dst, rgb), _mm_set1_epi32(-1)));
+}
+
+#define LOAD(P) _mm_loadu_si128((const __m128i*)(P))
+
+static int FindFirstDiffLossless_SSE2(const uint32_t* src,
+                                      const uint32_t* dst, int len,
+                                      int max_allowed_diff) {
+  int i;
+  for (i = 0; i + 4 <= len; i += 4) {
+    if (EqualMask_SSE2(LOAD(src + i), LOAD(dst + i)) != 0xffff) break;
+  }
+  return i + WebPAnimFindFirstDiffLossless_C(src + i, dst + i, len - i,
+                                             max_allowed_diff);
+}
+
+static int FindLastDiffLossless_SSE2(const uint32_t* src, const uint32_t* dst,
+                                     int len, int max_allowed_diff) {
+  int i;
+  for (i = len; i >= 4; i -= 4) {
+    if (EqualMask_SSE2(LOAD(src + i - 4), LOAD(dst + i - 4)) != 0xffff) break;
+  }
+  return WebPAnimFindLastDiffLossless_C(src, dst, i, max_allowed_diff);
+}
+
+static int FindFirstDiffLossy_SSE2(const uint32_t* src, const uint32_t* dst,
+                                   int len, int max_allowed_diff) {
+  const __m128i max_diff = MaxDiff_SSE2(max_allowed_diff);
+  int i;
+  for (i = 0; i + 4 <= len; i += 4) {
+    if (SimilarMask_SSE2(LOAD(src + i), LOAD(dst + i), max_diff) != 0xffff) {
+      break;
+    }
+  }
+  return i + WebPAnimFindFirstDiffLossy_C(src + i, dst + i, len - i,
+                                          max_allowed_diff);
+}
+
+static int FindLastDiffLossy_SSE2(const uint32_t* src, const uint32_t* dst,
+                                  int len, int max_allowed_diff) {
+  const __m128i max_diff = MaxDiff_SSE2(max_allowed_diff);
+  int i;
+  for (i = len; i >= 4; i -= 4) {
+    if (SimilarMask_SSE2(LOAD(src + i - 4), LOAD(dst + i - 4), max_diff) !=
+        0xffff) {
+      break;
+    }
+  }
+  return WebPAnimFindLastDiffLossy_C(src, dst, i, max_allowed_diff);
+}
+
+static int IsBlendingPossibleLossless_SSE2(const uint32_t* src,
+                                           const uint32_t* dst, int len,
+                                           int max_allowed_diff) {
+  int i;
+  for (i = 0; i + 4 <= len; i += 4) {
+    const __m128i d = LOAD(dst + i);
+    if ((EqualMask_SSE2(LOAD(src + i), d) | OpaqueMask_SSE2(d)) != 0xffff) {
+      return 0;
+    }
+  }
+  return WebPAnimIsBlendingPossibleLossless_C(src + i, dst + i, len - i,
+                                              max_allowed_diff);
+}
+
+static int IsBlendingPossibleLossy_SSE2(const uint32_t* src,
+                                        const uint32_t* dst, int len,
+                                        int max_allowed_diff) {
+  const __m128i max_diff = MaxDiff_SSE2(max_allowed_diff);
+  int i;
+  for (i = 0; i + 4 <= len; i += 4) {
+    const __m128i d = LOAD(dst + i);
+    if ((SimilarMask_SSE2(LOAD(src + i), d, max_diff) | OpaqueMask_SSE2(d)) !=
+        0xffff) {
+      return 0;
+    }
+  }
+  return WebPAnimIsBlendingPossibleLossy_C(src + i, dst + i, len - i,
+                                           max_allowed_diff);
+}
+
+static int IncreaseTransparency_SSE2(const uint32_t* src, uint32_t* dst,
+                                     int len) {
+  const __m128i zero = _mm_setzero_si128();
+  int i;
+  int modified = 0;
+  for (i = 0; i + 4 <= len; i += 4) {
+    const __m128i d = LOAD(dst + i);
+    const __m128i equal = _mm_cmpeq_epi32(LOAD(src + i), d);
+    const __m128i transparent = _mm_cmpeq_epi32(d, zero);
+    const __m128i change = _mm_andnot_si128(transparent, equal);
+    if (_mm_movemask_epi8(change)) {
+      _mm_storeu_si128((__m128i*)(dst + i), _mm_andnot_si128(change, d));
+      modified = 1;
+    }
+  }
+  if (WebPAnimIncreaseTransparency_C(src + i, dst + i, len - i)) modified = 1;
+  return modified;
+}
+
+#undef LOAD
+
+//------------------------------------------------------------------------------
+// Entry point
+
+extern void WebPAnimDiffDspInitSSE2(void);
+
+WEBP_TSAN_IGNORE_FUNCTION void WebPAnimDiffDspInitSSE2(void) {
+  WebPAnimFindFirstDiffLossless = FindFirstDiffLossless_SSE2;
+  WebPAnimFindLastDiffLossless = FindLastDiffLossless_SSE2;
+  WebPAnimFindFirstDiffLossy = FindFirstDiffLossy_SSE2;
+  WebPAnimFindLastDiffLossy = FindLastDiffLossy_SSE2;
+  WebPAnimIsBlendingPossibleLossless = IsBlendingPossibleLossless_SSE2;
+  WebPAnimIsBlendingPossibleLossy = IsBlendingPossibleLossy_SSE2;
+  WebPAnimIncreaseTransparency = IncreaseTransparency_SSE2;
+}
+
+#else  // !WEBP_USE_SSE2
+
+WEBP_DSP_INIT_STUB(WebPAnimDiffDspInitSSE2)
+
+#endif  // WEBP_USE_SSE2
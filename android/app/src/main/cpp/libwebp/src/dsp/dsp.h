@@ -205,6 +205,50 @@ extern VP8AccumulateSSEFunc VP8AccumulateSSE;
 // must be called before using any of the above directly
 void VP8SSIMDspInit(void);
 
+//------------------------------------------------------------------------------
+// Animation encoding: comparisons between successive ARGB canvases
+
+// Returns the index of the first (resp. last) of the 'len' pixels of 'src' and
+// 'dst' that differ, or 'len' (resp. -1) if none does. Lossless functions look
+// for any change. Lossy ones look for a channel off by more than
+// 'max_allowed_diff', weighted by the alpha of 'dst', or for an alpha change.
+typedef int (*WebPAnimFindDiffFunc)(const uint32_t* src, const uint32_t* dst,
+                                    int len, int max_allowed_diff);
+extern WebPAnimFindDiffFunc WebPAnimFindFirstDiffLossless;
+extern WebPAnimFindDiffFunc WebPAnimFindLastDiffLossless;
+extern WebPAnimFindDiffFunc WebPAnimFindFirstDiffLossy;
+extern WebPAnimFindDiffFunc WebPAnimFindLastDiffLossy;
+// Return true if blending 'dst' over 'src' can give back 'dst' (within
+// 'max_allowed_diff' for the lossy version): 'dst' pixels that are not opaque
+// must be the same as 'src' ones.
+extern WebPAnimFindDiffFunc WebPAnimIsBlendingPossibleLossless;
+extern WebPAnimFindDiffFunc WebPAnimIsBlendingPossibleLossy;
+// Replaces the pixels of 'dst' that are the same as 'src' by transparent ones.
+// Returns true if at least one pixel was modified.
+typedef int (*WebPAnimIncreaseTransparencyFunc)(const uint32_t* src,
+                                                uint32_t* dst, int len);
+extern WebPAnimIncreaseTransparencyFunc WebPAnimIncreaseTransparency;
+
+// Plain-C versions, used as fallback by the SIMD implementations.
+int WebPAnimFindFirstDiffLossless_C(const uint32_t* src, const uint32_t* dst,
+                                    int len, int max_allowed_diff);
+int WebPAnimFindLastDiffLossless_C(const uint32_t* src, const uint32_t* dst,
+                                   int len, int max_allowed_diff);
+int WebPAnimFindFirstDiffLossy_C(const uint32_t* src, const uint32_t* dst,
+                                 int len, int max_allowed_diff);
+int WebPAnimFindLastDiffLossy_C(const uint32_t* src, const uint32_t* dst,
+                                int len, int max_allowed_diff);
+int WebPAnimIsBlendingPossibleLossless_C(const uint32_t* src,
+                                         const uint32_t* dst, int len,
+                                         int max_allowed_diff);
+int WebPAnimIsBlendingPossibleLossy_C(const uint32_t* src, const uint32_t* dst,
+                                      int len, int max_allowed_diff);
+int WebPAnimIncreaseTransparency_C(const uint32_t* src, uint32_t* dst,
+                                   int len);
+
+// must be called before using any of the above directly
+void WebPAnimDiffDspInit(void);
+
 //------------------------------------------------------------------------------
 // Decoding
 
@@ -17,6 +17,7 @@
 
 #include "src/dsp/dsp.h"
 #include "src/webp/types.h"
+#include "src/enc/scratch_enc.h"
 #include "src/enc/vp8i_enc.h"
 #include "src/utils/bit_writer_utils.h"
 #include "src/utils/filters_utils.h"
@@ -54,23 +55,35 @@
 static int EncodeLossless(const uint8_t* const data, int width, int height,
                           int effort_level,  // in [0..6] range
                           int use_quality_100, VP8LBitWriter* const bw,
-                          WebPAuxStats* const stats) {
+                          WebPAuxStats* const stats,
+                          WebPEncoderScratch* const scratch) {
   int ok = 0;
   WebPConfig config;
   WebPPicture picture;
+  void* argb_mem;
 
   if (!WebPPictureInit(&picture)) return 0;
   picture.width = width;
   picture.height = height;
   picture.use_argb = 1;
   picture.stats = stats;
-  if (!WebPPictureAlloc(&picture)) return 0;
+  picture.scratch = scratch;
+  // The picture doesn't own its samples, so that they can stay in 'scratch'.
+  argb_mem = WebPScratchAlloc(scratch, WEBP_SCRATCH_ALPHA_ARGB,
+                              (uint64_t)width * height + WEBP_ALIGN_CST,
+                              sizeof(*picture.argb));
+  if (argb_mem == NULL) return 0;
+  picture.argb = (uint32_t*)WEBP_ALIGN(argb_mem);
+  picture.argb_stride = width;
 
   // Transfer the alpha values to the green channel.
   WebPDispatchAlphaToGreen(data, width, picture.width, picture.height,
                            picture.argb, picture.argb_stride);
 
-  if (!WebPConfigInit(&config)) return 0;
+  if (!WebPConfigInit(&config)) {
+    WebPScratchFree(scratch, WEBP_SCRATCH_ALPHA_ARGB, argb_mem);
+    return 0;
+  }
   config.lossless = 1;
   // Enable exact, or it would alter RGB values of transparent alpha, which is
   // normally OK but not here since we are not encoding the input image but  an
@@ -88,7 +101,7 @@ static int EncodeLossless(const uint8_t* const data, int width, int height,
   assert(config.quality >= 0 && config.quality <= 100.f);
 
   ok = VP8LEncodeStream(&config, &picture, bw);
-  WebPPictureFree(&picture);
+  WebPScratchFree(scratch, WEBP_SCRATCH_ALPHA_ARGB, argb_mem);
   ok = ok && !bw->error;
   if (!ok) {
     VP8LBitWriterWipeOut(bw);
@@ -111,6 +124,7 @@ static int EncodeAlphaInternal(const uint8_t* const data, int width, int height,
                                int method, int filter, int reduce_levels,
                                int effort_level,  // in [0..6] range
                                uint8_t* const tmp_alpha,
+                               WebPEncoderScratch* const scratch,
                                FilterTrial* result) {
   int ok = 0;
   const uint8_t* alpha_src;
@@ -138,7 +152,8 @@ static int EncodeAlphaInternal(const uint8_t* const data, int width, int height,
   if (method != ALPHA_NO_COMPRESSION) {
     ok = VP8LBitWriterInit(&tmp_bw, data_size >> 3);
     ok = ok && EncodeLossless(alpha_src, width, height, effort_level,
-                              !reduce_levels, &tmp_bw, &result->stats);
+                              !reduce_levels, &tmp_bw, &result->stats,
+                              scratch);
     if (ok) {
       output = VP8LBitWriterFinish(&tmp_bw);
       if (tmp_bw.error) {
@@ -238,12 +253,33 @@ static void InitFilterTrial(FilterTrial* const score) {
   VP8BitWriterInit(&score->bw, 0);
 }
 
+// A filter to try, with its result.
+typedef struct {
+  const uint8_t* alpha;
+  int width, height;
+  int method, filter, reduce_levels, effort_level;
+  uint8_t* filtered_alpha;        // buffer for the filtered plane
+  WebPEncoderScratch* scratch;    // only for the calling thread
+  FilterTrial trial;
+} FilterJob;
+
+static int FilterJobHook(void* arg1, void* unused) {
+  FilterJob* const job = (FilterJob*)arg1;
+  (void)unused;
+  return EncodeAlphaInternal(job->alpha, job->width, job->height, job->method,
+                             job->filter, job->reduce_levels,
+                             job->effort_level, job->filtered_alpha,
+                             job->scratch, &job->trial);
+}
+
 static int ApplyFiltersAndEncode(const uint8_t* alpha, int width, int height,
                                  size_t data_size, int method, int filter,
                                  int reduce_levels, int effort_level,
+                                 int num_threads,
                                  uint8_t** const output,
                                  size_t* const output_size,
-                                 WebPAuxStats* const stats) {
+                                 WebPAuxStats* const stats,
+                                 WebPEncoderScratch* const scratch) {
   int ok = 1;
   FilterTrial best;
   uint32_t try_map =
@@ -251,27 +287,61 @@ static int ApplyFiltersAndEncode(const uint8_t* alpha, int width, int height,
   InitFilterTrial(&best);
 
   if (try_map != FILTER_TRY_NONE) {
-    uint8_t* filtered_alpha =  (uint8_t*)WebPSafeMalloc(1ULL, data_size);
-    if (filtered_alpha == NULL) return 0;
-
-    for (filter = WEBP_FILTER_NONE; ok && try_map; ++filter, try_map >>= 1) {
+    // The filters are tried in parallel if there are threads for them. The
+    // jobs of the calling thread share one buffer from 'scratch', the others
+    // each have their own.
+    FilterJob jobs[WEBP_FILTER_LAST];
+    uint8_t* filtered_alpha[WEBP_FILTER_LAST] = { NULL };
+    WebPWorkerPool pool;
+    int num_jobs = 0;
+    int pool_size;
+    int i;
+    for (filter = WEBP_FILTER_NONE; try_map; ++filter, try_map >>= 1) {
       if (try_map & 1) {
-        FilterTrial trial;
-        ok = EncodeAlphaInternal(alpha, width, height, method, filter,
-                                 reduce_levels, effort_level, filtered_alpha,
-                                 &trial);
-        if (ok && trial.score < best.score) {
-          VP8BitWriterWipeOut(&best.bw);
-          best = trial;
-        } else {
-          VP8BitWriterWipeOut(&trial.bw);
-        }
+        FilterJob* const job = &jobs[num_jobs++];
+        job->alpha = alpha;
+        job->width = width;
+        job->height = height;
+        job->method = method;
+        job->filter = filter;
+        job->reduce_levels = reduce_levels;
+        job->effort_level = effort_level;
+        InitFilterTrial(&job->trial);
+      }
+    }
+    ok = WebPScratchPoolInit(scratch, WEBP_SCRATCH_POOL_ALPHA, &pool,
+                             (num_threads < num_jobs) ? num_threads : num_jobs);
+    pool_size = WebPWorkerPoolSize(&pool);
+    for (i = 0; ok && i < pool_size; ++i) {
+      filtered_alpha[i] =
+          (i == 0) ? (uint8_t*)WebPScratchAlloc(
+                         scratch, WEBP_SCRATCH_ALPHA_FILTERED, 1ULL, data_size)
+                   : (uint8_t*)WebPSafeMalloc(1ULL, data_size);
+      ok = (filtered_alpha[i] != NULL);
+    }
+    for (i = 0; i < num_jobs; ++i) {
+      // Job 'i' runs on the same thread as job 'i % pool_size'.
+      jobs[i].filtered_alpha = filtered_alpha[i % pool_size];
+      jobs[i].scratch = (i % pool_size == 0) ? scratch : NULL;
+    }
+    ok = ok && WebPWorkerPoolRun(&pool, FilterJobHook, jobs, sizeof(*jobs),
+                                 num_jobs, NULL);
+    WebPScratchPoolEnd(scratch, WEBP_SCRATCH_POOL_ALPHA, &pool);
+    // Keep the first smallest result, as when trying the filters in order.
+    for (i = 0; i < num_jobs; ++i) {
+      if (ok && jobs[i].trial.score < best.score) {
+        VP8BitWriterWipeOut(&best.bw);
+        best = jobs[i].trial;
+      } else {
+        VP8BitWriterWipeOut(&jobs[i].trial.bw);
       }
     }
-    WebPSafeFree(filtered_alpha);
+    WebPScratchFree(scratch, WEBP_SCRATCH_ALPHA_FILTERED, filtered_alpha[0]);
+    for (i = 1; i < pool_size; ++i) WebPSafeFree(filtered_alpha[i]);
   } else {
     ok = EncodeAlphaInternal(alpha, width, height, method, WEBP_FILTER_NONE,
-                             reduce_levels, effort_level, NULL, &best);
+                             reduce_levels, effort_level, NULL, scratch,
+                             &best);
   }
   if (ok) {
 #if !defined(WEBP_DISABLE_STATS)
@@ -332,7 +402,9 @@ static int EncodeAlpha(VP8Encoder* const enc,
     filter = WEBP_FILTER_NONE;
   }
 
-  quant_alpha = (uint8_t*)WebPSafeMalloc(1ULL, data_size);
+  quant_alpha = (uint8_t*)WebPScratchAlloc(pic->scratch,
+                                           WEBP_SCRATCH_ALPHA_PLANE, 1ULL,
+                                           data_size);
   if (quant_alpha == NULL) {
     return WebPEncodingSetError(pic, VP8_ENC_ERROR_OUT_OF_MEMORY);
   }
@@ -352,8 +424,9 @@ static int EncodeAlpha(VP8Encoder* const enc,
   if (ok) {
     VP8FiltersInit();
     ok = ApplyFiltersAndEncode(quant_alpha, width, height, data_size, method,
-                               filter, reduce_levels, effort_level, output,
-                               output_size, pic->stats);
+                               filter, reduce_levels, effort_level,
+                               enc->num_threads, output, output_size,
+                               pic->stats, pic->scratch);
     if (!ok) {
       WebPEncodingSetError(pic, VP8_ENC_ERROR_OUT_OF_MEMORY);  // imprecise
     }
@@ -365,7 +438,7 @@ static int EncodeAlpha(VP8Encoder* const enc,
 #endif
   }
 
-  WebPSafeFree(quant_alpha);
+  WebPScratchFree(pic->scratch, WEBP_SCRATCH_ALPHA_PLANE, quant_alpha);
   return ok;
 }
 
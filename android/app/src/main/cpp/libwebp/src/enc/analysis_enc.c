@@ -130,11 +130,103 @@ static void InitHistogram(VP8Histogram* const histo) {
   histo->last_non_zero = 1;
 }
 
+//------------------------------------------------------------------------------
+// Analysis cache: the analysis of each macroblock of the previous picture, and
+// the centers of its segments.
+
+typedef struct {
+  uint64_t hash;      // hash of the source samples
+  uint16_t uv_alpha;  // chroma susceptibility
+  uint8_t alpha;      // final susceptibility
+  uint8_t type;       // 0=i4x4 (DC modes only), 1=i16x16
+  uint8_t mode;       // i16x16 mode
+  uint8_t uv_mode;
+  uint8_t valid;      // true if the fields above are set
+} MBAnalysis;
+
+struct WebPAnalysisCache {
+  int width, height;   // dimensions of the picture 'mbs' belong to
+  int fast_quality;    // its quality for methods 0 and 1, whose analysis
+                       // depends on it, -1 otherwise
+  MBAnalysis* mbs;     // one per macroblock
+  int mbs_size;        // allocated size of 'mbs'
+  int num_segments;    // number of 'centers', 0 if none yet
+  int centers[NUM_MB_SEGMENTS];
+};
+
+WebPAnalysisCache* WebPAnalysisCacheNew(void) {
+  return (WebPAnalysisCache*)WebPSafeCalloc(1ULL, sizeof(WebPAnalysisCache));
+}
+
+void WebPAnalysisCacheDelete(WebPAnalysisCache* cache) {
+  if (cache != NULL) {
+    WebPSafeFree(cache->mbs);
+    WebPSafeFree(cache);
+  }
+}
+
+// Makes 'cache' apply to the picture of 'enc', forgetting the macroblocks of
+// a different one. The segment centers are kept. Returns false in case of
+// memory error.
+static int PrepareCache(const VP8Encoder* const enc,
+                        WebPAnalysisCache* const cache) {
+  const int num_mbs = enc->mb_w * enc->mb_h;
+  const int fast_quality = (enc->method <= 1) ? (int)enc->config->quality : -1;
+  if (cache->width == enc->pic->width && cache->height == enc->pic->height &&
+      cache->fast_quality == fast_quality) {
+    return 1;
+  }
+  if (num_mbs > cache->mbs_size) {
+    MBAnalysis* const mbs =
+        (MBAnalysis*)WebPSafeMalloc(num_mbs, sizeof(*cache->mbs));
+    if (mbs == NULL) return 0;
+    WebPSafeFree(cache->mbs);
+    cache->mbs = mbs;
+    cache->mbs_size = num_mbs;
+  }
+  memset(cache->mbs, 0, num_mbs * sizeof(*cache->mbs));
+  cache->width = enc->pic->width;
+  cache->height = enc->pic->height;
+  cache->fast_quality = fast_quality;
+  return 1;
+}
+
+static uint64_t HashBytes(const uint8_t* src, int size, uint64_t hash) {
+  int i;
+  for (i = 0; i < size; i += 8) {
+    uint64_t v;
+    memcpy(&v, src + i, sizeof(v));
+    hash = (hash ^ v) * 0x9e3779b97f4a7c15ULL;
+    hash ^= hash >> 29;
+  }
+  return hash;
+}
+
+// Hash of the samples the analysis of the current macroblock looks at: its
+// own and the boundary ones its predictions use.
+static uint64_t HashSamples(const VP8EncIterator* const it) {
+  uint64_t hash = it->y_left[-1] | (it->u_left[-1] << 8) |
+                  (it->v_left[-1] << 16);
+  int y;
+  for (y = 0; y < 8; ++y) {   // Y, U and V
+    hash = HashBytes(it->yuv_in + Y_OFF_ENC + y * BPS, 16 + 8 + 8, hash);
+  }
+  for (; y < 16; ++y) {       // Y only
+    hash = HashBytes(it->yuv_in + Y_OFF_ENC + y * BPS, 16, hash);
+  }
+  hash = HashBytes(it->y_left, 16, hash);
+  hash = HashBytes(it->u_left, 8, hash);
+  hash = HashBytes(it->v_left, 8, hash);
+  hash = HashBytes(it->y_top, 16, hash);
+  return HashBytes(it->uv_top, 8 + 8, hash);
+}
+
 //------------------------------------------------------------------------------
 // Simplified k-Means, to assign Nb segments based on alpha-histogram
 
 static void AssignSegments(VP8Encoder* const enc,
-                           const int alphas[MAX_ALPHA + 1]) {
+                           const int alphas[MAX_ALPHA + 1],
+                           WebPAnalysisCache* const cache) {
   // 'num_segments' is previously validated and <= NUM_MB_SEGMENTS, but an
   // explicit check is needed to avoid spurious warning about 'n + 1' exceeding
   // array bounds of 'centers' with some compilers (noticed with gcc-4.9).
@@ -158,10 +250,18 @@ static void AssignSegments(VP8Encoder* const enc,
   max_a = n;
   range_a = max_a - min_a;
 
-  // Spread initial centers evenly
-  for (k = 0, n = 1; k < nb; ++k, n += 2) {
-    assert(n < 2 * nb);
-    centers[k] = min_a + (n * range_a) / (2 * nb);
+  if (cache != NULL && cache->num_segments == nb) {
+    // Start from the centers of the previous picture: with similar content,
+    // they hardly move.
+    for (k = 0; k < nb; ++k) {
+      centers[k] = clip(cache->centers[k], min_a, max_a);
+    }
+  } else {
+    // Spread initial centers evenly
+    for (k = 0, n = 1; k < nb; ++k, n += 2) {
+      assert(n < 2 * nb);
+      centers[k] = min_a + (n * range_a) / (2 * nb);
+    }
   }
 
   for (k = 0; k < MAX_ITERS_K_MEANS; ++k) {     // few iters are enough
@@ -202,6 +302,10 @@ static void AssignSegments(VP8Encoder* const enc,
     weighted_average = (weighted_average + total_weight / 2) / total_weight;
     if (displaced < 5) break;   // no need to keep on looping...
   }
+  if (cache != NULL) {
+    memcpy(cache->centers, centers, sizeof(centers));
+    cache->num_segments = nb;
+  }
 
   // Map each original value to the closest centroid
   for (n = 0; n < enc->mb_w * enc->mb_h; ++n) {
@@ -308,26 +412,64 @@ static int MBAnalyzeBestUVMode(VP8EncIterator* const it) {
   return best_alpha;
 }
 
+// Sets the modes of the current macroblock as recorded in 'cached'.
+static void ReplayMBAnalysis(VP8EncIterator* const it,
+                             const MBAnalysis* const cached) {
+  if (cached->type == 1) {
+    VP8SetIntra16Mode(it, cached->mode);
+  } else {
+    const uint8_t modes[16] = { 0 };  // DC4
+    VP8SetIntra4Mode(it, modes);
+  }
+  VP8SetIntraUVMode(it, cached->uv_mode);
+}
+
+static void RecordMBAnalysis(const VP8EncIterator* const it, uint64_t hash,
+                             int alpha, int uv_alpha,
+                             MBAnalysis* const cached) {
+  assert(uv_alpha >= 0 && uv_alpha <= 0xffff);
+  cached->hash = hash;
+  cached->uv_alpha = (uint16_t)uv_alpha;
+  cached->alpha = (uint8_t)alpha;
+  cached->type = it->mb->type;
+  cached->mode = it->preds[0];
+  cached->uv_mode = it->mb->uv_mode;
+  cached->valid = 1;
+}
+
+// 'cached' is the analysis of this macroblock in the previous picture, to
+// reuse if its samples are the same, and to update otherwise. May be NULL.
 static void MBAnalyze(VP8EncIterator* const it,
                       int alphas[MAX_ALPHA + 1],
-                      int* const alpha, int* const uv_alpha) {
+                      int* const alpha, int* const uv_alpha,
+                      MBAnalysis* const cached) {
   const VP8Encoder* const enc = it->enc;
+  const uint64_t hash = (cached != NULL) ? HashSamples(it) : 0;
   int best_alpha, best_uv_alpha;
 
   VP8SetIntra16Mode(it, 0);  // default: Intra16, DC_PRED
   VP8SetSkip(it, 0);         // not skipped
   VP8SetSegment(it, 0);      // default segment, spec-wise.
 
-  if (enc->method <= 1) {
-    best_alpha = FastMBAnalyze(it);
+  if (cached != NULL && cached->valid && cached->hash == hash) {
+    ReplayMBAnalysis(it, cached);
+    best_alpha = cached->alpha;
+    best_uv_alpha = cached->uv_alpha;
   } else {
-    best_alpha = MBAnalyzeBestIntra16Mode(it);
-  }
-  best_uv_alpha = MBAnalyzeBestUVMode(it);
+    if (enc->method <= 1) {
+      best_alpha = FastMBAnalyze(it);
+    } else {
+      best_alpha = MBAnalyzeBestIntra16Mode(it);
+    }
+    best_uv_alpha = MBAnalyzeBestUVMode(it);
 
-  // Final susceptibility mix
-  best_alpha = (3 * best_alpha + best_uv_alpha + 2) >> 2;
-  best_alpha = FinalAlphaValue(best_alpha);
+    // Final susceptibility mix
+    best_alpha = (3 * best_alpha + best_uv_alpha + 2) >> 2;
+    best_alpha = FinalAlphaValue(best_alpha);
+    if (cached != NULL) {
+      RecordMBAnalysis(it, hash, best_alpha, best_uv_alpha, cached);
+    }
+  }
   alphas[best_alpha]++;
   it->mb->alpha = best_alpha;   // for later remapping.
 
@@ -370,56 +512,56 @@ static void ResetAllMBInfo(VP8Encoder* const enc) {
 
 // struct used to collect job result
 typedef struct {
-  WebPWorker worker;
   int alphas[MAX_ALPHA + 1];
   int alpha, uv_alpha;
   VP8EncIterator it;
   int delta_progress;
+  MBAnalysis* cached;   // analysis of the previous picture, or NULL
 } SegmentJob;
 
 // main work call
-static int DoSegmentsJob(void* arg1, void* arg2) {
+static int DoSegmentsJob(void* arg1, void* unused) {
   SegmentJob* const job = (SegmentJob*)arg1;
-  VP8EncIterator* const it = (VP8EncIterator*)arg2;
+  VP8EncIterator* const it = &job->it;
   int ok = 1;
+  (void)unused;
   if (!VP8IteratorIsDone(it)) {
     uint8_t tmp[32 + WEBP_ALIGN_CST];
     uint8_t* const scratch = (uint8_t*)WEBP_ALIGN(tmp);
     do {
       // Let's pretend we have perfect lossless reconstruction.
+      MBAnalysis* const cached =
+          (job->cached != NULL) ? &job->cached[it->x + it->y * it->enc->mb_w]
+                                : NULL;
       VP8IteratorImport(it, scratch);
-      MBAnalyze(it, job->alphas, &job->alpha, &job->uv_alpha);
+      MBAnalyze(it, job->alphas, &job->alpha, &job->uv_alpha, cached);
       ok = VP8IteratorProgress(it, job->delta_progress);
     } while (ok && VP8IteratorNext(it));
   }
   return ok;
 }
 
-#ifdef WEBP_USE_THREAD
 static void MergeJobs(const SegmentJob* const src, SegmentJob* const dst) {
   int i;
   for (i = 0; i <= MAX_ALPHA; ++i) dst->alphas[i] += src->alphas[i];
   dst->alpha += src->alpha;
   dst->uv_alpha += src->uv_alpha;
 }
-#endif
 
 // initialize the job struct with some tasks to perform
 static void InitSegmentJob(VP8Encoder* const enc, SegmentJob* const job,
                            int start_row, int end_row) {
-  WebPGetWorkerInterface()->Init(&job->worker);
-  job->worker.data1 = job;
-  job->worker.data2 = &job->it;
-  job->worker.hook = DoSegmentsJob;
   VP8IteratorInit(enc, &job->it);
   VP8IteratorSetRow(&job->it, start_row);
   VP8IteratorSetCountDown(&job->it, (end_row - start_row) * enc->mb_w);
   memset(job->alphas, 0, sizeof(job->alphas));
   job->alpha = 0;
   job->uv_alpha = 0;
-  // only one of both jobs can record the progress, since we don't
+  // only the first job can record the progress, since we don't
   // expect the user's hook to be multi-thread safe
   job->delta_progress = (start_row == 0) ? 20 : 0;
+  job->cached = (enc->pic->analysis_cache != NULL)
+              ? enc->pic->analysis_cache->mbs : NULL;
 }
 
 // main entry point
@@ -432,49 +574,34 @@ int VP8EncAnalyze(VP8Encoder* const enc) {
   if (do_segments) {
     const int last_row = enc->mb_h;
     const int total_mb = last_row * enc->mb_w;
-#ifdef WEBP_USE_THREAD
-    // We give a little more than a half work to the main thread.
-    const int split_row = (9 * last_row + 15) >> 4;
-    const int kMinSplitRow = 2;  // minimal rows needed for mt to be worth it
-    const int do_mt = (enc->thread_level > 0) && (split_row >= kMinSplitRow);
-#else
-    const int do_mt = 0;
-#endif
-    const WebPWorkerInterface* const worker_interface =
-        WebPGetWorkerInterface();
-    SegmentJob main_job;
-    if (do_mt) {
-#ifdef WEBP_USE_THREAD
-      SegmentJob side_job;
-      // Note the use of '&' instead of '&&' because we must call the functions
-      // no matter what.
-      InitSegmentJob(enc, &main_job, 0, split_row);
-      InitSegmentJob(enc, &side_job, split_row, last_row);
-      // we don't need to call Reset() on main_job.worker, since we're calling
-      // WebPWorkerExecute() on it
-      ok &= worker_interface->Reset(&side_job.worker);
-      // launch the two jobs in parallel
-      if (ok) {
-        worker_interface->Launch(&side_job.worker);
-        worker_interface->Execute(&main_job.worker);
-        ok &= worker_interface->Sync(&side_job.worker);
-        ok &= worker_interface->Sync(&main_job.worker);
-      }
-      worker_interface->End(&side_job.worker);
-      if (ok) MergeJobs(&side_job, &main_job);  // merge results together
-#endif  // WEBP_USE_THREAD
-    } else {
-      // Even for single-thread case, we use the generic Worker tools.
-      InitSegmentJob(enc, &main_job, 0, last_row);
-      worker_interface->Execute(&main_job.worker);
-      ok &= worker_interface->Sync(&main_job.worker);
+    const int kMinJobRows = 2;  // minimal rows for a job to be worth a thread
+    int num_jobs = WebPWorkerPoolSize(&enc->pool);
+    SegmentJob* jobs;
+    int i;
+    if (num_jobs > last_row / kMinJobRows) num_jobs = last_row / kMinJobRows;
+    if (num_jobs < 1) num_jobs = 1;
+    if (enc->pic->analysis_cache != NULL &&
+        !PrepareCache(enc, enc->pic->analysis_cache)) {
+      return WebPEncodingSetError(enc->pic, VP8_ENC_ERROR_OUT_OF_MEMORY);
+    }
+    jobs = (SegmentJob*)WebPSafeMalloc(num_jobs, sizeof(*jobs));
+    if (jobs == NULL) {
+      return WebPEncodingSetError(enc->pic, VP8_ENC_ERROR_OUT_OF_MEMORY);
+    }
+    // One band of rows per thread, the first one on the calling thread.
+    for (i = 0; i < num_jobs; ++i) {
+      InitSegmentJob(enc, &jobs[i], i * last_row / num_jobs,
+                     (i + 1) * last_row / num_jobs);
     }
-    worker_interface->End(&main_job.worker);
+    ok = WebPWorkerPoolRun(&enc->pool, DoSegmentsJob, jobs, sizeof(*jobs),
+                           num_jobs, NULL);
     if (ok) {
-      enc->alpha = main_job.alpha / total_mb;
-      enc->uv_alpha = main_job.uv_alpha / total_mb;
-      AssignSegments(enc, main_job.alphas);
+      for (i = 1; i < num_jobs; ++i) MergeJobs(&jobs[i], &jobs[0]);
+      enc->alpha = jobs[0].alpha / total_mb;
+      enc->uv_alpha = jobs[0].uv_alpha / total_mb;
+      AssignSegments(enc, jobs[0].alphas, enc->pic->analysis_cache);
     }
+    WebPSafeFree(jobs);
   } else {   // Use only one default segment.
     ResetAllMBInfo(enc);
   }
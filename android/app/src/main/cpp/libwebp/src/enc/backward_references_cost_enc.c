@@ -20,6 +20,7 @@
 #include "src/dsp/lossless_common.h"
 #include "src/enc/backward_references_enc.h"
 #include "src/enc/histogram_enc.h"
+#include "src/enc/scratch_enc.h"
 #include "src/utils/color_cache_utils.h"
 #include "src/utils/utils.h"
 #include "src/webp/format_constants.h"
@@ -189,6 +190,7 @@ typedef struct {
   int64_t cost_cache[MAX_LENGTH];
   int64_t* costs;
   uint16_t* dist_array;
+  WebPEncoderScratch* scratch;  // holds 'costs' if not NULL
   // Most of the time, we only need few intervals -> use a free-list, to avoid
   // fragmentation with small allocs in most common cases.
   CostInterval intervals[COST_MANAGER_MAX_FREE_LIST];
@@ -232,7 +234,7 @@ static void DeleteIntervalList(CostManager* const manager,
 static void CostManagerClear(CostManager* const manager) {
   if (manager == NULL) return;
 
-  WebPSafeFree(manager->costs);
+  WebPScratchFree(manager->scratch, WEBP_SCRATCH_COSTS, manager->costs);
   WebPSafeFree(manager->cache_intervals);
 
   // Clear the interval lists.
@@ -248,7 +250,8 @@ static void CostManagerClear(CostManager* const manager) {
 
 static int CostManagerInit(CostManager* const manager,
                            uint16_t* const dist_array, int pix_count,
-                           const CostModel* const cost_model) {
+                           const CostModel* const cost_model,
+                           WebPEncoderScratch* const scratch) {
   int i;
   const int cost_cache_size = (pix_count > MAX_LENGTH) ? MAX_LENGTH : pix_count;
 
@@ -258,6 +261,7 @@ static int CostManagerInit(CostManager* const manager,
   manager->recycled_intervals = NULL;
   manager->count = 0;
   manager->dist_array = dist_array;
+  manager->scratch = scratch;
   CostManagerInitFreeList(manager);
 
   // Fill in the 'cost_cache'.
@@ -309,8 +313,8 @@ static int CostManagerInit(CostManager* const manager,
            manager->cache_intervals_size);
   }
 
-  manager->costs =
-      (int64_t*)WebPSafeMalloc(pix_count, sizeof(*manager->costs));
+  manager->costs = (int64_t*)WebPScratchAlloc(
+      scratch, WEBP_SCRATCH_COSTS, pix_count, sizeof(*manager->costs));
   if (manager->costs == NULL) {
     CostManagerClear(manager);
     return 0;
@@ -600,7 +604,8 @@ static int BackwardReferencesHashChainDistanceOnly(
     goto Error;
   }
 
-  if (!CostManagerInit(cost_manager, dist_array, pix_count, cost_model)) {
+  if (!CostManagerInit(cost_manager, dist_array, pix_count, cost_model,
+                       hash_chain->scratch)) {
     goto Error;
   }
 
@@ -774,8 +779,9 @@ int VP8LBackwardReferencesTraceBackwards(int xsize, int ysize,
   const int dist_array_size = xsize * ysize;
   uint16_t* chosen_path = NULL;
   int chosen_path_size = 0;
-  uint16_t* dist_array =
-      (uint16_t*)WebPSafeMalloc(dist_array_size, sizeof(*dist_array));
+  uint16_t* dist_array = (uint16_t*)WebPScratchAlloc(
+      hash_chain->scratch, WEBP_SCRATCH_DIST_ARRAY, dist_array_size,
+      sizeof(*dist_array));
 
   if (dist_array == NULL) goto Error;
 
@@ -791,6 +797,6 @@ int VP8LBackwardReferencesTraceBackwards(int xsize, int ysize,
   }
   ok = 1;
  Error:
-  WebPSafeFree(dist_array);
+  WebPScratchFree(hash_chain->scratch, WEBP_SCRATCH_DIST_ARRAY, dist_array);
   return ok;
 }
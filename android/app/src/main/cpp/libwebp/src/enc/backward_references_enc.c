@@ -19,6 +19,7 @@
 #include "src/dsp/lossless.h"
 #include "src/dsp/lossless_common.h"
 #include "src/enc/histogram_enc.h"
+#include "src/enc/scratch_enc.h"
 #include "src/enc/vp8i_enc.h"
 #include "src/utils/color_cache_utils.h"
 #include "src/utils/utils.h"
@@ -202,21 +203,23 @@ void VP8LBackwardRefsCursorAdd(VP8LBackwardRefs* const refs,
 // -----------------------------------------------------------------------------
 // Hash chains
 
-int VP8LHashChainInit(VP8LHashChain* const p, int size) {
+int VP8LHashChainInit(VP8LHashChain* const p, int size,
+                      WebPEncoderScratch* const scratch) {
   assert(p->size == 0);
   assert(p->offset_length == NULL);
   assert(size > 0);
-  p->offset_length =
-      (uint32_t*)WebPSafeMalloc(size, sizeof(*p->offset_length));
+  p->offset_length = (uint32_t*)WebPScratchAlloc(
+      scratch, WEBP_SCRATCH_HASH_CHAIN, size, sizeof(*p->offset_length));
   if (p->offset_length == NULL) return 0;
   p->size = size;
+  p->scratch = scratch;
 
   return 1;
 }
 
 void VP8LHashChainClear(VP8LHashChain* const p) {
   assert(p != NULL);
-  WebPSafeFree(p->offset_length);
+  WebPScratchFree(p->scratch, WEBP_SCRATCH_HASH_CHAIN, p->offset_length);
 
   p->size = 0;
   p->offset_length = NULL;
@@ -279,8 +282,9 @@ int VP8LHashChainFill(VP8LHashChain* const p, int quality,
     return 1;
   }
 
-  hash_to_first_index =
-      (int32_t*)WebPSafeMalloc(HASH_SIZE, sizeof(*hash_to_first_index));
+  hash_to_first_index = (int32_t*)WebPScratchAlloc(
+      p->scratch, WEBP_SCRATCH_HASH_TABLE, HASH_SIZE,
+      sizeof(*hash_to_first_index));
   if (hash_to_first_index == NULL) {
     return WebPEncodingSetError(pic, VP8_ENC_ERROR_OUT_OF_MEMORY);
   }
@@ -336,14 +340,15 @@ int VP8LHashChainFill(VP8LHashChain* const p, int quality,
 
     if (!WebPReportProgress(
             pic, percent_start + percent_range * pos / (size - 2), percent)) {
-      WebPSafeFree(hash_to_first_index);
+      WebPScratchFree(p->scratch, WEBP_SCRATCH_HASH_TABLE,
+                      hash_to_first_index);
       return 0;
     }
   }
   // Process the penultimate pixel.
   chain[pos] = hash_to_first_index[GetPixPairHash64(argb + pos)];
 
-  WebPSafeFree(hash_to_first_index);
+  WebPScratchFree(p->scratch, WEBP_SCRATCH_HASH_TABLE, hash_to_first_index);
 
   percent_start += percent_range;
   if (!WebPReportProgress(pic, percent_start, percent)) return 0;
@@ -944,7 +949,10 @@ static int GetBackwardReferences(int width, int height,
                                      refs_tmp);
         break;
       case kLZ77Box:
-        if (!VP8LHashChainInit(&hash_chain_box, width * height)) goto Error;
+        if (!VP8LHashChainInit(&hash_chain_box, width * height,
+                               hash_chain->scratch)) {
+          goto Error;
+        }
         res = BackwardReferencesLz77Box(width, height, argb, 0, hash_chain,
                                         &hash_chain_box, refs_tmp);
         break;
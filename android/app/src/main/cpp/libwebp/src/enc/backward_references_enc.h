@@ -131,10 +131,14 @@ struct VP8LHashChain {
   // This is the maximum size of the hash_chain that can be constructed.
   // Typically this is the pixel count (width x height) for a given image.
   int size;
+  // If not NULL, holds 'offset_length' and the temporary buffers of the
+  // backward references search.
+  WebPEncoderScratch* scratch;
 };
 
-// Must be called first, to set size.
-int VP8LHashChainInit(VP8LHashChain* const p, int size);
+// Must be called first, to set size. 'scratch' can be NULL.
+int VP8LHashChainInit(VP8LHashChain* const p, int size,
+                      WebPEncoderScratch* const scratch);
 // Pre-compute the best matches for argb. pic and percent are for progress.
 int VP8LHashChainFill(VP8LHashChain* const p, int quality,
                       const uint32_t* const argb, int xsize, int ysize,
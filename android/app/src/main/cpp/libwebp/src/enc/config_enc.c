@@ -97,6 +97,8 @@ int WebPConfigInitInternal(WebPConfig* config,
   return WebPValidateConfig(config);
 }
 
+#define MAX_THREAD_LEVEL 16  // in threads, see WebPConfig::thread_level
+
 int WebPValidateConfig(const WebPConfig* config) {
   if (config == NULL) return 0;
   if (config->quality < 0 || config->quality > 100) return 0;
@@ -124,7 +126,9 @@ int WebPValidateConfig(const WebPConfig* config) {
   if (config->near_lossless < 0 || config->near_lossless > 100) return 0;
   if (config->image_hint >= WEBP_HINT_LAST) return 0;
   if (config->emulate_jpeg_size < 0 || config->emulate_jpeg_size > 1) return 0;
-  if (config->thread_level < 0 || config->thread_level > 1) return 0;
+  if (config->thread_level < 0 || config->thread_level > MAX_THREAD_LEVEL) {
+    return 0;
+  }
   if (config->low_memory < 0 || config->low_memory > 1) return 0;
   if (config->exact < 0 || config->exact > 1) return 0;
   if (config->use_sharp_yuv < 0 || config->use_sharp_yuv > 1) return 0;
@@ -21,6 +21,8 @@
 #include "src/enc/cost_enc.h"
 #include "src/enc/vp8i_enc.h"
 #include "src/utils/bit_writer_utils.h"
+#include "src/utils/thread_utils.h"
+#include "src/utils/utils.h"
 #include "src/webp/encode.h"
 #include "src/webp/format_constants.h"  // RIFF constants
 
@@ -413,8 +415,10 @@ static void RecordResiduals(VP8EncIterator* const it,
 
 #if !defined(DISABLE_TOKEN_BUFFER)
 
+// The token statistics are recorded in 'stats' rather than in enc->proba.
 static int RecordTokens(VP8EncIterator* const it, const VP8ModeScore* const rd,
-                        VP8TBuffer* const tokens) {
+                        VP8TBuffer* const tokens,
+                        StatsArray (*const stats)[NUM_BANDS]) {
   int x, y, ch;
   VP8Residual res;
   VP8Encoder* const enc = it->enc;
@@ -423,12 +427,15 @@ static int RecordTokens(VP8EncIterator* const it, const VP8ModeScore* const rd,
   if (it->mb->type == 1) {   // i16x16
     const int ctx = it->top_nz[8] + it->left_nz[8];
     VP8InitResidual(0, 1, enc, &res);
+    res.stats = stats[1];
     VP8SetResidualCoeffs(rd->y_dc_levels, &res);
     it->top_nz[8] = it->left_nz[8] =
         VP8RecordCoeffTokens(ctx, &res, tokens);
     VP8InitResidual(1, 0, enc, &res);
+    res.stats = stats[0];
   } else {
     VP8InitResidual(0, 3, enc, &res);
+    res.stats = stats[3];
   }
 
   // luma-AC
@@ -443,6 +450,7 @@ static int RecordTokens(VP8EncIterator* const it, const VP8ModeScore* const rd,
 
   // U/V
   VP8InitResidual(0, 2, enc, &res);
+  res.stats = stats[2];
   for (ch = 0; ch <= 2; ch += 2) {
     for (y = 0; y < 2; ++y) {
       for (x = 0; x < 2; ++x) {
@@ -482,27 +490,30 @@ static void ResetSSE(VP8Encoder* const enc) {
   enc->sse_count = 0;
 }
 
-static void StoreSSE(const VP8EncIterator* const it) {
-  VP8Encoder* const enc = it->enc;
+static void StoreSSE(const VP8EncIterator* const it, uint64_t sse[3],
+                     uint64_t* const sse_count) {
   const uint8_t* const in = it->yuv_in;
   const uint8_t* const out = it->yuv_out;
   // Note: not totally accurate at boundary. And doesn't include in-loop filter.
-  enc->sse[0] += VP8SSE16x16(in + Y_OFF_ENC, out + Y_OFF_ENC);
-  enc->sse[1] += VP8SSE8x8(in + U_OFF_ENC, out + U_OFF_ENC);
-  enc->sse[2] += VP8SSE8x8(in + V_OFF_ENC, out + V_OFF_ENC);
-  enc->sse_count += 16 * 16;
+  sse[0] += VP8SSE16x16(in + Y_OFF_ENC, out + Y_OFF_ENC);
+  sse[1] += VP8SSE8x8(in + U_OFF_ENC, out + U_OFF_ENC);
+  sse[2] += VP8SSE8x8(in + V_OFF_ENC, out + V_OFF_ENC);
+  *sse_count += 16 * 16;
 }
 
-static void StoreSideInfo(const VP8EncIterator* const it) {
+// The statistics are added to 'sse', 'sse_count' and 'block_count', which are
+// the ones of 'enc' unless several rows are encoded at once.
+static void StoreSideInfo(const VP8EncIterator* const it, uint64_t sse[3],
+                          uint64_t* const sse_count, int block_count[3]) {
   VP8Encoder* const enc = it->enc;
   const VP8MBInfo* const mb = it->mb;
   WebPPicture* const pic = enc->pic;
 
   if (pic->stats != NULL) {
-    StoreSSE(it);
-    enc->block_count[0] += (mb->type == 0);
-    enc->block_count[1] += (mb->type == 1);
-    enc->block_count[2] += (mb->skip != 0);
+    StoreSSE(it, sse, sse_count);
+    block_count[0] += (mb->type == 0);
+    block_count[1] += (mb->type == 1);
+    block_count[2] += (mb->skip != 0);
   }
 
   if (pic->extra_info != NULL) {
@@ -540,9 +551,13 @@ static void ResetSideInfo(const VP8EncIterator* const it) {
 static void ResetSSE(VP8Encoder* const enc) {
   (void)enc;
 }
-static void StoreSideInfo(const VP8EncIterator* const it) {
+static void StoreSideInfo(const VP8EncIterator* const it, uint64_t sse[3],
+                          uint64_t* const sse_count, int block_count[3]) {
   VP8Encoder* const enc = it->enc;
   WebPPicture* const pic = enc->pic;
+  (void)sse;
+  (void)sse_count;
+  (void)block_count;
   if (pic->extra_info != NULL) {
     if (it->x == 0 && it->y == 0) {   // only do it once, at start
       memset(pic->extra_info, 0,
@@ -616,6 +631,207 @@ static uint64_t OneStatPass(VP8Encoder* const enc, VP8RDLevel rd_opt,
   return size_p0;
 }
 
+//------------------------------------------------------------------------------
+// Parallel search of 'q' for target_size / target_PSNR.
+//
+// With a thread_level of 2 or more, each round of the search runs passes at
+// several values of 'q' spread over the current bracket, each pass on its own
+// copy of the encoder. The bracket narrows around the target at each round,
+// and 'q' is finally interpolated between the closest passes. One round takes
+// one of the config->pass passes. The encoder starts each round with the
+// probabilities of the probe closest to the target, as the passes of the
+// serial search do, and the last two passes are left to the serial search.
+
+#define MAX_Q_PROBES 8   // maximum number of 'q' values tried at once
+
+typedef struct QProbe QProbe;
+// Runs a pass at probe->stats.q and sets probe->stats.value.
+typedef int (*QProbePass)(QProbe* const probe);
+
+struct QProbe {
+  VP8Encoder enc;       // copy of the encoder, with the buffers below
+  WebPPicture pic;      // copy of the picture, without stats nor progress hook
+  VP8TBuffer tokens;
+  PassStats stats;
+  QProbePass pass;
+  uint8_t* mem;         // buffers of 'enc'
+  VP8MBInfo* mb_info;
+  uint8_t* preds;       // including the borders
+  uint32_t* nz;
+  uint8_t* y_top;
+  DError* top_derr;
+};
+
+static size_t PredsSize(const VP8Encoder* const enc) {
+  return enc->preds_w * (4 * enc->mb_h + 1) * sizeof(*enc->preds);
+}
+
+static int InitQProbe(const VP8Encoder* const enc, QProbe* const probe,
+                      QProbePass pass) {
+  const size_t info_size = enc->mb_w * enc->mb_h * sizeof(*enc->mb_info);
+  const size_t nz_size = (enc->mb_w + 1) * sizeof(*enc->nz) + WEBP_ALIGN_CST;
+  const size_t samples_size = 2 * enc->mb_w * 16 * sizeof(*enc->y_top)
+                            + WEBP_ALIGN_CST;
+  const size_t top_derr_size = enc->mb_w * sizeof(*enc->top_derr);
+  uint8_t* mem;
+  probe->pass = pass;
+  VP8TBufferInit(&probe->tokens, enc->tokens.page_size, NULL);
+  probe->mem = (uint8_t*)WebPSafeMalloc(1ULL, info_size + PredsSize(enc) +
+                                        nz_size + samples_size +
+                                        top_derr_size);
+  if (probe->mem == NULL) return 0;
+  mem = probe->mem;
+  probe->mb_info = (VP8MBInfo*)mem;
+  mem += info_size;
+  probe->preds = mem;
+  mem += PredsSize(enc);
+  probe->nz = 1 + (uint32_t*)WEBP_ALIGN(mem);
+  probe->nz[-1] = 0;   // constant, as set by ResetBoundaryPredictions()
+  mem += nz_size;
+  probe->y_top = (uint8_t*)WEBP_ALIGN(mem);
+  mem += samples_size;
+  probe->top_derr = (DError*)mem;
+  return 1;
+}
+
+static void ClearQProbe(QProbe* const probe) {
+  VP8TBufferClear(&probe->tokens);
+  WebPSafeFree(probe->mem);
+}
+
+// Copies the state of 'enc' into the probe.
+static void StartQProbe(QProbe* const probe, const VP8Encoder* const enc) {
+  VP8Encoder* const copy = &probe->enc;
+  *copy = *enc;
+  probe->pic = *enc->pic;
+  probe->pic.stats = NULL;
+  probe->pic.extra_info = NULL;
+  probe->pic.progress_hook = NULL;
+  probe->pic.scratch = NULL;
+  copy->pic = &probe->pic;
+  copy->mb_info = probe->mb_info;
+  memcpy(copy->mb_info, enc->mb_info,
+         enc->mb_w * enc->mb_h * sizeof(*enc->mb_info));
+  memcpy(probe->preds, enc->preds - 1 - enc->preds_w, PredsSize(enc));
+  copy->preds = probe->preds + 1 + enc->preds_w;
+  copy->nz = probe->nz;
+  copy->y_top = probe->y_top;
+  copy->uv_top = probe->y_top + enc->mb_w * 16;
+  copy->top_derr = (enc->top_derr != NULL) ? probe->top_derr : NULL;
+  copy->lf_stats = NULL;
+  copy->thread_level = 0;   // the copy doesn't use the pool
+  copy->num_threads = 1;
+  // Only marks the cost tables for rebuilding: ResetStats() rebuilds them
+  // with VP8CalculateLevelCosts(), which points 'remapped_costs' at the copy.
+  copy->proba.dirty = 1;
+}
+
+// Takes the probabilities and token statistics of 'probe' for the next pass.
+static void CarryProbas(VP8Encoder* const enc, const QProbe* const probe) {
+  enc->proba = probe->enc.proba;
+  enc->proba.dirty = 1;
+  VP8CalculateLevelCosts(&enc->proba);   // stop pointing into the probe
+}
+
+static int QProbeJob(void* arg1, void* arg2) {
+  QProbe* const probe = (QProbe*)arg1;
+  StartQProbe(probe, (const VP8Encoder*)arg2);
+  return probe->pass(probe);
+}
+
+// Returns the 'q' at which the line through 'a' and 'b' reaches the target.
+static float InterpolateQ(const PassStats* const a, const PassStats* const b) {
+  if (a->value == b->value) return b->q;
+  return (float)(a->q + (a->target - a->value) * (b->q - a->q) /
+                        (b->value - a->value));
+}
+
+// Searches 'q' with probes, and leaves two passes or more to do from s->q.
+// Returns false if the probes couldn't run, in which case 's' is unchanged.
+static int ProbeQ(VP8Encoder* const enc, PassStats* const s,
+                  int* const num_pass_left, QProbePass pass) {
+  const int num_probes =
+      (enc->num_threads < MAX_Q_PROBES) ? enc->num_threads : MAX_Q_PROBES;
+  PassStats lo = *s, hi = *s;   // bracket, with values once probed
+  int has_lo = 0, has_hi = 0;
+  int num_rounds = 0;
+  int ok = 1;
+  QProbe* probes;
+  int i;
+
+  probes = (QProbe*)WebPSafeCalloc(num_probes, sizeof(*probes));
+  if (probes == NULL) return 0;
+  for (i = 0; ok && i < num_probes; ++i) {
+    ok = InitQProbe(enc, &probes[i], pass);
+  }
+  lo.q = s->qmin;
+  hi.q = s->qmax;
+  while (ok && num_rounds < *num_pass_left - 2 && hi.q - lo.q > 2 * DQ_LIMIT) {
+    for (i = 0; i < num_probes; ++i) {
+      probes[i].stats = *s;
+      probes[i].stats.q = lo.q + (hi.q - lo.q) * (i + 1) / (num_probes + 1);
+    }
+    ok = WebPWorkerPoolRun(&enc->pool, QProbeJob, probes, sizeof(*probes),
+                           num_probes, enc);
+    if (!ok) break;
+    ++num_rounds;
+    // The values grow with 'q': the target is before the first probe above.
+    // The passes of the previous rounds had other probabilities, so an end of
+    // the bracket not probed in this round goes back to the limit.
+    for (i = 0; i < num_probes && probes[i].stats.value < s->target; ++i) {}
+    has_lo = (i > 0);
+    has_hi = (i < num_probes);
+    if (has_lo) {
+      lo = probes[i - 1].stats;
+    } else {
+      lo.q = s->qmin;
+    }
+    if (has_hi) {
+      hi = probes[i].stats;
+    } else {
+      hi.q = s->qmax;
+    }
+    if (i == num_probes || (i > 0 && s->target - probes[i - 1].stats.value <
+                                     probes[i].stats.value - s->target)) {
+      --i;
+    }
+    CarryProbas(enc, &probes[i]);
+  }
+  if (ok && num_rounds > 0) {
+    float q;
+    if (has_lo && has_hi) {
+      q = InterpolateQ(&lo, &hi);
+    } else if (has_hi) {   // below the first probes: extrapolate
+      q = InterpolateQ(&probes[0].stats, &probes[1].stats);
+    } else {               // above the last probes
+      q = InterpolateQ(&probes[num_probes - 2].stats,
+                       &probes[num_probes - 1].stats);
+    }
+    s->q = Clamp(q, lo.q, hi.q);
+    // The serial search goes on from the end of the bracket farthest from
+    // 's->q', which gives the better conditioned slope for its next step.
+    if (has_lo && (!has_hi || s->q - lo.q > hi.q - s->q)) {
+      s->last_q = lo.q;
+      s->last_value = lo.value;
+    } else {
+      s->last_q = hi.q;
+      s->last_value = hi.value;
+    }
+    s->is_first = 0;
+    s->dq = 2 * DQ_LIMIT;   // so that the next pass isn't the last one
+    *num_pass_left -= num_rounds;
+  }
+  for (i = 0; i < num_probes; ++i) ClearQProbe(&probes[i]);
+  WebPSafeFree(probes);
+  return ok && num_rounds > 0;
+}
+
+static int StatProbePass(QProbe* const probe) {
+  VP8Encoder* const enc = &probe->enc;
+  OneStatPass(enc, RD_OPT_BASIC, enc->mb_w * enc->mb_h, 0, &probe->stats);
+  return 1;
+}
+
 static int StatLoop(VP8Encoder* const enc) {
   const int method = enc->method;
   const int do_search = enc->do_search;
@@ -632,6 +848,9 @@ static int StatLoop(VP8Encoder* const enc) {
 
   InitPassStats(enc, &stats);
   ResetTokenStats(enc);
+  if (do_search && enc->thread_level >= 2 && num_pass_left > 2) {
+    ProbeQ(enc, &stats, &num_pass_left, StatProbePass);
+  }
 
   // Fast mode: quick analysis pass over few mbs. Better than nothing.
   if (fast_probe) {
@@ -768,7 +987,7 @@ int VP8EncLoop(VP8Encoder* const enc) {
     } else {   // reset predictors after a skip
       ResetAfterSkip(&it);
     }
-    StoreSideInfo(&it);
+    StoreSideInfo(&it, enc->sse, &enc->sse_count, enc->block_count);
     VP8StoreFilterStats(&it);
     VP8IteratorExport(&it);
     ok = VP8IteratorProgress(&it, 20);
@@ -784,31 +1003,345 @@ int VP8EncLoop(VP8Encoder* const enc) {
 #if !defined(DISABLE_TOKEN_BUFFER)
 
 #define MIN_COUNT 96  // minimum number of macroblocks before updating stats
+#define MIN_WAVEFRONT_ROWS 8  // minimum number of rows encoded at once
+
+// Wavefront: with a thread_level of 2 or more, the macroblock rows are encoded
+// in parallel, each one staying two macroblocks behind the row above so that
+// its top and top-right neighbours are done. The cost tables are refreshed
+// between groups of rows instead of every 'max_count' macroblocks, and the
+// per-row statistics are merged in row order, so that the output doesn't
+// depend on the number of threads.
+
+typedef struct {   // statistics of a row, merged once its group is done
+  StatsArray stats[NUM_TYPES][NUM_BANDS];
+  LFStats lf_stats;
+  int max_edge[NUM_MB_SEGMENTS];
+  uint64_t sse[3];
+  uint64_t sse_count;
+  int block_count[3];
+  uint64_t size_p0;
+  uint64_t distortion;
+} WavefrontRow;
+
+typedef struct {
+  VP8Encoder* enc;
+  VP8EncIterator* its;     // one iterator per job
+  int num_jobs;
+  VP8TBuffer* tokens;      // one token buffer per row, emitted in order
+  WavefrontRow* rows;      // statistics of the rows of the current group
+  int group_rows;          // maximum number of rows in a group
+  int first_row;           // first row of the current group
+  int num_rows;            // number of rows in the current group
+  int is_last_pass;
+  WebPCounters counters;   // #0: next row to encode, #1+i: MBs done in row i
+} Wavefront;
+
+static void WavefrontClear(Wavefront* const wf) {
+  if (wf != NULL) {
+    int y;
+    if (wf->tokens != NULL) {
+      for (y = 0; y < wf->enc->mb_h; ++y) VP8TBufferClear(&wf->tokens[y]);
+    }
+    WebPSafeFree(wf->tokens);
+    WebPSafeFree(wf->rows);
+    WebPSafeFree(wf->its);
+    WebPCountersEnd(&wf->counters);
+  }
+}
+
+static int WavefrontInit(VP8Encoder* const enc, int max_count,
+                         Wavefront* const wf) {
+  int y;
+  memset(wf, 0, sizeof(*wf));
+  wf->enc = enc;
+  wf->group_rows = (max_count + enc->mb_w - 1) / enc->mb_w;
+  if (wf->group_rows < MIN_WAVEFRONT_ROWS) wf->group_rows = MIN_WAVEFRONT_ROWS;
+  if (wf->group_rows > enc->mb_h) wf->group_rows = enc->mb_h;
+  wf->num_jobs = WebPWorkerPoolSize(&enc->pool);
+  if (wf->num_jobs > wf->group_rows) wf->num_jobs = wf->group_rows;
+  wf->its = (VP8EncIterator*)WebPSafeMalloc(wf->num_jobs, sizeof(*wf->its));
+  wf->rows = (WavefrontRow*)WebPSafeMalloc(wf->group_rows, sizeof(*wf->rows));
+  wf->tokens = (VP8TBuffer*)WebPSafeMalloc(enc->mb_h, sizeof(*wf->tokens));
+  if (wf->its == NULL || wf->rows == NULL || wf->tokens == NULL) return 0;
+  // The pages of the scratch can't be shared by the threads.
+  for (y = 0; y < enc->mb_h; ++y) {
+    VP8TBufferInit(&wf->tokens[y], enc->tokens.page_size / enc->mb_h, NULL);
+  }
+  return WebPCountersInit(&wf->counters, 1 + wf->group_rows);
+}
+
+// Encodes the row 'i' of the current group.
+static int WavefrontEncodeRow(VP8EncIterator* const it, Wavefront* const wf,
+                              int i) {
+  VP8Encoder* const enc = wf->enc;
+  WavefrontRow* const row = &wf->rows[i];
+  VP8TBuffer* const tokens = &wf->tokens[wf->first_row + i];
+  int ok = 1;
+  VP8IteratorSetRow(it, wf->first_row + i);
+  VP8IteratorSetCountDown(it, enc->mb_w);
+  it->lf_stats = (enc->lf_stats != NULL) ? &row->lf_stats : NULL;
+  it->max_edge = row->max_edge;
+  do {
+    VP8ModeScore info;
+    if (i > 0) {   // the first row of a group follows a finished one
+      const int x_above = (it->x + 2 < enc->mb_w) ? it->x + 2 : enc->mb_w;
+      WebPCountersWait(&wf->counters, 1 + (i - 1), x_above);
+    }
+    VP8IteratorImport(it, NULL);
+    VP8Decimate(it, &info, enc->rd_opt_level);
+    ok = RecordTokens(it, &info, tokens, row->stats);
+    if (!ok) break;
+    row->size_p0 += info.H;
+    row->distortion += info.D;
+    if (wf->is_last_pass) {
+      StoreSideInfo(it, row->sse, &row->sse_count, row->block_count);
+      VP8StoreFilterStats(it);
+      VP8IteratorExport(it);
+    }
+    VP8IteratorSaveBoundary(it);
+    WebPCountersAdd(&wf->counters, 1 + i, 1);
+  } while (VP8IteratorNext(it));
+  if (!ok) {   // don't leave the row below waiting
+    WebPCountersAdd(&wf->counters, 1 + i, enc->mb_w);
+  }
+  return ok;
+}
+
+static int WavefrontJob(void* arg1, void* arg2) {
+  VP8EncIterator* const it = (VP8EncIterator*)arg1;
+  Wavefront* const wf = (Wavefront*)arg2;
+  // The rows are taken in order by whichever job is free.
+  int i;
+  while ((i = WebPCountersAdd(&wf->counters, 0, 1)) < wf->num_rows) {
+    if (!WavefrontEncodeRow(it, wf, i)) return 0;
+  }
+  return 1;
+}
+
+static void MergeTokenStats(VP8EncProba* const proba,
+                            const WavefrontRow* const row) {
+  proba_t* const dst = &proba->stats[0][0][0][0];
+  const proba_t* const src = &row->stats[0][0][0][0];
+  const size_t size = sizeof(proba->stats) / sizeof(*dst);
+  size_t n;
+  for (n = 0; n < size; ++n) {
+    uint32_t nb = (dst[n] & 0xffffu) + (src[n] & 0xffffu);
+    uint32_t total = (dst[n] >> 16) + (src[n] >> 16);
+    while (total > 0xfffeu) {   // same saturation as VP8RecordStats()
+      nb = (nb + 1u) >> 1;
+      total = (total + 1u) >> 1;
+    }
+    dst[n] = (total << 16) | nb;
+  }
+}
+
+static void MergeRow(VP8Encoder* const enc, const WavefrontRow* const row,
+                     uint64_t* const size_p0, uint64_t* const distortion) {
+  int s;
+  MergeTokenStats(&enc->proba, row);
+  *size_p0 += row->size_p0;
+  *distortion += row->distortion;
+  for (s = 0; s < NUM_MB_SEGMENTS; ++s) {
+    if (row->max_edge[s] > enc->dqm[s].max_edge) {
+      enc->dqm[s].max_edge = row->max_edge[s];
+    }
+  }
+  if (enc->lf_stats != NULL) {
+    int i;
+    for (s = 0; s < NUM_MB_SEGMENTS; ++s) {
+      for (i = 0; i < MAX_LF_LEVELS; ++i) {
+        (*enc->lf_stats)[s][i] += row->lf_stats[s][i];
+      }
+    }
+  }
+#if !defined(WEBP_DISABLE_STATS)
+  enc->sse[0] += row->sse[0];
+  enc->sse[1] += row->sse[1];
+  enc->sse[2] += row->sse[2];
+  enc->sse_count += row->sse_count;
+  enc->block_count[0] += row->block_count[0];
+  enc->block_count[1] += row->block_count[1];
+  enc->block_count[2] += row->block_count[2];
+#endif
+}
+
+// Same as the macroblock loop of VP8EncTokenLoop(), for a wavefront.
+static int WavefrontPass(Wavefront* const wf, VP8EncIterator* const it,
+                         int is_last_pass, int pass_progress,
+                         uint64_t* const size_p0, uint64_t* const distortion) {
+  VP8Encoder* const enc = wf->enc;
+  int ok = 1;
+  int i;
+  for (i = 0; i < wf->num_jobs; ++i) VP8IteratorInit(enc, &wf->its[i]);
+  for (i = 0; i < enc->mb_h; ++i) VP8TBufferClear(&wf->tokens[i]);
+  wf->is_last_pass = is_last_pass;
+  for (wf->first_row = 0; ok && wf->first_row < enc->mb_h;
+       wf->first_row += wf->num_rows) {
+    const int rows_left = enc->mb_h - wf->first_row;
+    int num_jobs;
+    wf->num_rows = (rows_left < wf->group_rows) ? rows_left : wf->group_rows;
+    num_jobs = (wf->num_jobs < wf->num_rows) ? wf->num_jobs : wf->num_rows;
+    if (wf->first_row > 0) {
+      FinalizeTokenProbas(&enc->proba);
+      VP8CalculateLevelCosts(&enc->proba);  // refresh cost tables for rd-opt
+    }
+    memset(wf->rows, 0, wf->num_rows * sizeof(*wf->rows));
+    WebPCountersReset(&wf->counters);
+    ok = WebPWorkerPoolRun(&enc->pool, WavefrontJob, wf->its,
+                           sizeof(*wf->its), num_jobs, wf);
+    if (!ok) {
+      return WebPEncodingSetError(enc->pic, VP8_ENC_ERROR_OUT_OF_MEMORY);
+    }
+    for (i = 0; i < wf->num_rows; ++i) {
+      MergeRow(enc, &wf->rows[i], size_p0, distortion);
+    }
+    if (is_last_pass) {
+      it->count_down -= wf->num_rows * enc->mb_w;
+      ok = VP8IteratorProgress(it, pass_progress);
+    }
+  }
+  return ok;
+}
+
+static size_t WavefrontTokenSize(const Wavefront* const wf) {
+  const uint8_t* const probas = (const uint8_t*)wf->enc->proba.coeffs;
+  size_t size = 0;
+  int y;
+  for (y = 0; y < wf->enc->mb_h; ++y) {
+    size += VP8EstimateTokenSize(&wf->tokens[y], probas);
+  }
+  return size;
+}
+
+static int WavefrontEmitTokens(const Wavefront* const wf) {
+  VP8Encoder* const enc = wf->enc;
+  int ok = 1;
+  int y;
+  for (y = 0; ok && y < enc->mb_h; ++y) {
+    ok = VP8EmitTokens(&wf->tokens[y], enc->parts + 0,
+                       (const uint8_t*)enc->proba.coeffs, 1);
+  }
+  return ok;
+}
+
+// Roughly refresh the proba eight times per pass
+static int GetTokenMaxCount(const VP8Encoder* const enc) {
+  const int max_count = (enc->mb_w * enc->mb_h) >> 3;
+  return (max_count < MIN_COUNT) ? MIN_COUNT : max_count;
+}
+
+// Encodes all the macroblocks into 'tokens', on the calling thread.
+static int OneTokenPass(VP8EncIterator* const it, VP8TBuffer* const tokens,
+                        int max_count, int is_last_pass, int pass_progress,
+                        uint64_t* const size_p0, uint64_t* const distortion) {
+  VP8Encoder* const enc = it->enc;
+  VP8EncProba* const proba = &enc->proba;
+  const VP8RDLevel rd_opt = enc->rd_opt_level;
+  int cnt = max_count;
+  int ok = 1;
+  VP8TBufferClear(tokens);
+  do {
+    VP8ModeScore info;
+    VP8IteratorImport(it, NULL);
+    if (--cnt < 0) {
+      FinalizeTokenProbas(proba);
+      VP8CalculateLevelCosts(proba);  // refresh cost tables for rd-opt
+      cnt = max_count;
+    }
+    VP8Decimate(it, &info, rd_opt);
+    ok = RecordTokens(it, &info, tokens, proba->stats);
+    if (!ok) {
+      return WebPEncodingSetError(enc->pic, VP8_ENC_ERROR_OUT_OF_MEMORY);
+    }
+    *size_p0 += info.H;
+    *distortion += info.D;
+    if (is_last_pass) {
+      StoreSideInfo(it, enc->sse, &enc->sse_count, enc->block_count);
+      VP8StoreFilterStats(it);
+      VP8IteratorExport(it);
+      ok = VP8IteratorProgress(it, pass_progress);
+    }
+    VP8IteratorSaveBoundary(it);
+  } while (ok && VP8IteratorNext(it));
+  return ok;
+}
+
+// Returns the size or PSNR of a pass, with its tokens either in 'wf' (if not
+// NULL) or in 'tokens'.
+static double GetTokenPassValue(VP8Encoder* const enc,
+                                const Wavefront* const wf,
+                                VP8TBuffer* const tokens,
+                                const PassStats* const s,
+                                uint64_t size_p0, uint64_t distortion) {
+  if (s->do_size_search) {
+    uint64_t size = FinalizeTokenProbas(&enc->proba);
+    if (wf != NULL) {
+      size += WavefrontTokenSize(wf);
+    } else {
+      size += VP8EstimateTokenSize(tokens,
+                                   (const uint8_t*)enc->proba.coeffs);
+    }
+    size = (size + size_p0 + 1024) >> 11;  // -> size in bytes
+    size += HEADER_SIZE_ESTIMATE;
+    return (double)size;
+  } else {  // compute and store PSNR
+    const uint64_t pixel_count = (uint64_t)enc->mb_w * enc->mb_h * 384;
+    return GetPSNR(distortion, pixel_count);
+  }
+}
+
+static int TokenProbePass(QProbe* const probe) {
+  VP8Encoder* const enc = &probe->enc;
+  VP8EncIterator it;
+  uint64_t size_p0 = 0;
+  uint64_t distortion = 0;
+  VP8IteratorInit(enc, &it);
+  SetLoopParams(enc, probe->stats.q);
+  if (!OneTokenPass(&it, &probe->tokens, GetTokenMaxCount(enc), 0, 0,
+                    &size_p0, &distortion)) {
+    return 0;
+  }
+  size_p0 += enc->segment_hdr.size;
+  probe->stats.value = GetTokenPassValue(enc, NULL, &probe->tokens,
+                                         &probe->stats, size_p0, distortion);
+  return 1;
+}
 
 int VP8EncTokenLoop(VP8Encoder* const enc) {
-  // Roughly refresh the proba eight times per pass
-  int max_count = (enc->mb_w * enc->mb_h) >> 3;
+  const int max_count = GetTokenMaxCount(enc);
   int num_pass_left = enc->config->pass;
   int remaining_progress = 40;  // percents
   const int do_search = enc->do_search;
   VP8EncIterator it;
   VP8EncProba* const proba = &enc->proba;
-  const VP8RDLevel rd_opt = enc->rd_opt_level;
-  const uint64_t pixel_count = (uint64_t)enc->mb_w * enc->mb_h * 384;
   PassStats stats;
+  Wavefront wavefront;
+  Wavefront* wf = NULL;
   int ok;
 
   InitPassStats(enc, &stats);
+  if (enc->thread_level >= 2) {
+    wf = &wavefront;
+    if (!WavefrontInit(enc, max_count, wf)) {
+      WavefrontClear(wf);
+      return WebPEncodingSetError(enc->pic, VP8_ENC_ERROR_OUT_OF_MEMORY);
+    }
+  }
   ok = PreLoopInitialize(enc);
-  if (!ok) return 0;
-
-  if (max_count < MIN_COUNT) max_count = MIN_COUNT;
+  if (!ok) {
+    WavefrontClear(wf);
+    return 0;
+  }
 
   assert(enc->num_parts == 1);
   assert(enc->use_tokens);
   assert(proba->use_skip_proba == 0);
-  assert(rd_opt >= RD_OPT_BASIC);   // otherwise, token-buffer won't be useful
+  // the token buffer is only useful with rd-opt
+  assert(enc->rd_opt_level >= RD_OPT_BASIC);
   assert(num_pass_left > 0);
+  if (do_search && wf != NULL && num_pass_left > 2) {
+    ProbeQ(enc, &stats, &num_pass_left, TokenProbePass);
+  }
 
   while (ok && num_pass_left-- > 0) {
     const int is_last_pass = (fabs(stats.dq) <= DQ_LIMIT) ||
@@ -816,7 +1349,6 @@ int VP8EncTokenLoop(VP8Encoder* const enc) {
                              (enc->max_i4_header_bits == 0);
     uint64_t size_p0 = 0;
     uint64_t distortion = 0;
-    int cnt = max_count;
     // The final number of passes is not trivial to know in advance.
     const int pass_progress = remaining_progress / (2 + num_pass_left);
     remaining_progress -= pass_progress;
@@ -826,44 +1358,18 @@ int VP8EncTokenLoop(VP8Encoder* const enc) {
       ResetTokenStats(enc);
       VP8InitFilter(&it);  // don't collect stats until last pass (too costly)
     }
-    VP8TBufferClear(&enc->tokens);
-    do {
-      VP8ModeScore info;
-      VP8IteratorImport(&it, NULL);
-      if (--cnt < 0) {
-        FinalizeTokenProbas(proba);
-        VP8CalculateLevelCosts(proba);  // refresh cost tables for rd-opt
-        cnt = max_count;
-      }
-      VP8Decimate(&it, &info, rd_opt);
-      ok = RecordTokens(&it, &info, &enc->tokens);
-      if (!ok) {
-        WebPEncodingSetError(enc->pic, VP8_ENC_ERROR_OUT_OF_MEMORY);
-        break;
-      }
-      size_p0 += info.H;
-      distortion += info.D;
-      if (is_last_pass) {
-        StoreSideInfo(&it);
-        VP8StoreFilterStats(&it);
-        VP8IteratorExport(&it);
-        ok = VP8IteratorProgress(&it, pass_progress);
-      }
-      VP8IteratorSaveBoundary(&it);
-    } while (ok && VP8IteratorNext(&it));
+    if (wf != NULL) {
+      ok = WavefrontPass(wf, &it, is_last_pass, pass_progress,
+                         &size_p0, &distortion);
+    } else {
+      ok = OneTokenPass(&it, &enc->tokens, max_count, is_last_pass,
+                        pass_progress, &size_p0, &distortion);
+    }
     if (!ok) break;
 
     size_p0 += enc->segment_hdr.size;
-    if (stats.do_size_search) {
-      uint64_t size = FinalizeTokenProbas(&enc->proba);
-      size += VP8EstimateTokenSize(&enc->tokens,
-                                   (const uint8_t*)proba->coeffs);
-      size = (size + size_p0 + 1024) >> 11;  // -> size in bytes
-      size += HEADER_SIZE_ESTIMATE;
-      stats.value = (double)size;
-    } else {  // compute and store PSNR
-      stats.value = GetPSNR(distortion, pixel_count);
-    }
+    stats.value = GetTokenPassValue(enc, wf, &enc->tokens, &stats,
+                                    size_p0, distortion);
 
 #if (DEBUG_SEARCH > 0)
     printf("#%2d metric:%.1lf -> %.1lf   last_q=%.2lf q=%.2lf dq=%.2lf "
@@ -890,11 +1396,13 @@ int VP8EncTokenLoop(VP8Encoder* const enc) {
     if (!stats.do_size_search) {
       FinalizeTokenProbas(&enc->proba);
     }
-    ok = VP8EmitTokens(&enc->tokens, enc->parts + 0,
-                       (const uint8_t*)proba->coeffs, 1);
+    ok = (wf != NULL) ? WavefrontEmitTokens(wf)
+                      : VP8EmitTokens(&enc->tokens, enc->parts + 0,
+                                      (const uint8_t*)proba->coeffs, 1);
   }
   ok = ok && WebPReportProgress(enc->pic, enc->percent + remaining_progress,
                                 &enc->percent);
+  WavefrontClear(wf);
   return PostLoopFinalize(&it, ok);
 }
 
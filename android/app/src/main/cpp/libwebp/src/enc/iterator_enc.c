@@ -83,6 +83,7 @@ void VP8IteratorInit(VP8Encoder* const enc, VP8EncIterator* const it) {
   it->yuv_out2 = it->yuv_out + YUV_SIZE_ENC;
   it->yuv_p    = it->yuv_out2 + YUV_SIZE_ENC;
   it->lf_stats = enc->lf_stats;
+  it->max_edge = NULL;
   it->percent0 = enc->percent;
   it->y_left = (uint8_t*)WEBP_ALIGN(it->yuv_left_mem + 1);
   it->u_left = it->y_left + 16 + 16;
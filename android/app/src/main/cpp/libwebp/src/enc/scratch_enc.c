@@ -0,0 +1,157 @@
+// Copyright 2026 Google Inc. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the COPYING file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS. All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+// -----------------------------------------------------------------------------
+//
+// Encoder scratch memory kept alive across WebPEncode() calls.
+
+#include <assert.h>
+
+#include "src/enc/scratch_enc.h"
+#include "src/utils/utils.h"
+#include "src/webp/encode.h"
+#include "src/webp/types.h"
+
+typedef struct {
+  void* mem;     // block owned by the slot, or NULL
+  size_t size;   // size of 'mem' in bytes
+  int in_use;    // true while the block is handed out
+} ScratchBlock;
+
+struct WebPEncoderScratch {
+  ScratchBlock blocks[WEBP_SCRATCH_NUM_SLOTS];
+  void* pages;         // free pages, linked through their first word
+  size_t page_size;    // size of the pooled pages in bytes
+  WebPWorkerPool pools[WEBP_SCRATCH_NUM_POOLS];  // idle threads
+};
+
+WebPEncoderScratch* WebPEncoderScratchNew(void) {
+  return (WebPEncoderScratch*)WebPSafeCalloc(1ULL, sizeof(WebPEncoderScratch));
+}
+
+static void FreePages(WebPEncoderScratch* const scratch) {
+  while (scratch->pages != NULL) {
+    void* const next = *(void**)scratch->pages;
+    WebPSafeFree(scratch->pages);
+    scratch->pages = next;
+  }
+}
+
+void WebPEncoderScratchDelete(WebPEncoderScratch* scratch) {
+  if (scratch != NULL) {
+    int i;
+    for (i = 0; i < WEBP_SCRATCH_NUM_SLOTS; ++i) {
+      assert(!scratch->blocks[i].in_use);
+      WebPSafeFree(scratch->blocks[i].mem);
+    }
+    FreePages(scratch);
+    for (i = 0; i < WEBP_SCRATCH_NUM_POOLS; ++i) {
+      WebPWorkerPoolEnd(&scratch->pools[i]);
+    }
+    WebPSafeFree(scratch);
+  }
+}
+
+//------------------------------------------------------------------------------
+
+void* WebPScratchAlloc(WebPEncoderScratch* const scratch, WebPScratchSlot slot,
+                       uint64_t nmemb, size_t size) {
+  ScratchBlock* block;
+  assert(slot < WEBP_SCRATCH_NUM_SLOTS);
+  if (scratch == NULL || scratch->blocks[slot].in_use || size == 0) {
+    return WebPSafeMalloc(nmemb, size);
+  }
+  block = &scratch->blocks[slot];
+  if (nmemb > block->size / size) {
+    void* const mem = WebPSafeMalloc(nmemb, size);
+    if (mem == NULL) return NULL;
+    WebPSafeFree(block->mem);
+    block->mem = mem;
+    block->size = (size_t)nmemb * size;
+  }
+  block->in_use = 1;
+  return block->mem;
+}
+
+void WebPScratchFree(WebPEncoderScratch* const scratch, WebPScratchSlot slot,
+                     void* const ptr) {
+  assert(slot < WEBP_SCRATCH_NUM_SLOTS);
+  if (scratch != NULL && ptr != NULL && ptr == scratch->blocks[slot].mem) {
+    assert(scratch->blocks[slot].in_use);
+    scratch->blocks[slot].in_use = 0;
+  } else {
+    WebPSafeFree(ptr);
+  }
+}
+
+//------------------------------------------------------------------------------
+
+size_t WebPScratchPageSize(WebPEncoderScratch* const scratch, size_t size) {
+  assert(size >= sizeof(void*));
+  if (scratch == NULL) return size;
+  if (scratch->page_size < size) {
+    // Pages only get bigger, so that a lower quality reuses them.
+    FreePages(scratch);
+    scratch->page_size = size;
+  }
+  return scratch->page_size;
+}
+
+void* WebPScratchNewPage(WebPEncoderScratch* const scratch, size_t size) {
+  if (scratch != NULL && scratch->pages != NULL && size == scratch->page_size) {
+    void* const page = scratch->pages;
+    scratch->pages = *(void**)page;
+    return page;
+  }
+  return WebPSafeMalloc(1ULL, size);
+}
+
+void WebPScratchFreePage(WebPEncoderScratch* const scratch, void* const page,
+                         size_t size) {
+  if (scratch != NULL && page != NULL && size == scratch->page_size) {
+    *(void**)page = scratch->pages;
+    scratch->pages = page;
+  } else {
+    WebPSafeFree(page);
+  }
+}
+
+//------------------------------------------------------------------------------
+
+int WebPScratchPoolInit(WebPEncoderScratch* const scratch,
+                        WebPScratchPoolSlot slot, WebPWorkerPool* const pool,
+                        int num_threads) {
+  assert(slot < WEBP_SCRATCH_NUM_POOLS);
+  if (scratch != NULL) {
+    WebPWorkerPool* const kept = &scratch->pools[slot];
+    if (kept->num_workers > 0 && WebPWorkerPoolSize(kept) == num_threads) {
+      *pool = *kept;
+      kept->workers = NULL;
+      kept->num_workers = 0;
+      return 1;
+    }
+  }
+  if (!WebPWorkerPoolInit(pool, num_threads)) {
+    WebPWorkerPoolEnd(pool);
+    return 0;
+  }
+  return 1;
+}
+
+void WebPScratchPoolEnd(WebPEncoderScratch* const scratch,
+                        WebPScratchPoolSlot slot, WebPWorkerPool* const pool) {
+  assert(slot < WEBP_SCRATCH_NUM_POOLS);
+  if (scratch != NULL && pool->num_workers > 0) {
+    WebPWorkerPool* const kept = &scratch->pools[slot];
+    WebPWorkerPoolEnd(kept);
+    *kept = *pool;
+    pool->workers = NULL;
+    pool->num_workers = 0;
+    return;
+  }
+  WebPWorkerPoolEnd(pool);
+}
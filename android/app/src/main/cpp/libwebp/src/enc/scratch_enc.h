@@ -0,0 +1,81 @@
+// Copyright 2026 Google Inc. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the COPYING file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS. All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+// -----------------------------------------------------------------------------
+//
+// Encoder scratch memory kept alive across WebPEncode() calls.
+//
+// Each slot holds at most one block, grown on demand and handed out to one
+// user at a time. Token pages are pooled separately, and so are the threads
+// of worker pools. All functions accept a NULL scratch and then behave like
+// WebPSafeMalloc() / WebPSafeFree() / WebPWorkerPoolInit() / ...End().
+
+#ifndef WEBP_ENC_SCRATCH_ENC_H_
+#define WEBP_ENC_SCRATCH_ENC_H_
+
+#include <stddef.h>
+
+#include "src/utils/thread_utils.h"
+#include "src/webp/encode.h"
+#include "src/webp/types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+  WEBP_SCRATCH_VP8_ENCODER = 0,  // VP8Encoder and its per-macroblock arrays
+  WEBP_SCRATCH_ALPHA_PLANE,      // quantized alpha plane
+  WEBP_SCRATCH_ALPHA_FILTERED,   // filtered alpha plane
+  WEBP_SCRATCH_ALPHA_ARGB,       // alpha plane as the green of an ARGB picture
+  WEBP_SCRATCH_HASH_CHAIN,       // VP8LHashChain::offset_length
+  WEBP_SCRATCH_HASH_TABLE,       // hash heads used by VP8LHashChainFill()
+  WEBP_SCRATCH_TRANSFORM,        // VP8LEncoder::transform_mem
+  WEBP_SCRATCH_COSTS,            // CostManager::costs
+  WEBP_SCRATCH_DIST_ARRAY,       // VP8LBackwardReferencesTraceBackwards()
+  WEBP_SCRATCH_NUM_SLOTS
+} WebPScratchSlot;
+
+typedef enum {
+  WEBP_SCRATCH_POOL_VP8 = 0,     // VP8Encoder::pool
+  WEBP_SCRATCH_POOL_ALPHA,       // alpha filter trials, on the alpha thread
+  WEBP_SCRATCH_NUM_POOLS
+} WebPScratchPoolSlot;
+
+// Returns a block of at least 'nmemb * size' bytes, with undefined content.
+// If the slot is already handed out, a fresh block is allocated instead.
+void* WebPScratchAlloc(WebPEncoderScratch* const scratch, WebPScratchSlot slot,
+                       uint64_t nmemb, size_t size);
+// Gives back a block obtained from WebPScratchAlloc() for the same slot.
+void WebPScratchFree(WebPEncoderScratch* const scratch, WebPScratchSlot slot,
+                     void* const ptr);
+
+// Returns the size of the pages to use for at least 'size' bytes each. Pages
+// of another size are not pooled, so callers should use the returned size.
+size_t WebPScratchPageSize(WebPEncoderScratch* const scratch, size_t size);
+// Returns a page of 'size' bytes, recycled if possible.
+void* WebPScratchNewPage(WebPEncoderScratch* const scratch, size_t size);
+// Returns a page to the pool, or frees it if it has another size.
+void WebPScratchFreePage(WebPEncoderScratch* const scratch, void* const page,
+                         size_t size);
+
+// Same as WebPWorkerPoolInit(), but takes the threads kept in 'slot' if there
+// are as many, instead of starting new ones. In case of error, returns false
+// and leaves 'pool' with no threads.
+int WebPScratchPoolInit(WebPEncoderScratch* const scratch,
+                        WebPScratchPoolSlot slot, WebPWorkerPool* const pool,
+                        int num_threads);
+// Keeps the threads of a pool started by WebPScratchPoolInit() in 'slot' for
+// the next call, ending the ones the slot had.
+void WebPScratchPoolEnd(WebPEncoderScratch* const scratch,
+                        WebPScratchPoolSlot slot, WebPWorkerPool* const pool);
+
+#ifdef __cplusplus
+}    // extern "C"
+#endif
+
+#endif  // WEBP_ENC_SCRATCH_ENC_H_
@@ -23,6 +23,7 @@
 #include "src/dec/common_dec.h"
 #include "src/dsp/dsp.h"
 #include "src/enc/cost_enc.h"
+#include "src/enc/scratch_enc.h"
 #include "src/enc/vp8i_enc.h"
 #include "src/utils/bit_writer_utils.h"
 #include "src/utils/utils.h"
@@ -46,12 +47,21 @@ struct VP8Tokens {
 
 //------------------------------------------------------------------------------
 
-void VP8TBufferInit(VP8TBuffer* const b, int page_size) {
+// Size in bytes of a page holding 'page_size' tokens.
+#define PAGE_BYTES(page_size) \
+    (sizeof(VP8Tokens) + (size_t)(page_size) * sizeof(token_t))
+
+void VP8TBufferInit(VP8TBuffer* const b, int page_size,
+                    WebPEncoderScratch* const scratch) {
   b->tokens = NULL;
   b->pages = NULL;
   b->last_page = &b->pages;
   b->left = 0;
-  b->page_size = (page_size < MIN_PAGE_SIZE) ? MIN_PAGE_SIZE : page_size;
+  if (page_size < MIN_PAGE_SIZE) page_size = MIN_PAGE_SIZE;
+  // Round up to the size of the pooled pages, so that they can be reused.
+  b->page_size = (int)((WebPScratchPageSize(scratch, PAGE_BYTES(page_size)) -
+                        sizeof(VP8Tokens)) / sizeof(token_t));
+  b->scratch = scratch;
   b->error = 0;
 }
 
@@ -60,18 +70,18 @@ void VP8TBufferClear(VP8TBuffer* const b) {
     VP8Tokens* p = b->pages;
     while (p != NULL) {
       VP8Tokens* const next = p->next;
-      WebPSafeFree(p);
+      WebPScratchFreePage(b->scratch, p, PAGE_BYTES(b->page_size));
       p = next;
     }
-    VP8TBufferInit(b, b->page_size);
+    VP8TBufferInit(b, b->page_size, b->scratch);
   }
 }
 
 static int TBufferNewPage(VP8TBuffer* const b) {
   VP8Tokens* page = NULL;
   if (!b->error) {
-    const size_t size = sizeof(*page) + b->page_size * sizeof(token_t);
-    page = (VP8Tokens*)WebPSafeMalloc(1ULL, size);
+    page = (VP8Tokens*)WebPScratchNewPage(b->scratch,
+                                          PAGE_BYTES(b->page_size));
   }
   if (page == NULL) {
     b->error = 1;
@@ -219,7 +229,9 @@ int VP8EmitTokens(VP8TBuffer* const b, VP8BitWriter* const bw,
         VP8PutBit(bw, bit, probas[token & 0x3fffu]);
       }
     }
-    if (final_pass) WebPSafeFree((void*)p);
+    if (final_pass) {
+      WebPScratchFreePage(b->scratch, (void*)p, PAGE_BYTES(b->page_size));
+    }
     p = next;
   }
   if (final_pass) b->pages = NULL;
@@ -254,8 +266,10 @@ size_t VP8EstimateTokenSize(VP8TBuffer* const b, const uint8_t* const probas) {
 
 #else     // DISABLE_TOKEN_BUFFER
 
-void VP8TBufferInit(VP8TBuffer* const b, int page_size) {
+void VP8TBufferInit(VP8TBuffer* const b, int page_size,
+                    WebPEncoderScratch* const scratch) {
   (void)b;
+  (void)scratch;
   (void)page_size;
 }
 void VP8TBufferClear(VP8TBuffer* const b) {
@@ -249,6 +249,7 @@ typedef struct {
   uint64_t      luma_bits;        // macroblock bit-cost for luma
   uint64_t      uv_bits;          // macroblock bit-cost for chroma
   LFStats*      lf_stats;         // filter stats (borrowed from enc)
+  int*          max_edge;         // per-segment max edge delta, if not in enc
   int           do_trellis;       // if true, perform extra level optimisation
   int           count_down;       // number of mb still to be processed
   int           count_down0;      // starting counter value (for progress)
@@ -321,12 +322,14 @@ typedef struct {
   uint16_t* tokens;        // set to (*last_page)->tokens
   int left;                // how many free tokens left before the page is full
   int page_size;           // number of tokens per page
+  WebPEncoderScratch* scratch;  // pool the pages are recycled to (or NULL)
 #endif
   int error;         // true in case of malloc error
 } VP8TBuffer;
 
-// initialize an empty buffer
-void VP8TBufferInit(VP8TBuffer* const b, int page_size);
+// initialize an empty buffer, with pages taken from 'scratch' if not NULL
+void VP8TBufferInit(VP8TBuffer* const b, int page_size,
+                    WebPEncoderScratch* const scratch);
 void VP8TBufferClear(VP8TBuffer* const b);   // de-allocate pages memory
 
 #if !defined(DISABLE_TOKEN_BUFFER)
@@ -377,6 +380,7 @@ struct VP8Encoder {
   uint8_t* alpha_data;       // non-NULL if transparency is present
   uint32_t alpha_data_size;
   WebPWorker alpha_worker;
+  WebPWorkerPool pool;       // 'num_threads' threads, for the row bands
 
   // quantization info (one set of DC/AC dequant factor per segment)
   VP8SegmentInfo dqm[NUM_MB_SEGMENTS];
@@ -403,6 +407,7 @@ struct VP8Encoder {
   int max_i4_header_bits;   // partition #0 safeness factor
   int mb_header_limit;      // rough limit for header bits per MB
   int thread_level;         // derived from config->thread_level
+  int num_threads;          // threads encoding the frame, including this one
   int do_search;            // derived from config->target_XXX
   int use_tokens;           // if true, use token buffer
 
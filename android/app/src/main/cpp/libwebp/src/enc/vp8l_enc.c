@@ -20,6 +20,7 @@
 #include "src/dsp/lossless_common.h"
 #include "src/enc/backward_references_enc.h"
 #include "src/enc/histogram_enc.h"
+#include "src/enc/scratch_enc.h"
 #include "src/enc/vp8i_enc.h"
 #include "src/enc/vp8li_enc.h"
 #include "src/utils/bit_writer_utils.h"
@@ -428,7 +429,7 @@ static int EncoderInit(VP8LEncoder* const enc) {
   // at most MAX_REFS_BLOCK_PER_IMAGE blocks used:
   const int refs_block_size = (pix_cnt - 1) / MAX_REFS_BLOCK_PER_IMAGE + 1;
   int i;
-  if (!VP8LHashChainInit(&enc->hash_chain, pix_cnt)) return 0;
+  if (!VP8LHashChainInit(&enc->hash_chain, pix_cnt, pic->scratch)) return 0;
 
   for (i = 0; i < 4; ++i) VP8LBackwardRefsInit(&enc->refs[i], refs_block_size);
 
@@ -900,7 +901,8 @@ static int EncodeImageInternal(
 
   // Make sure we can allocate the different objects.
   if (huff_tree == NULL || histogram_argb == NULL ||
-      !VP8LHashChainInit(&hash_chain_histogram, histogram_image_xysize)) {
+      !VP8LHashChainInit(&hash_chain_histogram, histogram_image_xysize,
+                         pic->scratch)) {
     WebPEncodingSetError(pic, VP8_ENC_ERROR_OUT_OF_MEMORY);
     goto Error;
   }
@@ -1213,7 +1215,8 @@ static int WriteImage(const WebPPicture* const pic, VP8LBitWriter* const bw,
 // -----------------------------------------------------------------------------
 
 static void ClearTransformBuffer(VP8LEncoder* const enc) {
-  WebPSafeFree(enc->transform_mem);
+  WebPScratchFree(enc->pic->scratch, WEBP_SCRATCH_TRANSFORM,
+                  enc->transform_mem);
   enc->transform_mem = NULL;
   enc->transform_mem_size = 0;
 }
@@ -1246,7 +1249,8 @@ static int AllocateTransformBuffer(VP8LEncoder* const enc, int width,
   uint32_t* mem = enc->transform_mem;
   if (mem == NULL || mem_size > enc->transform_mem_size) {
     ClearTransformBuffer(enc);
-    mem = (uint32_t*)WebPSafeMalloc(mem_size, sizeof(*mem));
+    mem = (uint32_t*)WebPScratchAlloc(
+        enc->pic->scratch, WEBP_SCRATCH_TRANSFORM, mem_size, sizeof(*mem));
     if (mem == NULL) {
       return WebPEncodingSetError(enc->pic, VP8_ENC_ERROR_OUT_OF_MEMORY);
     }
@@ -1761,6 +1765,7 @@ int VP8LEncodeStream(const WebPConfig* const config,
           assert(0);
         }
         picture_side.progress_hook = NULL;  // Progress hook is not thread-safe.
+        picture_side.scratch = NULL;  // The scratch belongs to the main thread.
         param->picture = &picture_side;  // No need to free a view afterwards.
         param->stats = (picture->stats == NULL) ? NULL : &stats_side;
         // Create a side bit writer.
@@ -20,6 +20,7 @@
 #include "src/webp/types.h"
 #include "src/dsp/dsp.h"
 #include "src/enc/cost_enc.h"
+#include "src/enc/scratch_enc.h"
 #include "src/enc/vp8i_enc.h"
 #include "src/enc/vp8li_enc.h"
 #include "src/utils/utils.h"
@@ -114,6 +115,9 @@ static void MapConfigToTools(VP8Encoder* const enc) {
       (score_t)256 * 510 * 8 * 1024 / (enc->mb_w * enc->mb_h);
 
   enc->thread_level = config->thread_level;
+  // A thread level of 1 keeps meaning two threads.
+  enc->num_threads = (enc->thread_level == 1) ? 2 : enc->thread_level;
+  if (enc->num_threads < 1) enc->num_threads = 1;
 
   enc->do_search = (config->target_size > 0 || config->target_PSNR > 0);
   if (!config->low_memory) {
@@ -202,7 +206,8 @@ static VP8Encoder* InitVP8Encoder(const WebPConfig* const config,
          mb_w * mb_h * 384 * sizeof(uint8_t));
   printf("===================================\n");
 #endif
-  mem = (uint8_t*)WebPSafeMalloc(size, sizeof(*mem));
+  mem = (uint8_t*)WebPScratchAlloc(picture->scratch, WEBP_SCRATCH_VP8_ENCODER,
+                                   size, sizeof(*mem));
   if (mem == NULL) {
     WebPEncodingSetError(picture, VP8_ENC_ERROR_OUT_OF_MEMORY);
     return NULL;
@@ -245,12 +250,19 @@ static VP8Encoder* InitVP8Encoder(const WebPConfig* const config,
   ResetBoundaryPredictions(enc);
   VP8EncDspCostInit();
   VP8EncInitAlpha(enc);
+  if (!WebPScratchPoolInit(picture->scratch, WEBP_SCRATCH_POOL_VP8, &enc->pool,
+                           enc->num_threads)) {
+    WebPScratchFree(picture->scratch, WEBP_SCRATCH_VP8_ENCODER, enc);
+    WebPEncodingSetError(picture, VP8_ENC_ERROR_OUT_OF_MEMORY);
+    return NULL;
+  }
 
   // lower quality means smaller output -> we modulate a little the page
   // size based on quality. This is just a crude 1rst-order prediction.
   {
     const float scale = 1.f + config->quality * 5.f / 100.f;  // in [1,6]
-    VP8TBufferInit(&enc->tokens, (int)(mb_w * mb_h * 4 * scale));
+    VP8TBufferInit(&enc->tokens, (int)(mb_w * mb_h * 4 * scale),
+                   picture->scratch);
   }
   return enc;
 }
@@ -259,8 +271,9 @@ static int DeleteVP8Encoder(VP8Encoder* enc) {
   int ok = 1;
   if (enc != NULL) {
     ok = VP8EncDeleteAlpha(enc);
+    WebPScratchPoolEnd(enc->pic->scratch, WEBP_SCRATCH_POOL_VP8, &enc->pool);
     VP8TBufferClear(&enc->tokens);
-    WebPSafeFree(enc);
+    WebPScratchFree(enc->pic->scratch, WEBP_SCRATCH_VP8_ENCODER, enc);
   }
   return ok;
 }
@@ -17,7 +17,10 @@
 #include <stdlib.h>  // for abs()
 #include <string.h>
 
+#include "src/dsp/dsp.h"
 #include "src/mux/animi.h"
+#include "src/mux/muxi.h"
+#include "src/utils/thread_utils.h"
 #include "src/utils/utils.h"
 #include "src/webp/decode.h"
 #include "src/webp/encode.h"
@@ -46,8 +49,25 @@ typedef struct {
   WebPMuxFrameInfo sub_frame;  // Encoded frame rectangle.
   WebPMuxFrameInfo key_frame;  // Encoded frame if it is a key-frame.
   int is_key_frame;            // True if 'key_frame' has been chosen.
+  int num_candidates;          // Encodings tried for 'sub_frame' and
+                               // 'key_frame', for statistics.
+  int num_input_frames;        // Input frames shown by this frame, including
+                               // the merged and dropped ones.
+  float quality;               // Quality of the encodings, for statistics.
 } EncodedFrame;
 
+// A candidate encoding run on one of the encoder threads. Defined below.
+typedef struct CandidateJob CandidateJob;
+
+// Lossy encodes of a frame that start from the analysis of the same encode of
+// the previous frame, if 'options.reuse_analysis'.
+enum {
+  ANALYSIS_KEY_FRAME = 0,
+  ANALYSIS_SUB_FRAME,      // Previous frame disposed to none.
+  ANALYSIS_SUB_FRAME_BG,   // Previous frame disposed to background.
+  ANALYSIS_CACHE_COUNT
+};
+
 struct WebPAnimEncoder {
   const int canvas_width;                  // Canvas width.
   const int canvas_height;                 // Canvas height.
@@ -84,6 +104,24 @@ struct WebPAnimEncoder {
                             // transparent pixels in a frame.
   int keyframe;             // Index of selected key-frame relative to 'start'.
   int count_since_key_frame;      // Frames seen since the last key-frame.
+  // Key-frame size prediction, if 'options.keyframe_tolerance' > 0.
+  size_t last_key_size;           // Size of the last frame fully encoded as a
+                                  // key-frame, 0 if none yet.
+  uint64_t last_key_activity;     // PictureActivity() of that frame.
+  int key_error;                  // Recent prediction error, in percent.
+  // Frame decimation, if 'options.decimate_cost' > 0.
+  uint32_t sub_frame_cost;        // Recent size of sub-frames per pixel of
+                                  // their change rectangle, in 1/256 bytes.
+                                  // 0 until a sub-frame is encoded.
+  int decimated_count;            // Frames dropped since the last kept one.
+  // Rate control, if 'options.target_size' > 0.
+  float rc_quality;               // Quality picked for the current frame,
+                                  // before its weight.
+  double rc_bytes, rc_time;       // Recent frame sizes, as if encoded at the
+                                  // quality of their config, and durations.
+                                  // Both decay at each input frame.
+  double rc_new_bytes;            // Size of the last frame, if encoded, to add
+                                  // to 'rc_bytes' once its duration is known.
 
   int first_timestamp;            // Timestamp of the first frame.
   int prev_timestamp;             // Timestamp of the last added frame.
@@ -98,14 +136,39 @@ struct WebPAnimEncoder {
   size_t in_frame_count;   // Number of input frames processed so far.
   size_t out_frame_count;  // Number of frames added to mux so far. This may be
                            // different from 'in_frame_count' due to merging.
+  size_t frames_size;      // Size of the frames added to mux so far.
+
+  // Buffers reused by the frames encoded on the calling thread.
+  WebPEncoderScratch* scratch;
+  // Analysis of the previous lossy encodes, if 'options.reuse_analysis'.
+  WebPAnalysisCache* analysis_caches[ANALYSIS_CACHE_COUNT];
+
+  // Threads encoding the candidates, if 'options.candidate_threads' > 1.
+  int num_workers;
+  WebPWorker* workers;
+  CandidateJob* jobs;       // Job of each worker.
+  int next_worker;          // Worker the next candidate is given to.
 
   WebPMux* mux;         // Muxer to assemble the WebP bitstream.
   char error_str[ERROR_STR_MAX_LENGTH];  // Error string. Empty if no error.
+
+  // Streaming output, see WebPAnimEncoderSetWriter().
+  WebPAnimEncoderWriterFunction writer;  // If NULL, frames are kept in 'mux'.
+  void* writer_data;
+  size_t output_size;       // Bytes written so far. 0 until the header is.
+  uint32_t output_flags;    // VP8X flags of what was written so far.
+
+  // Called with the statistics of each flushed frame, if not NULL.
+  WebPAnimEncoderFrameStatsFunction stats_hook;
+  void* stats_data;
 };
 
 // -----------------------------------------------------------------------------
 // Life of WebPAnimEncoder object.
 
+static int InitWorkers(WebPAnimEncoder* const enc);
+static void EndWorkers(WebPAnimEncoder* const enc);
+
 #define DELTA_INFINITY      (1ULL << 32)
 #define KEYFRAME_NONE       (-1)
 
@@ -124,10 +187,51 @@ static void DisableKeyframes(WebPAnimEncoderOptions* const enc_options) {
 }
 
 #define MAX_CACHED_FRAMES 30
+#define MAX_CANDIDATE_THREADS 8  // A frame has at most 8 candidates.
+#define MAX_PSNR 99              // PSNR of identical pictures, in dB.
+#define MAX_DECIMATED_FRAMES 3   // Frames dropped in a row, at most.
 
 static void SanitizeEncoderOptions(WebPAnimEncoderOptions* const enc_options) {
   int print_warning = enc_options->verbose;
 
+  if (enc_options->keep_yuv) {  // YUV(A) frames can only be encoded lossy.
+    enc_options->allow_mixed = 0;
+  }
+
+  if (enc_options->candidate_threads < 0) {
+    enc_options->candidate_threads = 0;
+  } else if (enc_options->candidate_threads > MAX_CANDIDATE_THREADS) {
+    enc_options->candidate_threads = MAX_CANDIDATE_THREADS;
+  }
+
+  if (enc_options->keyframe_tolerance < 0) {
+    enc_options->keyframe_tolerance = 0;
+  } else if (enc_options->keyframe_tolerance > 100) {
+    enc_options->keyframe_tolerance = 100;
+  }
+
+  if (enc_options->merge_threshold < 0) {
+    enc_options->merge_threshold = 0;
+  } else if (enc_options->merge_threshold > MAX_PSNR) {
+    enc_options->merge_threshold = MAX_PSNR;
+  }
+  if (enc_options->scene_cut_threshold < 0) {
+    enc_options->scene_cut_threshold = 0;
+  } else if (enc_options->scene_cut_threshold > MAX_PSNR) {
+    enc_options->scene_cut_threshold = MAX_PSNR;
+  }
+  if (enc_options->decimate_cost < 0) enc_options->decimate_cost = 0;
+  if (enc_options->max_buffered_frames < 0) {
+    enc_options->max_buffered_frames = 0;
+  }
+  if (enc_options->target_size > 0 && enc_options->target_duration <= 0) {
+    enc_options->target_size = 0;
+    if (print_warning) {
+      fprintf(stderr, "WARNING: Ignoring target_size without a "
+              "target_duration.\n");
+    }
+  }
+
   if (enc_options->minimize_size) {
     DisableKeyframes(enc_options);
   }
@@ -169,10 +273,23 @@ static void SanitizeEncoderOptions(WebPAnimEncoderOptions* const enc_options) {
               enc_options->kmin, MAX_CACHED_FRAMES);
     }
   }
+  // Frames past 'kmin' wait for the key-frame decision, at most kmax - kmin
+  // of them.
+  if (enc_options->max_buffered_frames > 0 &&
+      enc_options->kmax - enc_options->kmin >
+          enc_options->max_buffered_frames) {
+    enc_options->kmin = enc_options->kmax - enc_options->max_buffered_frames;
+    if (print_warning) {
+      fprintf(stderr,
+              "WARNING: Setting kmin = %d, so that kmax - kmin <= %d.\n",
+              enc_options->kmin, enc_options->max_buffered_frames);
+    }
+  }
   assert(enc_options->kmin < enc_options->kmax);
 }
 
 #undef MAX_CACHED_FRAMES
+#undef MAX_CANDIDATE_THREADS
 
 static void DefaultEncoderOptions(WebPAnimEncoderOptions* const enc_options) {
   enc_options->anim_params.loop_count = 0;
@@ -181,6 +298,17 @@ static void DefaultEncoderOptions(WebPAnimEncoderOptions* const enc_options) {
   DisableKeyframes(enc_options);
   enc_options->allow_mixed = 0;
   enc_options->verbose = 0;
+  enc_options->keep_yuv = 0;
+  enc_options->candidate_threads = 0;
+  enc_options->keyframe_tolerance = 0;
+  enc_options->merge_threshold = 0;
+  enc_options->scene_cut_threshold = 0;
+  enc_options->decimate_cost = 0;
+  enc_options->max_buffered_frames = 0;
+  enc_options->target_size = 0;
+  enc_options->target_duration = 0;
+  enc_options->reuse_analysis = 0;
+  enc_options->allocator = NULL;
 }
 
 int WebPAnimEncoderOptionsInitInternal(WebPAnimEncoderOptions* enc_options,
@@ -200,6 +328,30 @@ int WebPAnimEncoderOptionsInitInternal(WebPAnimEncoderOptions* enc_options,
 static void ClearRectangle(WebPPicture* const picture,
                            int left, int top, int width, int height) {
   int j;
+  if (!picture->use_argb) {
+    // Only the alpha matters for transparent pixels; use neutral chroma.
+    // Chroma samples shared with pixels outside the rectangle are left as is,
+    // as the decoder keeps those pixels.
+    const int right = left + width, bottom = top + height;
+    const int uv_left = (left + 1) >> 1;
+    const int uv_top = (top + 1) >> 1;
+    const int uv_right = (right + (right == picture->width)) >> 1;
+    const int uv_bottom = (bottom + (bottom == picture->height)) >> 1;
+    for (j = top; j < bottom; ++j) {
+      memset(picture->y + j * picture->y_stride + left, 0, width);
+      if (picture->a != NULL) {
+        memset(picture->a + j * picture->a_stride + left, 0, width);
+      }
+    }
+    if (uv_right <= uv_left) return;
+    for (j = uv_top; j < uv_bottom; ++j) {
+      memset(picture->u + j * picture->uv_stride + uv_left, 128,
+             uv_right - uv_left);
+      memset(picture->v + j * picture->uv_stride + uv_left, 128,
+             uv_right - uv_left);
+    }
+    return;
+  }
   for (j = top; j < top + height; ++j) {
     uint32_t* const dst = picture->argb + j * picture->argb_stride;
     int i;
@@ -237,14 +389,18 @@ static void MarkError2(WebPAnimEncoder* const enc,
   }
 }
 
-WebPAnimEncoder* WebPAnimEncoderNewInternal(
-    int width, int height, const WebPAnimEncoderOptions* enc_options,
-    int abi_version) {
+// Makes the calling thread allocate with 'allocator', unless it is NULL.
+// Returns the allocator to restore with WebPSetAllocator().
+static const WebPAllocator* UseAllocator(const WebPAllocator* const allocator) {
+  const WebPAllocator* const previous = WebPGetAllocator();
+  if (allocator != NULL) WebPSetAllocator(allocator);
+  return previous;
+}
+
+static WebPAnimEncoder* NewEncoder(int width, int height,
+                                   const WebPAnimEncoderOptions* enc_options) {
   WebPAnimEncoder* enc;
 
-  if (WEBP_ABI_IS_INCOMPATIBLE(abi_version, WEBP_MUX_ABI_VERSION)) {
-    return NULL;
-  }
   if (width <= 0 || height <= 0 ||
       (width * (uint64_t)height) >= MAX_IMAGE_AREA) {
     return NULL;
@@ -253,6 +409,9 @@ WebPAnimEncoder* WebPAnimEncoderNewInternal(
   enc = (WebPAnimEncoder*)WebPSafeCalloc(1, sizeof(*enc));
   if (enc == NULL) return NULL;
   MarkNoError(enc);
+  WebPAnimDiffDspInit();
+  VP8SSIMDspInit();
+  enc->key_error = 100;  // Nothing is known about the prediction yet.
 
   // Dimensions and options.
   *(int*)&enc->canvas_width = width;
@@ -272,7 +431,13 @@ WebPAnimEncoder* WebPAnimEncoderNewInternal(
   }
   enc->curr_canvas_copy.width = width;
   enc->curr_canvas_copy.height = height;
-  enc->curr_canvas_copy.use_argb = 1;
+  if (enc->options.keep_yuv) {
+    // Always keep an alpha plane so the canvas can be cleared to transparent.
+    enc->curr_canvas_copy.use_argb = 0;
+    enc->curr_canvas_copy.colorspace = WEBP_YUV420A;
+  } else {
+    enc->curr_canvas_copy.use_argb = 1;
+  }
   if (!WebPPictureAlloc(&enc->curr_canvas_copy) ||
       !WebPPictureCopy(&enc->curr_canvas_copy, &enc->prev_canvas) ||
       !WebPPictureCopy(&enc->curr_canvas_copy, &enc->prev_canvas_disposed)) {
@@ -295,6 +460,19 @@ WebPAnimEncoder* WebPAnimEncoderNewInternal(
   enc->mux = WebPMuxNew();
   if (enc->mux == NULL) goto Err;
 
+  enc->scratch = WebPEncoderScratchNew();
+  if (enc->scratch == NULL) goto Err;
+
+  if (enc->options.reuse_analysis) {
+    int i;
+    for (i = 0; i < ANALYSIS_CACHE_COUNT; ++i) {
+      enc->analysis_caches[i] = WebPAnalysisCacheNew();
+      if (enc->analysis_caches[i] == NULL) goto Err;
+    }
+  }
+
+  if (enc->options.candidate_threads > 1 && !InitWorkers(enc)) goto Err;
+
   enc->count_since_key_frame = 0;
   enc->first_timestamp = 0;
   enc->prev_timestamp = 0;
@@ -309,6 +487,22 @@ WebPAnimEncoder* WebPAnimEncoderNewInternal(
   return NULL;
 }
 
+WebPAnimEncoder* WebPAnimEncoderNewInternal(
+    int width, int height, const WebPAnimEncoderOptions* enc_options,
+    int abi_version) {
+  const WebPAllocator* previous;
+  WebPAnimEncoder* enc;
+
+  if (WEBP_ABI_IS_INCOMPATIBLE(abi_version, WEBP_MUX_ABI_VERSION)) {
+    return NULL;
+  }
+  previous =
+      UseAllocator((enc_options != NULL) ? enc_options->allocator : NULL);
+  enc = NewEncoder(width, height, enc_options);
+  WebPSetAllocator(previous);
+  return enc;
+}
+
 // Release the data contained by 'encoded_frame'.
 static void FrameRelease(EncodedFrame* const encoded_frame) {
   if (encoded_frame != NULL) {
@@ -320,17 +514,22 @@ static void FrameRelease(EncodedFrame* const encoded_frame) {
 
 void WebPAnimEncoderDelete(WebPAnimEncoder* enc) {
   if (enc != NULL) {
+    size_t i;
+    EndWorkers(enc);
     WebPPictureFree(&enc->curr_canvas_copy);
     WebPPictureFree(&enc->prev_canvas);
     WebPPictureFree(&enc->prev_canvas_disposed);
     if (enc->encoded_frames != NULL) {
-      size_t i;
       for (i = 0; i < enc->size; ++i) {
         FrameRelease(&enc->encoded_frames[i]);
       }
       WebPSafeFree(enc->encoded_frames);
     }
     WebPMuxDelete(enc->mux);
+    WebPEncoderScratchDelete(enc->scratch);
+    for (i = 0; i < ANALYSIS_CACHE_COUNT; ++i) {
+      WebPAnalysisCacheDelete(enc->analysis_caches[i]);
+    }
     WebPSafeFree(enc);
   }
 }
@@ -345,60 +544,65 @@ static EncodedFrame* GetFrame(const WebPAnimEncoder* const enc,
   return &enc->encoded_frames[enc->start + position];
 }
 
-typedef int (*ComparePixelsFunc)(const uint32_t*, int, const uint32_t*, int,
-                                 int, int);
+// Returns true if the pixels at ('x', 'y') in the YUV(A) pictures 'src' and
+// 'dst' are within 'max_allowed_diff' of each other, using the same alpha
+// weighting as the ARGB comparisons. Chroma is compared at the 2x2 sample
+// covering the pixel. Pictures without an alpha plane are opaque.
+static WEBP_INLINE int YUVAPixelsAreSimilar(const WebPPicture* const src,
+                                            const WebPPicture* const dst,
+                                            int x, int y,
+                                            int max_allowed_diff) {
+  const int src_a = (src->a != NULL) ? src->a[y * src->a_stride + x] : 0xff;
+  const int dst_a = (dst->a != NULL) ? dst->a[y * dst->a_stride + x] : 0xff;
+  const int src_uv = (y >> 1) * src->uv_stride + (x >> 1);
+  const int dst_uv = (y >> 1) * dst->uv_stride + (x >> 1);
+  const int max_diff = max_allowed_diff * 255;
+  if (src_a != dst_a) return 0;
+  if (dst_a == 0) return 1;  // Both are fully transparent.
+  return
+      (abs(src->y[y * src->y_stride + x] - dst->y[y * dst->y_stride + x]) *
+           dst_a <= max_diff) &&
+      (abs(src->u[src_uv] - dst->u[dst_uv]) * dst_a <= max_diff) &&
+      (abs(src->v[src_uv] - dst->v[dst_uv]) * dst_a <= max_diff);
+}
 
-// Returns true if 'length' number of pixels in 'src' and 'dst' are equal,
-// assuming the given step sizes between pixels.
-// 'max_allowed_diff' is unused and only there to allow function pointer use.
-static WEBP_INLINE int ComparePixelsLossless(const uint32_t* src, int src_step,
-                                             const uint32_t* dst, int dst_step,
-                                             int length, int max_allowed_diff) {
-  (void)max_allowed_diff;
-  assert(length > 0);
-  while (length-- > 0) {
-    if (*src != *dst) {
-      return 0;
-    }
-    src += src_step;
-    dst += dst_step;
-  }
-  return 1;
+// Returns the index of the first of the 'len' pixels starting at ('x', 'y')
+// that differs between 'src' and 'dst', or 'len' if they are all similar.
+static int FindFirstDiff(const WebPPicture* const src,
+                         const WebPPicture* const dst, int x, int y, int len,
+                         int is_lossless, int max_allowed_diff) {
+  int i;
+  if (dst->use_argb) {
+    const WebPAnimFindDiffFunc find_first_diff =
+        is_lossless ? WebPAnimFindFirstDiffLossless
+                    : WebPAnimFindFirstDiffLossy;
+    return find_first_diff(&src->argb[y * src->argb_stride + x],
+                           &dst->argb[y * dst->argb_stride + x], len,
+                           max_allowed_diff);
+  }
+  for (i = 0; i < len; ++i) {
+    if (!YUVAPixelsAreSimilar(src, dst, x + i, y, max_allowed_diff)) break;
+  }
+  return i;
 }
 
-// Helper to check if each channel in 'src' and 'dst' is at most off by
-// 'max_allowed_diff'.
-static WEBP_INLINE int PixelsAreSimilar(uint32_t src, uint32_t dst,
-                                        int max_allowed_diff) {
-  const int src_a = (src >> 24) & 0xff;
-  const int src_r = (src >> 16) & 0xff;
-  const int src_g = (src >> 8) & 0xff;
-  const int src_b = (src >> 0) & 0xff;
-  const int dst_a = (dst >> 24) & 0xff;
-  const int dst_r = (dst >> 16) & 0xff;
-  const int dst_g = (dst >> 8) & 0xff;
-  const int dst_b = (dst >> 0) & 0xff;
-
-  return (src_a == dst_a) &&
-         (abs(src_r - dst_r) * dst_a <= (max_allowed_diff * 255)) &&
-         (abs(src_g - dst_g) * dst_a <= (max_allowed_diff * 255)) &&
-         (abs(src_b - dst_b) * dst_a <= (max_allowed_diff * 255));
-}
-
-// Returns true if 'length' number of pixels in 'src' and 'dst' are within an
-// error bound, assuming the given step sizes between pixels.
-static WEBP_INLINE int ComparePixelsLossy(const uint32_t* src, int src_step,
-                                          const uint32_t* dst, int dst_step,
-                                          int length, int max_allowed_diff) {
-  assert(length > 0);
-  while (length-- > 0) {
-    if (!PixelsAreSimilar(*src, *dst, max_allowed_diff)) {
-      return 0;
-    }
-    src += src_step;
-    dst += dst_step;
+// Returns the index of the last of the 'len' pixels starting at ('x', 'y')
+// that differs between 'src' and 'dst', or -1 if they are all similar.
+static int FindLastDiff(const WebPPicture* const src,
+                        const WebPPicture* const dst, int x, int y, int len,
+                        int is_lossless, int max_allowed_diff) {
+  int i;
+  if (dst->use_argb) {
+    const WebPAnimFindDiffFunc find_last_diff =
+        is_lossless ? WebPAnimFindLastDiffLossless : WebPAnimFindLastDiffLossy;
+    return find_last_diff(&src->argb[y * src->argb_stride + x],
+                          &dst->argb[y * dst->argb_stride + x], len,
+                          max_allowed_diff);
   }
-  return 1;
+  for (i = len - 1; i >= 0; --i) {
+    if (!YUVAPixelsAreSimilar(src, dst, x + i, y, max_allowed_diff)) break;
+  }
+  return i;
 }
 
 static int IsEmptyRect(const FrameRectangle* const rect) {
@@ -412,90 +616,74 @@ static int QualityToMaxDiff(float quality) {
 }
 
 // Assumes that an initial valid guess of change rectangle 'rect' is passed.
+// 'rect' is shrunk to the bounding box of the differing pixels. Rows are
+// scanned rather than columns so that the comparisons run over contiguous
+// pixels, and the rows between the top and bottom ones are only scanned
+// outside of the columns already known to change.
 static void MinimizeChangeRectangle(const WebPPicture* const src,
                                     const WebPPicture* const dst,
                                     FrameRectangle* const rect,
                                     int is_lossless, float quality) {
-  int i, j;
-  const ComparePixelsFunc compare_pixels =
-      is_lossless ? ComparePixelsLossless : ComparePixelsLossy;
-  const int max_allowed_diff_lossy = QualityToMaxDiff(quality);
-  const int max_allowed_diff = is_lossless ? 0 : max_allowed_diff_lossy;
+  const int max_allowed_diff = is_lossless ? 0 : QualityToMaxDiff(quality);
+  const int x0 = rect->x_offset;
+  const int width = rect->width;
+  const int y_end = rect->y_offset + rect->height;
+  int top, bottom, left = width, right = -1, y;
 
   // Assumption/correctness checks.
   assert(src->width == dst->width && src->height == dst->height);
   assert(rect->x_offset + rect->width <= dst->width);
   assert(rect->y_offset + rect->height <= dst->height);
+  if (IsEmptyRect(rect)) goto NoChange;
 
-  // Left boundary.
-  for (i = rect->x_offset; i < rect->x_offset + rect->width; ++i) {
-    const uint32_t* const src_argb =
-        &src->argb[rect->y_offset * src->argb_stride + i];
-    const uint32_t* const dst_argb =
-        &dst->argb[rect->y_offset * dst->argb_stride + i];
-    if (compare_pixels(src_argb, src->argb_stride, dst_argb, dst->argb_stride,
-                       rect->height, max_allowed_diff)) {
-      --rect->width;  // Redundant column.
-      ++rect->x_offset;
-    } else {
-      break;
-    }
-  }
-  if (rect->width == 0) goto NoChange;
-
-  // Right boundary.
-  for (i = rect->x_offset + rect->width - 1; i >= rect->x_offset; --i) {
-    const uint32_t* const src_argb =
-        &src->argb[rect->y_offset * src->argb_stride + i];
-    const uint32_t* const dst_argb =
-        &dst->argb[rect->y_offset * dst->argb_stride + i];
-    if (compare_pixels(src_argb, src->argb_stride, dst_argb, dst->argb_stride,
-                       rect->height, max_allowed_diff)) {
-      --rect->width;  // Redundant column.
-    } else {
-      break;
-    }
+  // Top boundary, which also gives a first guess of the left and right ones.
+  for (top = rect->y_offset; top < y_end; ++top) {
+    left = FindFirstDiff(src, dst, x0, top, width, is_lossless,
+                         max_allowed_diff);
+    if (left < width) break;
   }
-  if (rect->width == 0) goto NoChange;
+  if (top == y_end) goto NoChange;
+  right = left + FindLastDiff(src, dst, x0 + left, top, width - left,
+                              is_lossless, max_allowed_diff);
 
-  // Top boundary.
-  for (j = rect->y_offset; j < rect->y_offset + rect->height; ++j) {
-    const uint32_t* const src_argb =
-        &src->argb[j * src->argb_stride + rect->x_offset];
-    const uint32_t* const dst_argb =
-        &dst->argb[j * dst->argb_stride + rect->x_offset];
-    if (compare_pixels(src_argb, 1, dst_argb, 1, rect->width,
-                       max_allowed_diff)) {
-      --rect->height;  // Redundant row.
-      ++rect->y_offset;
-    } else {
+  // Bottom boundary.
+  for (bottom = y_end - 1; bottom > top; --bottom) {
+    const int first = FindFirstDiff(src, dst, x0, bottom, width, is_lossless,
+                                     max_allowed_diff);
+    if (first < width) {
+      const int last = FindLastDiff(src, dst, x0, bottom, width, is_lossless,
+                                    max_allowed_diff);
+      if (first < left) left = first;
+      if (last > right) right = last;
       break;
     }
   }
-  if (rect->height == 0) goto NoChange;
 
-  // Bottom boundary.
-  for (j = rect->y_offset + rect->height - 1; j >= rect->y_offset; --j) {
-    const uint32_t* const src_argb =
-        &src->argb[j * src->argb_stride + rect->x_offset];
-    const uint32_t* const dst_argb =
-        &dst->argb[j * dst->argb_stride + rect->x_offset];
-    if (compare_pixels(src_argb, 1, dst_argb, 1, rect->width,
-                       max_allowed_diff)) {
-      --rect->height;  // Redundant row.
-    } else {
-      break;
+  // Rows in between can only push the left and right boundaries outwards.
+  for (y = top + 1; y < bottom; ++y) {
+    if (left > 0) {
+      left = FindFirstDiff(src, dst, x0, y, left, is_lossless,
+                           max_allowed_diff);
+    }
+    if (right < width - 1) {
+      const int last = FindLastDiff(src, dst, x0 + right + 1, y,
+                                    width - right - 1, is_lossless,
+                                    max_allowed_diff);
+      if (last >= 0) right += last + 1;
     }
   }
-  if (rect->height == 0) goto NoChange;
 
-  if (IsEmptyRect(rect)) {
+  rect->x_offset = x0 + left;
+  rect->y_offset = top;
+  rect->width = right - left + 1;
+  rect->height = bottom - top + 1;
+  return;
+
  NoChange:
-    rect->x_offset = 0;
-    rect->y_offset = 0;
-    rect->width = 0;
-    rect->height = 0;
-  }
+  rect->x_offset = 0;
+  rect->y_offset = 0;
+  rect->width = 0;
+  rect->height = 0;
 }
 
 // Snap rectangle to even offsets (and adjust dimensions if needed).
@@ -567,6 +755,8 @@ static int GetSubRect(const WebPPicture* const prev_canvas,
 
 // Picks optimal frame rectangle for both lossless and lossy compression. The
 // initial guess for frame rectangles will be the full canvas.
+// YUV(A) canvases are only encoded lossy, so 'rect_ll' is then a copy of
+// 'rect_lossy' and 'sub_frame_ll' is left unset.
 static int GetSubRects(const WebPPicture* const prev_canvas,
                        const WebPPicture* const curr_canvas, int is_key_frame,
                        int is_first_frame, float quality,
@@ -576,6 +766,16 @@ static int GetSubRects(const WebPPicture* const prev_canvas,
   params->rect_ll.y_offset = 0;
   params->rect_ll.width = curr_canvas->width;
   params->rect_ll.height = curr_canvas->height;
+  if (!curr_canvas->use_argb) {
+    params->rect_lossy = params->rect_ll;
+    if (!GetSubRect(prev_canvas, curr_canvas, is_key_frame, is_first_frame,
+                    params->empty_rect_allowed, 0, quality,
+                    &params->rect_lossy, &params->sub_frame_lossy)) {
+      return 0;
+    }
+    params->rect_ll = params->rect_lossy;
+    return 1;
+  }
   if (!GetSubRect(prev_canvas, curr_canvas, is_key_frame, is_first_frame,
                   params->empty_rect_allowed, 1, quality,
                   &params->rect_ll, &params->sub_frame_ll)) {
@@ -638,20 +838,18 @@ static uint32_t RectArea(const FrameRectangle* const rect) {
 static int IsLosslessBlendingPossible(const WebPPicture* const src,
                                       const WebPPicture* const dst,
                                       const FrameRectangle* const rect) {
-  int i, j;
+  int j;
   assert(src->width == dst->width && src->height == dst->height);
   assert(rect->x_offset + rect->width <= dst->width);
   assert(rect->y_offset + rect->height <= dst->height);
   for (j = rect->y_offset; j < rect->y_offset + rect->height; ++j) {
-    for (i = rect->x_offset; i < rect->x_offset + rect->width; ++i) {
-      const uint32_t src_pixel = src->argb[j * src->argb_stride + i];
-      const uint32_t dst_pixel = dst->argb[j * dst->argb_stride + i];
-      const uint32_t dst_alpha = dst_pixel >> 24;
-      if (dst_alpha != 0xff && src_pixel != dst_pixel) {
-        // In this case, if we use blending, we can't attain the desired
-        // 'dst_pixel' value for this pixel. So, blending is not possible.
-        return 0;
-      }
+    // If a non-opaque 'dst' pixel differs from 'src', we can't attain it by
+    // blending. So, blending is not possible.
+    if (!WebPAnimIsBlendingPossibleLossless(
+            &src->argb[j * src->argb_stride + rect->x_offset],
+            &dst->argb[j * dst->argb_stride + rect->x_offset], rect->width,
+            0)) {
+      return 0;
     }
   }
   return 1;
@@ -662,21 +860,16 @@ static int IsLossyBlendingPossible(const WebPPicture* const src,
                                    const FrameRectangle* const rect,
                                    float quality) {
   const int max_allowed_diff_lossy = QualityToMaxDiff(quality);
-  int i, j;
+  int j;
   assert(src->width == dst->width && src->height == dst->height);
   assert(rect->x_offset + rect->width <= dst->width);
   assert(rect->y_offset + rect->height <= dst->height);
   for (j = rect->y_offset; j < rect->y_offset + rect->height; ++j) {
-    for (i = rect->x_offset; i < rect->x_offset + rect->width; ++i) {
-      const uint32_t src_pixel = src->argb[j * src->argb_stride + i];
-      const uint32_t dst_pixel = dst->argb[j * dst->argb_stride + i];
-      const uint32_t dst_alpha = dst_pixel >> 24;
-      if (dst_alpha != 0xff &&
-          !PixelsAreSimilar(src_pixel, dst_pixel, max_allowed_diff_lossy)) {
-        // In this case, if we use blending, we can't attain the desired
-        // 'dst_pixel' value for this pixel. So, blending is not possible.
-        return 0;
-      }
+    if (!WebPAnimIsBlendingPossibleLossy(
+            &src->argb[j * src->argb_stride + rect->x_offset],
+            &dst->argb[j * dst->argb_stride + rect->x_offset], rect->width,
+            max_allowed_diff_lossy)) {
+      return 0;
     }
   }
   return 1;
@@ -688,18 +881,15 @@ static int IsLossyBlendingPossible(const WebPPicture* const src,
 static int IncreaseTransparency(const WebPPicture* const src,
                                 const FrameRectangle* const rect,
                                 WebPPicture* const dst) {
-  int i, j;
+  int j;
   int modified = 0;
   assert(src != NULL && dst != NULL && rect != NULL);
   assert(src->width == dst->width && src->height == dst->height);
   for (j = rect->y_offset; j < rect->y_offset + rect->height; ++j) {
-    const uint32_t* const psrc = src->argb + j * src->argb_stride;
-    uint32_t* const pdst = dst->argb + j * dst->argb_stride;
-    for (i = rect->x_offset; i < rect->x_offset + rect->width; ++i) {
-      if (psrc[i] == pdst[i] && pdst[i] != TRANSPARENT_COLOR) {
-        pdst[i] = TRANSPARENT_COLOR;
-        modified = 1;
-      }
+    if (WebPAnimIncreaseTransparency(
+            &src->argb[j * src->argb_stride + rect->x_offset],
+            &dst->argb[j * dst->argb_stride + rect->x_offset], rect->width)) {
+      modified = 1;
     }
   }
   return modified;
@@ -725,35 +915,43 @@ static int FlattenSimilarBlocks(const WebPPicture* const src,
   assert(src != NULL && dst != NULL && rect != NULL);
   assert(src->width == dst->width && src->height == dst->height);
   assert((block_size & (block_size - 1)) == 0);  // must be a power of 2
-  // Iterate over each block and count similar pixels.
+  // Iterate over each block and look for fully similar ones.
   for (j = y_start; j < y_end; j += block_size) {
     for (i = x_start; i < x_end; i += block_size) {
-      int cnt = 0;
-      int avg_r = 0, avg_g = 0, avg_b = 0;
       int x, y;
       const uint32_t* const psrc = src->argb + j * src->argb_stride + i;
       uint32_t* const pdst = dst->argb + j * dst->argb_stride + i;
+      // The block has to be opaque in 'src' and similar to 'dst'.
       for (y = 0; y < block_size; ++y) {
+        const uint32_t* const src_row = psrc + y * src->argb_stride;
+        const uint32_t* const dst_row = pdst + y * dst->argb_stride;
         for (x = 0; x < block_size; ++x) {
-          const uint32_t src_pixel = psrc[x + y * src->argb_stride];
-          const int alpha = src_pixel >> 24;
-          if (alpha == 0xff &&
-              PixelsAreSimilar(src_pixel, pdst[x + y * dst->argb_stride],
-                               max_allowed_diff_lossy)) {
-            ++cnt;
+          if ((src_row[x] >> 24) != 0xff) break;
+        }
+        if (x < block_size ||
+            WebPAnimFindFirstDiffLossy(src_row, dst_row, block_size,
+                                       max_allowed_diff_lossy) < block_size) {
+          break;
+        }
+      }
+      // If we have a fully similar block, we replace it with an
+      // average transparent block. This compresses better in lossy mode.
+      if (y == block_size) {
+        const int cnt = block_size * block_size;
+        int avg_r = 0, avg_g = 0, avg_b = 0;
+        uint32_t color;
+        for (y = 0; y < block_size; ++y) {
+          for (x = 0; x < block_size; ++x) {
+            const uint32_t src_pixel = psrc[x + y * src->argb_stride];
             avg_r += (src_pixel >> 16) & 0xff;
             avg_g += (src_pixel >> 8) & 0xff;
             avg_b += (src_pixel >> 0) & 0xff;
           }
         }
-      }
-      // If we have a fully similar block, we replace it with an
-      // average transparent block. This compresses better in lossy mode.
-      if (cnt == block_size * block_size) {
-        const uint32_t color = (0x00          << 24) |
-                               ((avg_r / cnt) << 16) |
-                               ((avg_g / cnt) <<  8) |
-                               ((avg_b / cnt) <<  0);
+        color = (0x00          << 24) |
+                ((avg_r / cnt) << 16) |
+                ((avg_g / cnt) <<  8) |
+                ((avg_b / cnt) <<  0);
         for (y = 0; y < block_size; ++y) {
           for (x = 0; x < block_size; ++x) {
             pdst[x + y * dst->argb_stride] = color;
@@ -767,8 +965,16 @@ static int FlattenSimilarBlocks(const WebPPicture* const src,
 }
 
 static int EncodeFrame(const WebPConfig* const config, WebPPicture* const pic,
+                       WebPEncoderScratch* const scratch,
+                       WebPAnalysisCache* const analysis_cache,
                        WebPMemoryWriter* const memory) {
-  pic->use_argb = 1;
+  // Make sure ARGB samples are used even if a previous lossy encode left YUV
+  // ones around. Frames kept in YUV(A) have no ARGB samples and are used as is.
+  if (pic->argb != NULL) pic->use_argb = 1;
+  // 'pic' may be a copy made for another thread: always set its scratch and
+  // analysis cache.
+  pic->scratch = scratch;
+  pic->analysis_cache = analysis_cache;
   pic->writer = WebPMemoryWrite;
   pic->custom_ptr = memory;
   if (!WebPEncode(config, pic)) {
@@ -790,6 +996,8 @@ static WebPEncodingError EncodeCandidate(WebPPicture* const sub_frame,
                                          const FrameRectangle* const rect,
                                          const WebPConfig* const encoder_config,
                                          int use_blending,
+                                         WebPEncoderScratch* const scratch,
+                                         WebPAnalysisCache* const analysis,
                                          Candidate* const candidate) {
   WebPConfig config = *encoder_config;
   WebPEncodingError error_code = VP8_ENC_OK;
@@ -815,7 +1023,8 @@ static WebPEncodingError EncodeCandidate(WebPPicture* const sub_frame,
     config.autofilter = 0;
     config.filter_strength = 0;
   }
-  if (!EncodeFrame(&config, sub_frame, &candidate->mem)) {
+  if (!EncodeFrame(&config, sub_frame, scratch, analysis,
+                   &candidate->mem)) {
     error_code = sub_frame->error_code;
     goto Err;
   }
@@ -828,6 +1037,115 @@ static WebPEncodingError EncodeCandidate(WebPPicture* const sub_frame,
   return error_code;
 }
 
+struct CandidateJob {
+  WebPPicture sub_frame;        // Own copy of the sub-frame, as the canvas it
+                                // comes from is modified for other candidates.
+  FrameRectangle rect;
+  WebPConfig config;
+  int use_blending;
+  WebPEncoderScratch* scratch;  // Buffers reused by the jobs of this worker.
+  WebPAnalysisCache* analysis_cache;  // Of this candidate, or NULL.
+  Candidate* candidate;         // Output.
+  WebPEncodingError error_code;
+};
+
+static int CandidateJobHook(void* arg1, void* arg2) {
+  CandidateJob* const job = (CandidateJob*)arg1;
+  (void)arg2;
+  job->error_code = EncodeCandidate(&job->sub_frame, &job->rect, &job->config,
+                                    job->use_blending, job->scratch,
+                                    job->analysis_cache, job->candidate);
+  return 1;  // Errors are reported through 'error_code'.
+}
+
+static int InitWorkers(WebPAnimEncoder* const enc) {
+  const WebPWorkerInterface* const winterface = WebPGetWorkerInterface();
+  const int num_workers = enc->options.candidate_threads;
+  int i;
+  enc->workers =
+      (WebPWorker*)WebPSafeCalloc(num_workers, sizeof(*enc->workers));
+  enc->jobs = (CandidateJob*)WebPSafeCalloc(num_workers, sizeof(*enc->jobs));
+  if (enc->workers == NULL || enc->jobs == NULL) return 0;
+  for (i = 0; i < num_workers; ++i) {
+    WebPWorker* const worker = &enc->workers[i];
+    if (!WebPPictureInit(&enc->jobs[i].sub_frame)) return 0;
+    enc->jobs[i].scratch = WebPEncoderScratchNew();
+    if (enc->jobs[i].scratch == NULL) return 0;
+    winterface->Init(worker);
+    worker->hook = CandidateJobHook;
+    worker->data1 = &enc->jobs[i];
+    worker->data2 = NULL;
+    ++enc->num_workers;  // Only count the workers that need to be ended.
+    if (!winterface->Reset(worker)) return 0;
+  }
+  return 1;
+}
+
+// Waits for the job of worker 'i' and returns its error code.
+static WebPEncodingError WaitForWorker(WebPAnimEncoder* const enc, int i) {
+  CandidateJob* const job = &enc->jobs[i];
+  WebPEncodingError error_code;
+  WebPGetWorkerInterface()->Sync(&enc->workers[i]);
+  error_code = job->error_code;
+  job->error_code = VP8_ENC_OK;
+  WebPPictureFree(&job->sub_frame);
+  return error_code;
+}
+
+static void EndWorkers(WebPAnimEncoder* const enc) {
+  int i;
+  for (i = 0; i < enc->num_workers; ++i) {
+    WebPGetWorkerInterface()->End(&enc->workers[i]);
+    WebPPictureFree(&enc->jobs[i].sub_frame);
+    WebPEncoderScratchDelete(enc->jobs[i].scratch);
+  }
+  WebPSafeFree(enc->workers);
+  WebPSafeFree(enc->jobs);
+}
+
+// Waits for all the candidates started so far to be encoded. Returns the first
+// error met, if any.
+static WebPEncodingError WaitForCandidates(WebPAnimEncoder* const enc) {
+  WebPEncodingError error_code = VP8_ENC_OK;
+  int i;
+  for (i = 0; i < enc->num_workers; ++i) {
+    const WebPEncodingError err = WaitForWorker(enc, i);
+    if (error_code == VP8_ENC_OK) error_code = err;
+  }
+  return error_code;
+}
+
+// Same as EncodeCandidate(), but if the encoder has threads, the candidate is
+// encoded on one of them and is only ready after WaitForCandidates().
+static WebPEncodingError StartCandidate(WebPAnimEncoder* const enc,
+                                        WebPPicture* const sub_frame,
+                                        const FrameRectangle* const rect,
+                                        const WebPConfig* const encoder_config,
+                                        int use_blending,
+                                        WebPAnalysisCache* const analysis_cache,
+                                        Candidate* const candidate) {
+  const int i = enc->next_worker;
+  CandidateJob* const job = &enc->jobs[i];
+  WebPEncodingError error_code;
+  if (enc->num_workers == 0) {
+    return EncodeCandidate(sub_frame, rect, encoder_config, use_blending,
+                           enc->scratch, analysis_cache, candidate);
+  }
+  error_code = WaitForWorker(enc, i);  // Wait for its previous job, if any.
+  if (error_code != VP8_ENC_OK) return error_code;
+  if (!WebPPictureCopy(sub_frame, &job->sub_frame)) {
+    return VP8_ENC_ERROR_OUT_OF_MEMORY;
+  }
+  job->rect = *rect;
+  job->config = *encoder_config;
+  job->use_blending = use_blending;
+  job->analysis_cache = analysis_cache;
+  job->candidate = candidate;
+  WebPGetWorkerInterface()->Launch(&enc->workers[i]);
+  enc->next_worker = (i + 1) % enc->num_workers;
+  return VP8_ENC_OK;
+}
+
 static void CopyCurrentCanvas(WebPAnimEncoder* const enc) {
   if (enc->curr_canvas_copy_modified) {
     WebPCopyPixels(enc->curr_canvas, &enc->curr_canvas_copy);
@@ -865,15 +1183,20 @@ static WebPEncodingError GenerateCandidates(
   WebPPicture* const curr_canvas = &enc->curr_canvas_copy;
   const WebPPicture* const prev_canvas =
       is_dispose_none ? &enc->prev_canvas : &enc->prev_canvas_disposed;
+  WebPAnalysisCache* const analysis_cache =
+      enc->analysis_caches[is_key_frame ? ANALYSIS_KEY_FRAME
+                           : is_dispose_none ? ANALYSIS_SUB_FRAME
+                           : ANALYSIS_SUB_FRAME_BG];
   int use_blending_ll, use_blending_lossy;
   int evaluate_ll, evaluate_lossy;
 
   CopyCurrentCanvas(enc);
+  // Blending checks and the pixel tweaks that go with them need ARGB samples.
   use_blending_ll =
-      !is_key_frame &&
+      !is_key_frame && curr_canvas->use_argb &&
       IsLosslessBlendingPossible(prev_canvas, curr_canvas, &params->rect_ll);
   use_blending_lossy =
-      !is_key_frame &&
+      !is_key_frame && curr_canvas->use_argb &&
       IsLossyBlendingPossible(prev_canvas, curr_canvas, &params->rect_lossy,
                               config_lossy->quality);
 
@@ -897,8 +1220,8 @@ static WebPEncodingError GenerateCandidates(
       enc->curr_canvas_copy_modified =
           IncreaseTransparency(prev_canvas, &params->rect_ll, curr_canvas);
     }
-    error_code = EncodeCandidate(&params->sub_frame_ll, &params->rect_ll,
-                                 config_ll, use_blending_ll, candidate_ll);
+    error_code = StartCandidate(enc, &params->sub_frame_ll, &params->rect_ll,
+                                config_ll, use_blending_ll, NULL, candidate_ll);
     if (error_code != VP8_ENC_OK) return error_code;
   }
   if (evaluate_lossy) {
@@ -909,8 +1232,9 @@ static WebPEncodingError GenerateCandidates(
                                config_lossy->quality);
     }
     error_code =
-        EncodeCandidate(&params->sub_frame_lossy, &params->rect_lossy,
-                        config_lossy, use_blending_lossy, candidate_lossy);
+        StartCandidate(enc, &params->sub_frame_lossy, &params->rect_lossy,
+                       config_lossy, use_blending_lossy, analysis_cache,
+                       candidate_lossy);
     if (error_code != VP8_ENC_OK) return error_code;
     enc->curr_canvas_copy_modified = 1;
   }
@@ -1029,6 +1353,7 @@ static void PickBestCandidate(WebPAnimEncoder* const enc,
   assert(best_idx != -1);
   for (i = 0; i < CANDIDATE_COUNT; ++i) {
     if (candidates[i].evaluate) {
+      ++encoded_frame->num_candidates;
       if (i == best_idx) {
         WebPMuxFrameInfo* const dst = is_key_frame
                                       ? &encoded_frame->key_frame
@@ -1054,20 +1379,30 @@ static void PickBestCandidate(WebPAnimEncoder* const enc,
   }
 }
 
+// Releases the candidates that have been encoded.
+static void ClearCandidates(Candidate* const candidates) {
+  int i;
+  for (i = 0; i < CANDIDATE_COUNT; ++i) {
+    if (candidates[i].evaluate) {
+      WebPMemoryWriterClear(&candidates[i].mem);
+      candidates[i].evaluate = 0;
+    }
+  }
+}
+
 // Depending on the configuration, tries different compressions
 // (lossy/lossless), dispose methods, blending methods etc to encode the current
-// frame and outputs the best one in 'encoded_frame'.
+// frame into 'candidates'. They may still be encoding on the encoder threads
+// when this returns; FinishFrame() picks the best one.
 // 'frame_skipped' will be set to true if this frame should actually be skipped.
-static WebPEncodingError SetFrame(WebPAnimEncoder* const enc,
-                                  const WebPConfig* const config,
-                                  int is_key_frame,
-                                  EncodedFrame* const encoded_frame,
-                                  int* const frame_skipped) {
-  int i;
+static WebPEncodingError StartFrame(WebPAnimEncoder* const enc,
+                                    const WebPConfig* const config,
+                                    int is_key_frame,
+                                    Candidate candidates[CANDIDATE_COUNT],
+                                    int* const frame_skipped) {
   WebPEncodingError error_code = VP8_ENC_OK;
   const WebPPicture* const curr_canvas = &enc->curr_canvas_copy;
   const WebPPicture* const prev_canvas = &enc->prev_canvas;
-  Candidate candidates[CANDIDATE_COUNT];
   const int is_lossless = config->lossless;
   const int consider_lossless = is_lossless || enc->options.allow_mixed;
   const int consider_lossy = !is_lossless || enc->options.allow_mixed;
@@ -1108,7 +1443,7 @@ static WebPEncodingError SetFrame(WebPAnimEncoder* const enc,
     return VP8_ENC_ERROR_INVALID_CONFIGURATION;
   }
 
-  memset(candidates, 0, sizeof(candidates));
+  memset(candidates, 0, CANDIDATE_COUNT * sizeof(*candidates));
 
   // Change-rectangle assuming previous frame was DISPOSE_NONE.
   if (!GetSubRects(prev_canvas, curr_canvas, is_key_frame, is_first_frame,
@@ -1172,16 +1507,11 @@ static WebPEncodingError SetFrame(WebPAnimEncoder* const enc,
     if (error_code != VP8_ENC_OK) goto Err;
   }
 
-  PickBestCandidate(enc, candidates, is_key_frame, encoded_frame);
-
   goto End;
 
  Err:
-  for (i = 0; i < CANDIDATE_COUNT; ++i) {
-    if (candidates[i].evaluate) {
-      WebPMemoryWriterClear(&candidates[i].mem);
-    }
-  }
+  WaitForCandidates(enc);
+  ClearCandidates(candidates);
 
  End:
   SubFrameParamsFree(&dispose_none_params);
@@ -1189,6 +1519,34 @@ static WebPEncodingError SetFrame(WebPAnimEncoder* const enc,
   return error_code;
 }
 
+// Waits for the candidates started by StartFrame() and outputs the best one in
+// 'encoded_frame'.
+static WebPEncodingError FinishFrame(WebPAnimEncoder* const enc,
+                                     Candidate candidates[CANDIDATE_COUNT],
+                                     int is_key_frame,
+                                     EncodedFrame* const encoded_frame) {
+  const WebPEncodingError error_code = WaitForCandidates(enc);
+  if (error_code != VP8_ENC_OK) {
+    ClearCandidates(candidates);
+    return error_code;
+  }
+  PickBestCandidate(enc, candidates, is_key_frame, encoded_frame);
+  return VP8_ENC_OK;
+}
+
+// Encodes the current frame and outputs the best candidate in 'encoded_frame'.
+static WebPEncodingError SetFrame(WebPAnimEncoder* const enc,
+                                  const WebPConfig* const config,
+                                  int is_key_frame,
+                                  EncodedFrame* const encoded_frame,
+                                  int* const frame_skipped) {
+  Candidate candidates[CANDIDATE_COUNT];
+  const WebPEncodingError error_code =
+      StartFrame(enc, config, is_key_frame, candidates, frame_skipped);
+  if (error_code != VP8_ENC_OK || *frame_skipped) return error_code;
+  return FinishFrame(enc, candidates, is_key_frame, encoded_frame);
+}
+
 // Calculate the penalty incurred if we encode given frame as a key frame
 // instead of a sub-frame.
 static int64_t KeyFramePenalty(const EncodedFrame* const encoded_frame) {
@@ -1196,10 +1554,301 @@ static int64_t KeyFramePenalty(const EncodedFrame* const encoded_frame) {
           encoded_frame->sub_frame.bitstream.size);
 }
 
+// Returns a cheap estimate of the cost of encoding 'pic' as a key-frame: the
+// sum of the horizontal gradients of the green (or luma) and alpha samples of
+// every other row. Each sample adds 1 so that flat pictures don't give 0.
+static uint64_t PictureActivity(const WebPPicture* const pic) {
+  uint64_t activity = 0;
+  int x, y;
+  for (y = 0; y < pic->height; y += 2) {
+    activity += pic->width;
+    if (pic->use_argb) {
+      const uint32_t* const row = pic->argb + y * pic->argb_stride;
+      for (x = 1; x < pic->width; ++x) {
+        const int dg = (int)((row[x] >> 8) & 0xff) -
+                       (int)((row[x - 1] >> 8) & 0xff);
+        const int da = (int)(row[x] >> 24) - (int)(row[x - 1] >> 24);
+        activity += abs(dg) + abs(da);
+      }
+    } else {
+      const uint8_t* const luma = pic->y + y * pic->y_stride;
+      const uint8_t* const alpha =
+          (pic->a != NULL) ? pic->a + y * pic->a_stride : NULL;
+      for (x = 1; x < pic->width; ++x) {
+        activity += abs(luma[x] - luma[x - 1]);
+        if (alpha != NULL) activity += abs(alpha[x] - alpha[x - 1]);
+      }
+    }
+  }
+  return activity;
+}
+
+// Returns the key-frame size predicted for a frame of the given 'activity',
+// scaling the last key-frame encoded in full. Returns 0 if there is none yet.
+static int64_t PredictKeyFrameSize(const WebPAnimEncoder* const enc,
+                                   uint64_t activity) {
+  if (enc->last_key_size == 0) return 0;
+  return (int64_t)((double)enc->last_key_size * activity /
+                   enc->last_key_activity);
+}
+
+// Returns true if the current frame, whose sub-frame is already encoded in
+// 'encoded_frame', could be picked as a key-frame and so must be encoded as
+// one. It is skipped only if the predicted key-frame penalty is worse than the
+// best one by more than the recent prediction error, less the tolerance.
+static int ShouldEncodeKeyFrame(const WebPAnimEncoder* const enc,
+                                const EncodedFrame* const encoded_frame,
+                                uint64_t activity) {
+  const int64_t predicted_size = PredictKeyFrameSize(enc, activity);
+  const int margin_percent = enc->key_error - enc->options.keyframe_tolerance;
+  const int64_t margin =
+      (margin_percent > 0) ? predicted_size * margin_percent / 100 : 0;
+  if (predicted_size == 0 || enc->best_delta == DELTA_INFINITY) return 1;
+  return (predicted_size - (int64_t)encoded_frame->sub_frame.bitstream.size -
+          margin <= enc->best_delta);
+}
+
+// Calibrates the key-frame size prediction with a frame of the given
+// 'activity' that was just encoded as a key-frame in 'encoded_frame'.
+static void UpdateKeyFramePrediction(WebPAnimEncoder* const enc,
+                                     const EncodedFrame* const encoded_frame,
+                                     uint64_t activity) {
+  const size_t size = encoded_frame->key_frame.bitstream.size;
+  const int64_t predicted_size = PredictKeyFrameSize(enc, activity);
+  if (size == 0) return;
+  if (predicted_size > 0) {
+    const int64_t error = predicted_size - (int64_t)size;
+    const int error_percent =
+        (int)((error < 0 ? -error : error) * 100 / (int64_t)size);
+    // The margin follows the worst recent errors and slowly decays.
+    enc->key_error = enc->key_error * 3 / 4;
+    if (error_percent > enc->key_error) {
+      enc->key_error = (error_percent > 100) ? 100 : error_percent;
+    }
+  }
+  enc->last_key_size = size;
+  enc->last_key_activity = activity;
+}
+
+// Returns the sum of squared differences of the 'len' samples of 'a' and 'b'.
+static WEBP_INLINE uint64_t SamplesSSE(const uint8_t* a, const uint8_t* b,
+                                       int len) {
+#if !defined(WEBP_DISABLE_STATS)
+  return VP8AccumulateSSE(a, b, len);
+#else
+  uint64_t sse = 0;
+  int i;
+  for (i = 0; i < len; ++i) sse += (a[i] - b[i]) * (a[i] - b[i]);
+  return sse;
+#endif
+}
+
+static double SSEToPSNR(uint64_t sse, uint64_t count) {
+  if (sse == 0) return MAX_PSNR;
+  return 10. * log10(255. * 255. * count / sse);
+}
+
+#define CHANGE_BLOCK_SIZE 32
+
+// Computes the PSNR, in dB, of 'curr' against 'prev' over 'rect' in '*psnr',
+// and the lowest PSNR of its blocks in '*min_block_psnr', so that a local
+// change is not lost in the average. ARGB canvases compare all the channels,
+// YUV(A) ones the luma and alpha planes.
+static void ChangePSNR(const WebPPicture* const prev,
+                       const WebPPicture* const curr,
+                       const FrameRectangle* const rect,
+                       double* const psnr, double* const min_block_psnr) {
+  const int x_end = rect->x_offset + rect->width;
+  const int y_end = rect->y_offset + rect->height;
+  const int has_alpha = (prev->a != NULL && curr->a != NULL);
+  uint64_t total_sse = 0, total_count = 0;
+  int x, y, j;
+  *min_block_psnr = MAX_PSNR;
+  for (y = rect->y_offset; y < y_end; y += CHANGE_BLOCK_SIZE) {
+    const int h = (y_end - y < CHANGE_BLOCK_SIZE) ? y_end - y
+                                                  : CHANGE_BLOCK_SIZE;
+    for (x = rect->x_offset; x < x_end; x += CHANGE_BLOCK_SIZE) {
+      const int w = (x_end - x < CHANGE_BLOCK_SIZE) ? x_end - x
+                                                    : CHANGE_BLOCK_SIZE;
+      uint64_t sse = 0, count = 0;
+      double block_psnr;
+      for (j = y; j < y + h; ++j) {
+        if (curr->use_argb) {
+          sse += SamplesSSE(
+              (const uint8_t*)&prev->argb[j * prev->argb_stride + x],
+              (const uint8_t*)&curr->argb[j * curr->argb_stride + x], 4 * w);
+          count += 4 * w;
+        } else {
+          sse += SamplesSSE(&prev->y[j * prev->y_stride + x],
+                            &curr->y[j * curr->y_stride + x], w);
+          count += w;
+          if (has_alpha) {
+            sse += SamplesSSE(&prev->a[j * prev->a_stride + x],
+                              &curr->a[j * curr->a_stride + x], w);
+            count += w;
+          }
+        }
+      }
+      block_psnr = SSEToPSNR(sse, count);
+      if (block_psnr < *min_block_psnr) *min_block_psnr = block_psnr;
+      total_sse += sse;
+      total_count += count;
+    }
+  }
+  *psnr = SSEToPSNR(total_sse, total_count);
+}
+
+#undef CHANGE_BLOCK_SIZE
+
+// Returns true if the current frame, whose change from the previous canvas
+// covers 'rect' with the given 'psnr', should be dropped: its sub-frame is
+// predicted to take more bytes than the change it shows is worth.
+static int ShouldDecimateFrame(const WebPAnimEncoder* const enc,
+                               const FrameRectangle* const rect, double psnr) {
+  const double area = (double)RectArea(rect);
+  // Squared error of the change, in pixels changed from 0 to 255.
+  const double change = area / pow(10., psnr / 10.);
+  const double predicted_size = area * enc->sub_frame_cost / 256.;
+  if (enc->sub_frame_cost == 0 ||
+      enc->decimated_count >= MAX_DECIMATED_FRAMES) {
+    return 0;
+  }
+  return (predicted_size * enc->options.decimate_cost > change * 1024.);
+}
+
+// Calibrates the sub-frame size prediction with a sub-frame of 'size' bytes
+// whose change rectangle is 'rect'.
+static void UpdateSubFrameCost(WebPAnimEncoder* const enc,
+                               const FrameRectangle* const rect, size_t size) {
+  const uint32_t cost = (uint32_t)((uint64_t)size * 256 / RectArea(rect));
+  enc->sub_frame_cost = (enc->sub_frame_cost == 0)
+                            ? cost
+                            : (enc->sub_frame_cost * 3 + cost) / 4;
+}
+
+// Rate control: with 'options.target_size', the quality of each lossy frame is
+// picked so that the rest of the budget lasts until 'target_duration', from
+// the recent sizes per ms. Frame sizes are modeled as exp(RC_SLOPE * quality).
+// Some frames are weighted, i.e. given more bytes than the others.
+
+#define RC_SLOPE 0.025          // ln(size) change per quality point
+#define RC_DECAY 0.875          // weight of the past in 'rc_bytes', 'rc_time'
+#define RC_MAX_STEP 10.         // largest quality change between frames
+#define RC_KEY_FRAME_WEIGHT 1.5  // first frame and scene cuts, that the next
+                                 // frames build on
+#define RC_STATIC_WEIGHT 1.25   // frames changing less than a quarter of the
+                                // canvas, which is then seen for longer
+
+static int UseRateControl(const WebPAnimEncoder* const enc,
+                          const WebPConfig* const config) {
+  return (enc->options.target_size > 0 && !config->lossless);
+}
+
+// Returns the size of the frames output or held by 'enc', counting the
+// variant picked so far for the undecided ones.
+static size_t SpentSize(const WebPAnimEncoder* const enc) {
+  size_t size = enc->frames_size;
+  size_t i;
+  for (i = 0; i < enc->count; ++i) {
+    const EncodedFrame* const frame = GetFrame(enc, i);
+    size += frame->is_key_frame ? frame->key_frame.bitstream.size
+                                : frame->sub_frame.bitstream.size;
+  }
+  return size;
+}
+
+// Adds the frame before the one at 'timestamp' to the size model and picks
+// 'rc_quality' for the frame at 'timestamp'.
+static void UpdateRateControl(WebPAnimEncoder* const enc,
+                              const WebPConfig* const config, int timestamp) {
+  const int elapsed = timestamp - enc->first_timestamp;
+  const int duration = timestamp - enc->prev_timestamp;
+  const double max_quality = config->quality;
+  const double min_quality =
+      (config->qmin < max_quality) ? config->qmin : max_quality;
+  double quality;
+  if (enc->is_first_frame) {
+    enc->rc_quality = config->quality;
+    return;
+  }
+  enc->rc_bytes = enc->rc_bytes * RC_DECAY + enc->rc_new_bytes;
+  enc->rc_time = enc->rc_time * RC_DECAY + duration;
+  enc->rc_new_bytes = 0.;
+  if (enc->rc_bytes <= 0. || enc->rc_time <= 0.) return;
+  {
+    const double left_size =
+        (double)enc->options.target_size - (double)SpentSize(enc);
+    const int left_time = enc->options.target_duration - elapsed;
+    if (left_size <= 0.) {
+      quality = min_quality;
+    } else {
+      // The frames to come take as many bytes per ms as the recent ones.
+      const double rate = left_size / ((left_time > duration) ? left_time
+                                       : (duration > 0) ? duration : 1);
+      quality = max_quality +
+                log(rate * enc->rc_time / enc->rc_bytes) / RC_SLOPE;
+    }
+  }
+  if (quality > enc->rc_quality + RC_MAX_STEP) {
+    quality = enc->rc_quality + RC_MAX_STEP;
+  } else if (quality < enc->rc_quality - RC_MAX_STEP) {
+    quality = enc->rc_quality - RC_MAX_STEP;
+  }
+  enc->rc_quality = (float)((quality < min_quality) ? min_quality
+                            : (quality > max_quality) ? max_quality
+                            : quality);
+}
+
+// Returns 'config', or a copy of it in 'tmp' with the quality picked by the
+// rate control for a frame of the given 'weight'.
+static const WebPConfig* RateControlConfig(const WebPAnimEncoder* const enc,
+                                           const WebPConfig* const config,
+                                           double weight,
+                                           WebPConfig* const tmp) {
+  const float quality = enc->rc_quality + (float)(log(weight) / RC_SLOPE);
+  if (!UseRateControl(enc, config)) return config;
+  *tmp = *config;
+  tmp->quality = (quality < config->quality) ? quality : config->quality;
+  return tmp;
+}
+
+// Returns the weight of a frame changing 'rect' from the previous canvas.
+static double RateControlWeight(const WebPAnimEncoder* const enc,
+                                const FrameRectangle* const rect,
+                                int is_scene_cut) {
+  if (is_scene_cut) return RC_KEY_FRAME_WEIGHT;
+  if ((uint64_t)RectArea(rect) * 4 <
+      (uint64_t)enc->canvas_width * enc->canvas_height) {
+    return RC_STATIC_WEIGHT;
+  }
+  return 1.;
+}
+
+// Records the size of the frame just encoded in 'encoded_frame' with
+// 'config', as if it had been encoded at the quality of 'base_config'.
+static void RecordRateControl(WebPAnimEncoder* const enc,
+                              const WebPConfig* const base_config,
+                              const WebPConfig* const config,
+                              const EncodedFrame* const encoded_frame) {
+  const size_t size = encoded_frame->is_key_frame
+                          ? encoded_frame->key_frame.bitstream.size
+                          : encoded_frame->sub_frame.bitstream.size;
+  if (!UseRateControl(enc, base_config)) return;
+  enc->rc_new_bytes =
+      size * exp(RC_SLOPE * (base_config->quality - config->quality));
+}
+
+#undef RC_SLOPE
+#undef RC_DECAY
+#undef RC_MAX_STEP
+
 static int CacheFrame(WebPAnimEncoder* const enc,
                       const WebPConfig* const config) {
   int ok = 0;
   int frame_skipped = 0;
+  WebPConfig weighted_config;
+  const WebPConfig* frame_config = config;  // 'config' with the quality
+                                            // picked by the rate control
   WebPEncodingError error_code = VP8_ENC_OK;
   const size_t position = enc->count;
   EncodedFrame* const encoded_frame = GetFrame(enc, position);
@@ -1207,48 +1856,153 @@ static int CacheFrame(WebPAnimEncoder* const enc,
   ++enc->count;
 
   if (enc->is_first_frame) {  // Add this as a key-frame.
-    error_code = SetFrame(enc, config, 1, encoded_frame, &frame_skipped);
+    frame_config = RateControlConfig(enc, config, RC_KEY_FRAME_WEIGHT,
+                                     &weighted_config);
+    error_code =
+        SetFrame(enc, frame_config, 1, encoded_frame, &frame_skipped);
     if (error_code != VP8_ENC_OK) goto End;
     assert(frame_skipped == 0);  // First frame can't be skipped, even if empty.
     assert(position == 0 && enc->count == 1);
+    if (enc->options.keyframe_tolerance > 0) {
+      UpdateKeyFramePrediction(enc, encoded_frame,
+                               PictureActivity(enc->curr_canvas));
+    }
     encoded_frame->is_key_frame = 1;
     enc->flush_count = 0;
     enc->count_since_key_frame = 0;
     enc->prev_candidate_undecided = 0;
   } else {
+    int is_scene_cut = 0;
+    const int decimate = (!config->lossless && enc->options.decimate_cost > 0);
+    const int rate_control = UseRateControl(enc, config);
+    FrameRectangle rect = { 0, 0, 0, 0 };
     ++enc->count_since_key_frame;
-    if (enc->count_since_key_frame <= enc->options.kmin) {
+    if (enc->options.merge_threshold > 0 ||
+        enc->options.scene_cut_threshold > 0 || decimate || rate_control) {
+      rect.width = enc->canvas_width;
+      rect.height = enc->canvas_height;
+      MinimizeChangeRectangle(&enc->prev_canvas, enc->curr_canvas, &rect,
+                              config->lossless, config->quality);
+      if (!IsEmptyRect(&rect)) {  // Empty ones are skipped by SetFrame().
+        double psnr, min_block_psnr;
+        ChangePSNR(&enc->prev_canvas, enc->curr_canvas, &rect, &psnr,
+                   &min_block_psnr);
+        if (!config->lossless && enc->options.merge_threshold > 0 &&
+            min_block_psnr >= enc->options.merge_threshold) {
+          // Merge it into the previous frame. The next frames are still
+          // compared to the previous one, so changes can't add up unseen.
+          frame_skipped = 1;
+          goto Skip;
+        }
+        is_scene_cut = (psnr < enc->options.scene_cut_threshold &&
+                        (uint64_t)RectArea(&rect) * 4 >=
+                            (uint64_t)enc->canvas_width *
+                                enc->canvas_height * 3);
+        if (decimate && !is_scene_cut &&
+            ShouldDecimateFrame(enc, &rect, psnr)) {
+          // Drop it like a merged frame. The next frame is compared to the
+          // same previous one, so a lasting change is encoded eventually.
+          ++enc->decimated_count;
+          frame_skipped = 1;
+          goto Skip;
+        }
+      }
+    }
+    if (rate_control) {
+      frame_config =
+          RateControlConfig(enc, config,
+                            RateControlWeight(enc, &rect, is_scene_cut),
+                            &weighted_config);
+    }
+    if (is_scene_cut) {
+      // Start over from a key-frame: nothing before it helps. The frames
+      // cached so far keep the key-frame picked among them, if any.
+      error_code =
+          SetFrame(enc, frame_config, 1, encoded_frame, &frame_skipped);
+      if (error_code != VP8_ENC_OK) goto End;
+      assert(frame_skipped == 0);  // Key-frame cannot be an empty rectangle.
+      if (enc->options.keyframe_tolerance > 0) {
+        UpdateKeyFramePrediction(enc, encoded_frame,
+                                 PictureActivity(enc->curr_canvas));
+      }
+      encoded_frame->is_key_frame = 1;
+      enc->flush_count = enc->count - 1;
+      enc->count_since_key_frame = 0;
+      enc->keyframe = KEYFRAME_NONE;
+      enc->best_delta = DELTA_INFINITY;
+      enc->prev_candidate_undecided = 0;
+    } else if (enc->count_since_key_frame <= enc->options.kmin) {
       // Add this as a frame rectangle.
-      error_code = SetFrame(enc, config, 0, encoded_frame, &frame_skipped);
+      error_code =
+          SetFrame(enc, frame_config, 0, encoded_frame, &frame_skipped);
       if (error_code != VP8_ENC_OK) goto End;
       if (frame_skipped) goto Skip;
       encoded_frame->is_key_frame = 0;
       enc->flush_count = enc->count - 1;
       enc->prev_candidate_undecided = 0;
     } else {
-      int64_t curr_delta;
+      int64_t curr_delta = 0;
+      int key_frame_encoded = 1;
       FrameRectangle prev_rect_key, prev_rect_sub;
+      Candidate sub_candidates[CANDIDATE_COUNT];
+      Candidate key_candidates[CANDIDATE_COUNT];
 
       // Add this as a frame rectangle to enc.
-      error_code = SetFrame(enc, config, 0, encoded_frame, &frame_skipped);
+      error_code =
+          StartFrame(enc, frame_config, 0, sub_candidates, &frame_skipped);
       if (error_code != VP8_ENC_OK) goto End;
       if (frame_skipped) goto Skip;
-      prev_rect_sub = enc->prev_rect;
 
+      if (enc->options.keyframe_tolerance > 0) {
+        // Only encode the key-frame if its predicted size makes it a
+        // contender, which needs the size of the sub-frame first.
+        const uint64_t activity = PictureActivity(enc->curr_canvas);
+        error_code = FinishFrame(enc, sub_candidates, 0, encoded_frame);
+        if (error_code != VP8_ENC_OK) goto End;
+        prev_rect_sub = prev_rect_key = enc->prev_rect;
+        key_frame_encoded =
+            ShouldEncodeKeyFrame(enc, encoded_frame, activity);
+        if (key_frame_encoded) {
+          error_code =
+              SetFrame(enc, frame_config, 1, encoded_frame, &frame_skipped);
+          if (error_code != VP8_ENC_OK) goto End;
+          assert(frame_skipped == 0);  // Key-frame can't be an empty rectangle.
+          prev_rect_key = enc->prev_rect;
+          UpdateKeyFramePrediction(enc, encoded_frame, activity);
+        }
+      } else {
+        // Add this as a key-frame to enc, too. Its candidates don't depend on
+        // the sub-frame ones, so with threads both are encoded at the same
+        // time.
+        error_code =
+            StartFrame(enc, frame_config, 1, key_candidates, &frame_skipped);
+        if (error_code != VP8_ENC_OK) {
+          WaitForCandidates(enc);
+          ClearCandidates(sub_candidates);
+          goto End;
+        }
+        assert(frame_skipped == 0);  // Key-frame cannot be an empty rectangle.
 
-      // Add this as a key-frame to enc, too.
-      error_code = SetFrame(enc, config, 1, encoded_frame, &frame_skipped);
-      if (error_code != VP8_ENC_OK) goto End;
-      assert(frame_skipped == 0);  // Key-frame cannot be an empty rectangle.
-      prev_rect_key = enc->prev_rect;
+        error_code = FinishFrame(enc, sub_candidates, 0, encoded_frame);
+        if (error_code != VP8_ENC_OK) {
+          ClearCandidates(key_candidates);  // Already waited for.
+          goto End;
+        }
+        prev_rect_sub = enc->prev_rect;
+        error_code = FinishFrame(enc, key_candidates, 1, encoded_frame);
+        if (error_code != VP8_ENC_OK) goto End;
+        prev_rect_key = enc->prev_rect;
+      }
 
       // Analyze size difference of the two variants.
-      curr_delta = KeyFramePenalty(encoded_frame);
-      if (curr_delta <= enc->best_delta) {  // Pick this as the key-frame.
+      if (key_frame_encoded) curr_delta = KeyFramePenalty(encoded_frame);
+      if (key_frame_encoded && curr_delta <= enc->best_delta) {
+        // Pick this as the key-frame.
         if (enc->keyframe != KEYFRAME_NONE) {
           EncodedFrame* const old_keyframe = GetFrame(enc, enc->keyframe);
           assert(old_keyframe->is_key_frame);
           old_keyframe->is_key_frame = 0;
+          WebPDataClear(&old_keyframe->key_frame.bitstream);
         }
         encoded_frame->is_key_frame = 1;
         enc->prev_candidate_undecided = 1;
@@ -1256,8 +2010,11 @@ static int CacheFrame(WebPAnimEncoder* const enc,
         enc->best_delta = curr_delta;
         enc->flush_count = enc->count - 1;  // We can flush previous frames.
       } else {
+        // Only the last frame can still be picked: drop its key-frame now
+        // rather than keep it until the frame is output.
         encoded_frame->is_key_frame = 0;
         enc->prev_candidate_undecided = 0;
+        WebPDataClear(&encoded_frame->key_frame.bitstream);
       }
       // Note: We need '>=' below because when kmin and kmax are both zero,
       // count_since_key_frame will always be > kmax.
@@ -1272,8 +2029,17 @@ static int CacheFrame(WebPAnimEncoder* const enc,
             encoded_frame->is_key_frame ? prev_rect_key : prev_rect_sub;
       }
     }
+    if (decimate && encoded_frame->sub_frame.bitstream.size > 0 &&
+        !IsEmptyRect(&rect)) {
+      UpdateSubFrameCost(enc, &rect, encoded_frame->sub_frame.bitstream.size);
+    }
+    enc->decimated_count = 0;
   }
 
+  encoded_frame->num_input_frames = 1;
+  encoded_frame->quality = frame_config->quality;
+  RecordRateControl(enc, config, frame_config, encoded_frame);
+
   // Update previous to previous and previous canvases for next call.
   WebPCopyPixels(enc->curr_canvas, &enc->prev_canvas);
   enc->is_first_frame = 0;
@@ -1288,6 +2054,8 @@ static int CacheFrame(WebPAnimEncoder* const enc,
     // We reset some counters, as the frame addition failed/was skipped.
     --enc->count;
     if (!enc->is_first_frame) --enc->count_since_key_frame;
+    // A skipped frame is shown by the previous one, which is still cached.
+    if (ok) ++GetFrame(enc, enc->count - 1)->num_input_frames;
     if (!ok) {
       MarkError2(enc, "ERROR adding frame. WebPEncodingError", error_code);
     }
@@ -1297,24 +2065,237 @@ static int CacheFrame(WebPAnimEncoder* const enc,
   return ok;
 }
 
+#undef MAX_PSNR
+#undef MAX_DECIMATED_FRAMES
+#undef RC_KEY_FRAME_WEIGHT
+#undef RC_STATIC_WEIGHT
+
+// -----------------------------------------------------------------------------
+// Streaming output.
+
+// Offset and size of what FinishOutput() rewrites: the RIFF header, and the
+// VP8X chunk header and flags.
+#define OUTPUT_PATCH_SIZE (RIFF_HEADER_SIZE + CHUNK_HEADER_SIZE + 4)
+
+int WebPAnimEncoderSetWriter(WebPAnimEncoder* enc,
+                             WebPAnimEncoderWriterFunction writer,
+                             void* user_data) {
+  if (enc == NULL || writer == NULL) return 0;
+  if (enc->in_frame_count > 0) {
+    MarkError(enc, "ERROR setting writer: frames were already added");
+    return 0;
+  }
+  enc->writer = writer;
+  enc->writer_data = user_data;
+  return 1;
+}
+
+static int WriteOutput(WebPAnimEncoder* const enc, const uint8_t* const data,
+                       size_t size, size_t offset) {
+  if (!enc->writer(data, size, offset, enc->writer_data)) {
+    MarkError(enc, "ERROR writing output");
+    return 0;
+  }
+  return 1;
+}
+
+// Writes the RIFF header and the VP8X, ICCP and ANIM chunks. The RIFF size and
+// the VP8X flags are only known at the end and are rewritten by FinishOutput().
+static int WriteOutputHeader(WebPAnimEncoder* const enc) {
+  const WebPMux* const mux = enc->mux;
+  const WebPMuxAnimParams* const params = &enc->options.anim_params;
+  const size_t iccp_size = ChunkListDiskSize(mux->iccp);
+  const size_t size = RIFF_HEADER_SIZE + CHUNK_HEADER_SIZE + VP8X_CHUNK_SIZE +
+                      iccp_size + CHUNK_HEADER_SIZE + ANIM_CHUNK_SIZE;
+  uint8_t* data;
+  uint8_t* dst;
+  int ok;
+
+  if (params->loop_count < 0 || params->loop_count >= MAX_LOOP_COUNT) {
+    MarkError2(enc, "ERROR writing output header", WEBP_MUX_INVALID_ARGUMENT);
+    return 0;
+  }
+  data = (uint8_t*)WebPSafeMalloc(1ULL, size);
+  if (data == NULL) {
+    MarkError2(enc, "ERROR writing output header", WEBP_MUX_MEMORY_ERROR);
+    return 0;
+  }
+  enc->output_flags = ANIMATION_FLAG;
+  if (iccp_size > 0) enc->output_flags |= ICCP_FLAG;
+
+  dst = MuxEmitRiffHeader(data, size);  // The size is rewritten at the end.
+  PutLE32(dst, kChunks[IDX_VP8X].tag);
+  PutLE32(dst + TAG_SIZE, VP8X_CHUNK_SIZE);
+  PutLE32(dst + CHUNK_HEADER_SIZE, enc->output_flags);
+  PutLE24(dst + CHUNK_HEADER_SIZE + 4, enc->canvas_width - 1);
+  PutLE24(dst + CHUNK_HEADER_SIZE + 7, enc->canvas_height - 1);
+  dst += CHUNK_HEADER_SIZE + VP8X_CHUNK_SIZE;
+  dst = ChunkListEmit(mux->iccp, dst);
+  PutLE32(dst, kChunks[IDX_ANIM].tag);
+  PutLE32(dst + TAG_SIZE, ANIM_CHUNK_SIZE);
+  PutLE32(dst + CHUNK_HEADER_SIZE, params->bgcolor);
+  PutLE16(dst + CHUNK_HEADER_SIZE + 4, params->loop_count);
+  assert(dst + CHUNK_HEADER_SIZE + ANIM_CHUNK_SIZE == data + size);
+
+  ok = WriteOutput(enc, data, size, 0);
+  enc->output_size = size;
+  WebPSafeFree(data);
+  return ok;
+}
+
+// Writes the frame that was just pushed to the muxer, and drops it from there.
+static int WriteOutputFrame(WebPAnimEncoder* const enc) {
+  WebPMuxImage* const wpi = enc->mux->images;
+  size_t size;
+  uint8_t* data;
+  int ok;
+  assert(wpi != NULL && wpi->next == NULL);
+
+  if (enc->output_size == 0 && !WriteOutputHeader(enc)) return 0;
+  size = MuxImageDiskSize(wpi);
+  if (enc->output_size + size > MAX_CHUNK_PAYLOAD) {
+    MarkError2(enc, "ERROR writing frame", WEBP_MUX_INVALID_ARGUMENT);
+    return 0;
+  }
+  data = (uint8_t*)WebPSafeMalloc(1ULL, size);
+  if (data == NULL) {
+    MarkError2(enc, "ERROR writing frame", WEBP_MUX_MEMORY_ERROR);
+    return 0;
+  }
+  MuxImageEmit(wpi, data);
+  ok = WriteOutput(enc, data, size, enc->output_size);
+  WebPSafeFree(data);
+  enc->output_size += size;
+  if (MuxHasAlpha(wpi)) enc->output_flags |= ALPHA_FLAG;
+  return ok && MuxImageDeleteNth(&enc->mux->images, 1) == WEBP_MUX_OK;
+}
+
+// Writes the EXIF, XMP and unknown chunks, then the final RIFF size and VP8X
+// flags.
+static int FinishOutput(WebPAnimEncoder* const enc) {
+  const WebPMux* const mux = enc->mux;
+  const size_t trailer_size = ChunkListDiskSize(mux->exif) +
+                              ChunkListDiskSize(mux->xmp) +
+                              ChunkListDiskSize(mux->unknown);
+  uint8_t header[OUTPUT_PATCH_SIZE];
+  assert(enc->output_size > 0);
+
+  if (trailer_size > 0) {
+    uint8_t* dst;
+    uint8_t* const data = (uint8_t*)WebPSafeMalloc(1ULL, trailer_size);
+    int ok;
+    if (data == NULL) {
+      MarkError2(enc, "ERROR writing output", WEBP_MUX_MEMORY_ERROR);
+      return 0;
+    }
+    dst = ChunkListEmit(mux->exif, data);
+    dst = ChunkListEmit(mux->xmp, dst);
+    dst = ChunkListEmit(mux->unknown, dst);
+    assert(dst == data + trailer_size);
+    (void)dst;
+    ok = WriteOutput(enc, data, trailer_size, enc->output_size);
+    WebPSafeFree(data);
+    if (!ok) return 0;
+    enc->output_size += trailer_size;
+    if (mux->exif != NULL) enc->output_flags |= EXIF_FLAG;
+    if (mux->xmp != NULL) enc->output_flags |= XMP_FLAG;
+  }
+  if (enc->output_size > MAX_CHUNK_PAYLOAD) {
+    MarkError2(enc, "ERROR writing output", WEBP_MUX_INVALID_ARGUMENT);
+    return 0;
+  }
+
+  MuxEmitRiffHeader(header, enc->output_size);
+  PutLE32(header + RIFF_HEADER_SIZE, kChunks[IDX_VP8X].tag);
+  PutLE32(header + RIFF_HEADER_SIZE + TAG_SIZE, VP8X_CHUNK_SIZE);
+  PutLE32(header + RIFF_HEADER_SIZE + CHUNK_HEADER_SIZE, enc->output_flags);
+  return WriteOutput(enc, header, sizeof(header), 0);
+}
+
+#undef OUTPUT_PATCH_SIZE
+
+// -----------------------------------------------------------------------------
+// Statistics.
+
+int WebPAnimEncoderSetFrameStatsHook(WebPAnimEncoder* enc,
+                                     WebPAnimEncoderFrameStatsFunction hook,
+                                     void* user_data) {
+  if (enc == NULL) return 0;
+  enc->stats_hook = hook;
+  enc->stats_data = user_data;
+  return 1;
+}
+
+// Reports the statistics of 'frame', which is being flushed as 'info' out of
+// 'buffered_frames' frames of 'buffered_size' bytes.
+static void ReportFrameStats(const WebPAnimEncoder* const enc,
+                             const EncodedFrame* const frame,
+                             const WebPMuxFrameInfo* const info,
+                             int buffered_frames, size_t buffered_size) {
+  WebPAnimEncoderFrameStats stats;
+  WebPBitstreamFeatures features;
+  memset(&stats, 0, sizeof(stats));
+  if (WebPGetFeatures(info->bitstream.bytes, info->bitstream.size,
+                      &features) == VP8_STATUS_OK) {
+    stats.width = features.width;
+    stats.height = features.height;
+    stats.lossless = (features.format == 2);
+  }
+  stats.is_key_frame = frame->is_key_frame;
+  stats.x_offset = info->x_offset;
+  stats.y_offset = info->y_offset;
+  stats.duration = info->duration;
+  stats.num_candidates = frame->num_candidates;
+  stats.num_input_frames = frame->num_input_frames;
+  stats.blend_method = info->blend_method;
+  stats.dispose_method = info->dispose_method;
+  stats.size = info->bitstream.size;
+  stats.buffered_frames = buffered_frames;
+  stats.buffered_size = buffered_size;
+  stats.quality = frame->quality;
+  enc->stats_hook(&stats, enc->stats_data);
+}
+
+// Returns the size of the encoded frames held by 'enc', in bytes.
+static size_t BufferedSize(const WebPAnimEncoder* const enc) {
+  size_t size = 0;
+  size_t i;
+  for (i = 0; i < enc->count; ++i) {
+    const EncodedFrame* const frame = GetFrame(enc, i);
+    size += frame->sub_frame.bitstream.size + frame->key_frame.bitstream.size;
+  }
+  return size;
+}
+
 static int FlushFrames(WebPAnimEncoder* const enc) {
+  // What was buffered before this flush, for statistics.
+  const int buffered_frames = (int)enc->count;
+  const size_t buffered_size =
+      (enc->stats_hook != NULL && enc->flush_count > 0) ? BufferedSize(enc) : 0;
   while (enc->flush_count > 0) {
     WebPMuxError err;
     EncodedFrame* const curr = GetFrame(enc, 0);
     const WebPMuxFrameInfo* const info =
         curr->is_key_frame ? &curr->key_frame : &curr->sub_frame;
     assert(enc->mux != NULL);
-    err = WebPMuxPushFrame(enc->mux, info, 1);
+    // A streamed frame is written and removed from 'mux' before 'curr' is
+    // released, so it doesn't need a copy.
+    err = WebPMuxPushFrame(enc->mux, info, enc->writer == NULL);
     if (err != WEBP_MUX_OK) {
       MarkError2(enc, "ERROR adding frame. WebPMuxError", err);
       return 0;
     }
+    if (enc->writer != NULL && !WriteOutputFrame(enc)) return 0;
+    if (enc->stats_hook != NULL) {
+      ReportFrameStats(enc, curr, info, buffered_frames, buffered_size);
+    }
     if (enc->options.verbose) {
       fprintf(stderr, "INFO: Added frame. offset:%d,%d dispose:%d blend:%d\n",
               info->x_offset, info->y_offset, info->dispose_method,
               info->blend_method);
     }
     ++enc->out_frame_count;
+    enc->frames_size += info->bitstream.size;
     FrameRelease(curr);
     ++enc->start;
     --enc->flush_count;
@@ -1337,14 +2318,11 @@ static int FlushFrames(WebPAnimEncoder* const enc) {
 #undef DELTA_INFINITY
 #undef KEYFRAME_NONE
 
-int WebPAnimEncoderAdd(WebPAnimEncoder* enc, WebPPicture* frame, int timestamp,
-                       const WebPConfig* encoder_config) {
+static int AddFrame(WebPAnimEncoder* const enc, WebPPicture* frame,
+                    int timestamp, const WebPConfig* encoder_config) {
   WebPConfig config;
   int ok;
 
-  if (enc == NULL) {
-    return 0;
-  }
   MarkNoError(enc);
 
   if (!enc->is_first_frame) {
@@ -1384,7 +2362,17 @@ int WebPAnimEncoderAdd(WebPAnimEncoder* enc, WebPPicture* frame, int timestamp,
     return 0;
   }
 
-  if (!frame->use_argb) {  // Convert frame from YUV(A) to ARGB.
+  if (enc->options.keep_yuv) {
+    if (encoder_config != NULL && encoder_config->lossless) {
+      frame->error_code = VP8_ENC_ERROR_INVALID_CONFIGURATION;
+      MarkError(enc, "ERROR adding frame: lossless needs ARGB frames");
+      return 0;
+    }
+    if (frame->use_argb && !WebPPictureARGBToYUVA(frame, WEBP_YUV420)) {
+      MarkError(enc, "ERROR converting frame from ARGB to YUV(A)");
+      return 0;
+    }
+  } else if (!frame->use_argb) {  // Convert frame from YUV(A) to ARGB.
     if (enc->options.verbose) {
       fprintf(stderr, "WARNING: Converting frame from YUV(A) to ARGB format; "
               "this incurs a small loss.\n");
@@ -1406,7 +2394,10 @@ int WebPAnimEncoderAdd(WebPAnimEncoder* enc, WebPPicture* frame, int timestamp,
       MarkError(enc, "Cannot Init config");
       return 0;
     }
-    config.lossless = 1;
+    config.lossless = !enc->options.keep_yuv;
+  }
+  if (UseRateControl(enc, &config)) {
+    UpdateRateControl(enc, &config, timestamp);
   }
   assert(enc->curr_canvas == NULL);
   enc->curr_canvas = frame;  // Store reference.
@@ -1423,6 +2414,21 @@ int WebPAnimEncoderAdd(WebPAnimEncoder* enc, WebPPicture* frame, int timestamp,
   return ok;
 }
 
+int WebPAnimEncoderAdd(WebPAnimEncoder* enc, WebPPicture* frame, int timestamp,
+                       const WebPConfig* encoder_config) {
+  const WebPAllocator* previous;
+  int ok;
+  if (enc == NULL) return 0;
+  previous = UseAllocator(enc->options.allocator);
+  ok = AddFrame(enc, frame, timestamp, encoder_config);
+  WebPSetAllocator(previous);
+  return ok;
+}
+
+size_t WebPAnimEncoderGetFramesSize(const WebPAnimEncoder* enc) {
+  return (enc != NULL) ? enc->frames_size : 0;
+}
+
 // -----------------------------------------------------------------------------
 // Bitstream assembly.
 
@@ -1458,17 +2464,32 @@ WEBP_NODISCARD static int DecodeFrameOntoCanvas(
 static int FrameToFullCanvas(WebPAnimEncoder* const enc,
                              const WebPMuxFrameInfo* const frame,
                              WebPData* const full_image) {
-  WebPPicture* const canvas_buf = &enc->curr_canvas_copy;
+  WebPPicture argb_canvas;  // Only used if the canvases are in YUV(A).
+  WebPPicture* const canvas_buf =
+      enc->curr_canvas_copy.use_argb ? &enc->curr_canvas_copy : &argb_canvas;
   WebPMemoryWriter mem1, mem2;
   WebPMemoryWriterInit(&mem1);
   WebPMemoryWriterInit(&mem2);
+  if (!WebPPictureInit(&argb_canvas)) return 0;
 
+  if (canvas_buf == &argb_canvas) {
+    argb_canvas.width = enc->canvas_width;
+    argb_canvas.height = enc->canvas_height;
+    argb_canvas.use_argb = 1;
+    if (!WebPPictureAlloc(&argb_canvas)) goto Err;
+  }
   if (!DecodeFrameOntoCanvas(frame, canvas_buf)) goto Err;
-  if (!EncodeFrame(&enc->last_config, canvas_buf, &mem1)) goto Err;
+  if (!EncodeFrame(&enc->last_config, canvas_buf, enc->scratch, NULL,
+                   &mem1)) {
+    goto Err;
+  }
   GetEncodedData(&mem1, full_image);
 
   if (enc->options.allow_mixed) {
-    if (!EncodeFrame(&enc->last_config_reversed, canvas_buf, &mem2)) goto Err;
+    if (!EncodeFrame(&enc->last_config_reversed, canvas_buf, enc->scratch,
+                     NULL, &mem2)) {
+      goto Err;
+    }
     if (mem2.size < mem1.size) {
       GetEncodedData(&mem2, full_image);
       WebPMemoryWriterClear(&mem1);
@@ -1476,9 +2497,11 @@ static int FrameToFullCanvas(WebPAnimEncoder* const enc,
       WebPMemoryWriterClear(&mem2);
     }
   }
+  WebPPictureFree(&argb_canvas);
   return 1;
 
  Err:
+  WebPPictureFree(&argb_canvas);
   WebPMemoryWriterClear(&mem1);
   WebPMemoryWriterClear(&mem2);
   return 0;
@@ -1529,13 +2552,10 @@ static WebPMuxError OptimizeSingleFrame(WebPAnimEncoder* const enc,
   return err;
 }
 
-int WebPAnimEncoderAssemble(WebPAnimEncoder* enc, WebPData* webp_data) {
+static int Assemble(WebPAnimEncoder* const enc, WebPData* webp_data) {
   WebPMux* mux;
   WebPMuxError err;
 
-  if (enc == NULL) {
-    return 0;
-  }
   MarkNoError(enc);
 
   if (webp_data == NULL) {
@@ -1564,6 +2584,13 @@ int WebPAnimEncoderAssemble(WebPAnimEncoder* enc, WebPData* webp_data) {
     return 0;
   }
 
+  if (enc->writer != NULL) {  // Frames were written as they were flushed.
+    if (!FinishOutput(enc)) return 0;
+    webp_data->bytes = NULL;
+    webp_data->size = enc->output_size;
+    return 1;
+  }
+
   // Set definitive canvas size.
   mux = enc->mux;
   err = WebPMuxSetCanvasSize(mux, enc->canvas_width, enc->canvas_height);
@@ -1587,6 +2614,16 @@ int WebPAnimEncoderAssemble(WebPAnimEncoder* enc, WebPData* webp_data) {
   return 0;
 }
 
+int WebPAnimEncoderAssemble(WebPAnimEncoder* enc, WebPData* webp_data) {
+  const WebPAllocator* previous;
+  int ok;
+  if (enc == NULL) return 0;
+  previous = UseAllocator(enc->options.allocator);
+  ok = Assemble(enc, webp_data);
+  WebPSetAllocator(previous);
+  return ok;
+}
+
 const char* WebPAnimEncoderGetError(WebPAnimEncoder* enc) {
   if (enc == NULL) return NULL;
   return enc->error_str;
@@ -1595,8 +2632,13 @@ const char* WebPAnimEncoderGetError(WebPAnimEncoder* enc) {
 WebPMuxError WebPAnimEncoderSetChunk(
     WebPAnimEncoder* enc, const char fourcc[4], const WebPData* chunk_data,
     int copy_data) {
+  const WebPAllocator* previous;
+  WebPMuxError err;
   if (enc == NULL) return WEBP_MUX_INVALID_ARGUMENT;
-  return WebPMuxSetChunk(enc->mux, fourcc, chunk_data, copy_data);
+  previous = UseAllocator(enc->options.allocator);
+  err = WebPMuxSetChunk(enc->mux, fourcc, chunk_data, copy_data);
+  WebPSetAllocator(previous);
+  return err;
 }
 
 WebPMuxError WebPAnimEncoderGetChunk(
@@ -0,0 +1,228 @@
+// Copyright 2026 Google Inc. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the COPYING file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS. All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+// -----------------------------------------------------------------------------
+//
+// Memory arena for WebPSetAllocator(), with accounting and a memory limit.
+//
+// Small blocks are rounded up to a power of two and carved from 4 MiB chunks.
+// Freed blocks go to the free list of their size class, and chunks are only
+// released with the arena. Blocks above 1 MiB are allocated on their own.
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "src/utils/utils.h"
+#include "src/webp/types.h"
+
+#if defined(WEBP_USE_THREAD) && !defined(_WIN32)
+#include <pthread.h>
+typedef pthread_mutex_t ArenaLock;
+#define LOCK_INIT(l) (pthread_mutex_init((l), NULL) == 0)
+#define LOCK_DESTROY(l) pthread_mutex_destroy(l)
+#define LOCK(l) pthread_mutex_lock(l)
+#define UNLOCK(l) pthread_mutex_unlock(l)
+#elif defined(WEBP_USE_THREAD)
+#include <windows.h>
+typedef CRITICAL_SECTION ArenaLock;
+#define LOCK_INIT(l) (InitializeCriticalSection(l), 1)
+#define LOCK_DESTROY(l) DeleteCriticalSection(l)
+#define LOCK(l) EnterCriticalSection(l)
+#define UNLOCK(l) LeaveCriticalSection(l)
+#else
+typedef int ArenaLock;
+#define LOCK_INIT(l) ((void)(l), 1)
+#define LOCK_DESTROY(l) (void)(l)
+#define LOCK(l) (void)(l)
+#define UNLOCK(l) (void)(l)
+#endif
+
+#define CHUNK_SIZE ((size_t)4 << 20)
+#define MIN_CLASS_BITS 5    // 32 bytes
+#define MAX_CLASS_BITS 20   // 1 MiB
+#define NUM_CLASSES (MAX_CLASS_BITS - MIN_CLASS_BITS + 1)
+#define LINK_SIZE 16        // keeps the blocks 16-byte aligned
+
+typedef struct Link Link;
+struct Link {
+  Link* prev;
+  Link* next;
+};
+
+struct WebPArena {
+  WebPAllocator allocator;
+  size_t limit;                     // 0 for no limit
+  WebPArenaStats stats;
+  Link* chunks;                     // through 'next' only
+  Link large;                       // sentinel of the blocks above 1 MiB
+  uint8_t* bump;                    // free space of the last chunk
+  size_t bump_left;
+  Link* free_blocks[NUM_CLASSES];   // through 'next' only
+  ArenaLock lock;
+};
+
+static int SizeClass(size_t size) {
+  if (size <= ((size_t)1 << MIN_CLASS_BITS)) return 0;
+  return BitsLog2Floor((uint32_t)(size - 1)) + 1 - MIN_CLASS_BITS;
+}
+
+static size_t ClassSize(int size_class) {
+  return (size_t)1 << (size_class + MIN_CLASS_BITS);
+}
+
+// Returns true if 'size' more bytes can be reserved.
+static int Reserve(WebPArena* const arena, size_t size) {
+  if (arena->limit > 0 && size > arena->limit - arena->stats.reserved) {
+    ++arena->stats.failures;
+    return 0;
+  }
+  arena->stats.reserved += size;
+  return 1;
+}
+
+// Puts the rest of the last chunk in the free lists, largest classes first.
+static void RecycleBump(WebPArena* const arena) {
+  while (arena->bump_left >= ClassSize(0)) {
+    int size_class = SizeClass(arena->bump_left);
+    Link* block;
+    if (ClassSize(size_class) > arena->bump_left) --size_class;
+    block = (Link*)arena->bump;
+    block->next = arena->free_blocks[size_class];
+    arena->free_blocks[size_class] = block;
+    arena->bump += ClassSize(size_class);
+    arena->bump_left -= ClassSize(size_class);
+  }
+}
+
+static void* AllocSmall(WebPArena* const arena, int size_class) {
+  const size_t size = ClassSize(size_class);
+  Link* block = arena->free_blocks[size_class];
+  if (block != NULL) {
+    arena->free_blocks[size_class] = block->next;
+    return block;
+  }
+  if (arena->bump_left < size) {
+    Link* chunk;
+    if (!Reserve(arena, CHUNK_SIZE)) return NULL;
+    chunk = (Link*)malloc(CHUNK_SIZE);
+    if (chunk == NULL) {
+      arena->stats.reserved -= CHUNK_SIZE;
+      return NULL;
+    }
+    RecycleBump(arena);
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->bump = (uint8_t*)chunk + LINK_SIZE;
+    arena->bump_left = CHUNK_SIZE - LINK_SIZE;
+  }
+  block = (Link*)arena->bump;
+  arena->bump += size;
+  arena->bump_left -= size;
+  return block;
+}
+
+static void* AllocLarge(WebPArena* const arena, size_t size) {
+  Link* block;
+  if (!Reserve(arena, size + LINK_SIZE)) return NULL;
+  block = (Link*)malloc(size + LINK_SIZE);
+  if (block == NULL) {
+    arena->stats.reserved -= size + LINK_SIZE;
+    return NULL;
+  }
+  block->prev = &arena->large;
+  block->next = arena->large.next;
+  block->next->prev = block;
+  arena->large.next = block;
+  return (uint8_t*)block + LINK_SIZE;
+}
+
+static void* ArenaAlloc(size_t size, void* user_data) {
+  WebPArena* const arena = (WebPArena*)user_data;
+  void* ptr;
+  LOCK(&arena->lock);
+  if (size > ClassSize(NUM_CLASSES - 1)) {
+    ptr = AllocLarge(arena, size);
+  } else {
+    ptr = AllocSmall(arena, SizeClass(size));
+  }
+  if (ptr != NULL) {
+    arena->stats.in_use += size;
+    if (arena->stats.in_use > arena->stats.peak) {
+      arena->stats.peak = arena->stats.in_use;
+    }
+  }
+  UNLOCK(&arena->lock);
+  return ptr;
+}
+
+static void ArenaFree(void* ptr, size_t size, void* user_data) {
+  WebPArena* const arena = (WebPArena*)user_data;
+  LOCK(&arena->lock);
+  assert(arena->stats.in_use >= size);
+  arena->stats.in_use -= size;
+  if (size > ClassSize(NUM_CLASSES - 1)) {
+    Link* const block = (Link*)((uint8_t*)ptr - LINK_SIZE);
+    block->prev->next = block->next;
+    block->next->prev = block->prev;
+    arena->stats.reserved -= size + LINK_SIZE;
+    free(block);
+  } else {
+    const int size_class = SizeClass(size);
+    Link* const block = (Link*)ptr;
+    block->next = arena->free_blocks[size_class];
+    arena->free_blocks[size_class] = block;
+  }
+  UNLOCK(&arena->lock);
+}
+
+//------------------------------------------------------------------------------
+
+WebPArena* WebPArenaNew(size_t limit) {
+  // The arena is not allocated through WebPSafeMalloc(), which may be using
+  // another arena.
+  WebPArena* const arena = (WebPArena*)calloc(1, sizeof(*arena));
+  if (arena == NULL) return NULL;
+  if (!LOCK_INIT(&arena->lock)) {
+    free(arena);
+    return NULL;
+  }
+  arena->allocator.Alloc = ArenaAlloc;
+  arena->allocator.Free = ArenaFree;
+  arena->allocator.user_data = arena;
+  arena->limit = limit;
+  arena->large.prev = arena->large.next = &arena->large;
+  return arena;
+}
+
+void WebPArenaDelete(WebPArena* arena) {
+  if (arena != NULL) {
+    while (arena->chunks != NULL) {
+      Link* const next = arena->chunks->next;
+      free(arena->chunks);
+      arena->chunks = next;
+    }
+    while (arena->large.next != &arena->large) {
+      Link* const block = arena->large.next;
+      arena->large.next = block->next;
+      free(block);
+    }
+    LOCK_DESTROY(&arena->lock);
+    free(arena);
+  }
+}
+
+const WebPAllocator* WebPArenaGetAllocator(WebPArena* arena) {
+  return (arena != NULL) ? &arena->allocator : NULL;
+}
+
+void WebPArenaGetStats(WebPArena* arena, WebPArenaStats* const stats) {
+  assert(arena != NULL && stats != NULL);
+  LOCK(&arena->lock);
+  *stats = arena->stats;
+  UNLOCK(&arena->lock);
+}
@@ -55,6 +55,7 @@ typedef struct {
   pthread_mutex_t mutex;
   pthread_cond_t  condition;
   pthread_t       thread;
+  const WebPAllocator* allocator;   // allocator of the thread launching jobs
 } WebPWorkerImpl;
 
 #if defined(_WIN32)
@@ -212,7 +213,10 @@ static THREADFN ThreadLoop(void* ptr) {
       pthread_cond_wait(&impl->condition, &impl->mutex);
     }
     if (worker->status == WORK) {
+      // The job allocates like the thread that launched it.
+      const WebPAllocator* const previous = WebPSetAllocator(impl->allocator);
       WebPGetWorkerInterface()->Execute(worker);
+      WebPSetAllocator(previous);
       worker->status = OK;
     } else if (worker->status == NOT_OK) {   // finish the worker
       done = 1;
@@ -245,6 +249,7 @@ static void ChangeState(WebPWorker* const worker, WebPWorkerStatus new_status) {
     // assign new status and release the working thread if needed
     if (new_status != OK) {
       worker->status = new_status;
+      impl->allocator = WebPGetAllocator();
       // Note the associated mutex does not need to be held when signaling the
       // condition. Unlocking the mutex first may improve performance in some
       // implementations, avoiding the case where the waiting thread can't
@@ -368,3 +373,168 @@ const WebPWorkerInterface* WebPGetWorkerInterface(void) {
 }
 
 //------------------------------------------------------------------------------
+// Worker pool
+
+int WebPWorkerPoolInit(WebPWorkerPool* const pool, int num_threads) {
+  const WebPWorkerInterface* const winterface = WebPGetWorkerInterface();
+  int i;
+  pool->workers = NULL;
+  pool->num_workers = 0;
+#ifndef WEBP_USE_THREAD
+  num_threads = 1;
+#endif
+  if (num_threads <= 1) return 1;
+  pool->workers =
+      (WebPWorker*)WebPSafeCalloc(num_threads - 1, sizeof(*pool->workers));
+  if (pool->workers == NULL) return 0;
+  for (i = 0; i < num_threads - 1; ++i) {
+    WebPWorker* const worker = &pool->workers[i];
+    winterface->Init(worker);
+    ++pool->num_workers;  // Only count the workers that need to be ended.
+    if (!winterface->Reset(worker)) return 0;
+  }
+  return 1;
+}
+
+int WebPWorkerPoolRun(WebPWorkerPool* const pool, WebPWorkerHook hook,
+                      void* jobs, size_t job_size, int num_jobs, void* data2) {
+  const WebPWorkerInterface* const winterface = WebPGetWorkerInterface();
+  const int pool_size = WebPWorkerPoolSize(pool);
+  int ok = 1;
+  int first;
+  for (first = 0; first < num_jobs; first += pool_size) {
+    const int last =
+        (first + pool_size < num_jobs) ? first + pool_size : num_jobs;
+    int i;
+    for (i = first + 1; i < last; ++i) {
+      WebPWorker* const worker = &pool->workers[i - first - 1];
+      ok &= winterface->Reset(worker);  // clears the error of a previous job
+      worker->hook = hook;
+      worker->data1 = (uint8_t*)jobs + i * job_size;
+      worker->data2 = data2;
+      winterface->Launch(worker);
+    }
+    ok &= hook((uint8_t*)jobs + first * job_size, data2);
+    for (i = first + 1; i < last; ++i) {
+      ok &= winterface->Sync(&pool->workers[i - first - 1]);
+    }
+  }
+  return ok;
+}
+
+void WebPWorkerPoolEnd(WebPWorkerPool* const pool) {
+  int i;
+  for (i = 0; i < pool->num_workers; ++i) {
+    WebPGetWorkerInterface()->End(&pool->workers[i]);
+  }
+  WebPSafeFree(pool->workers);
+  pool->workers = NULL;
+  pool->num_workers = 0;
+}
+
+//------------------------------------------------------------------------------
+// Counters
+
+#ifdef WEBP_USE_THREAD
+typedef struct {
+  pthread_mutex_t mutex;          // guards the values
+  pthread_cond_t* conditions;     // signaled when a value changes
+  int num_conditions;             // number of 'conditions' to destroy
+} WebPCountersImpl;
+#endif
+
+int WebPCountersInit(WebPCounters* const counters, int num_counters) {
+  assert(num_counters > 0);
+  counters->impl = NULL;
+  counters->num_counters = 0;
+  counters->values =
+      (int*)WebPSafeCalloc(num_counters, sizeof(*counters->values));
+  if (counters->values == NULL) return 0;
+  counters->num_counters = num_counters;
+#ifdef WEBP_USE_THREAD
+  {
+    WebPCountersImpl* const impl =
+        (WebPCountersImpl*)WebPSafeCalloc(1, sizeof(*impl));
+    if (impl == NULL) return 0;
+    if (pthread_mutex_init(&impl->mutex, NULL)) {
+      WebPSafeFree(impl);
+      return 0;
+    }
+    counters->impl = (void*)impl;
+    impl->conditions = (pthread_cond_t*)WebPSafeMalloc(
+        num_counters, sizeof(*impl->conditions));
+    if (impl->conditions == NULL) return 0;
+    for (; impl->num_conditions < num_counters; ++impl->num_conditions) {
+      if (pthread_cond_init(&impl->conditions[impl->num_conditions], NULL)) {
+        return 0;
+      }
+    }
+  }
+#endif
+  return 1;
+}
+
+void WebPCountersReset(WebPCounters* const counters) {
+#ifdef WEBP_USE_THREAD
+  WebPCountersImpl* const impl = (WebPCountersImpl*)counters->impl;
+  pthread_mutex_lock(&impl->mutex);
+#endif
+  memset(counters->values, 0,
+         counters->num_counters * sizeof(*counters->values));
+#ifdef WEBP_USE_THREAD
+  pthread_mutex_unlock(&impl->mutex);
+#endif
+}
+
+int WebPCountersAdd(WebPCounters* const counters, int index, int delta) {
+  int previous;
+#ifdef WEBP_USE_THREAD
+  WebPCountersImpl* const impl = (WebPCountersImpl*)counters->impl;
+  pthread_mutex_lock(&impl->mutex);
+#endif
+  assert(index >= 0 && index < counters->num_counters);
+  previous = counters->values[index];
+  counters->values[index] = previous + delta;
+#ifdef WEBP_USE_THREAD
+  pthread_mutex_unlock(&impl->mutex);
+  pthread_cond_signal(&impl->conditions[index]);
+#endif
+  return previous;
+}
+
+void WebPCountersWait(WebPCounters* const counters, int index, int value) {
+#ifdef WEBP_USE_THREAD
+  WebPCountersImpl* const impl = (WebPCountersImpl*)counters->impl;
+  pthread_mutex_lock(&impl->mutex);
+  while (counters->values[index] < value) {
+    pthread_cond_wait(&impl->conditions[index], &impl->mutex);
+  }
+  pthread_mutex_unlock(&impl->mutex);
+#else
+  // Nothing else could increase the counter.
+  assert(counters->values[index] >= value);
+  (void)counters;
+  (void)index;
+  (void)value;
+#endif
+}
+
+void WebPCountersEnd(WebPCounters* const counters) {
+#ifdef WEBP_USE_THREAD
+  WebPCountersImpl* const impl = (WebPCountersImpl*)counters->impl;
+  if (impl != NULL) {
+    while (impl->num_conditions > 0) {
+      pthread_cond_destroy(&impl->conditions[--impl->num_conditions]);
+    }
+    WebPSafeFree(impl->conditions);
+    pthread_mutex_destroy(&impl->mutex);
+    WebPSafeFree(impl);
+  }
+#endif
+  WebPSafeFree(counters->values);
+  counters->impl = NULL;
+  counters->values = NULL;
+  counters->num_counters = 0;
+}
+
+//------------------------------------------------------------------------------
@@ -81,6 +81,65 @@ WEBP_EXTERN int WebPSetWorkerInterface(
 // Retrieve the currently set thread worker interface.
 WEBP_EXTERN const WebPWorkerInterface* WebPGetWorkerInterface(void);
 
+//------------------------------------------------------------------------------
+// Worker pool
+
+// Workers running jobs in parallel with the calling thread, which counts as
+// one of the threads of the pool.
+typedef struct {
+  WebPWorker* workers;    // threads besides the calling one
+  int num_workers;        // number of 'workers' to end
+} WebPWorkerPool;
+
+// Starts a pool of 'num_threads' threads, including the calling one. Without
+// thread support, the pool only has the calling thread. Returns false in case
+// of error; WebPWorkerPoolEnd() must still be called.
+int WebPWorkerPoolInit(WebPWorkerPool* const pool, int num_threads);
+
+// Returns the number of jobs the pool runs at once.
+static WEBP_INLINE int WebPWorkerPoolSize(const WebPWorkerPool* const pool) {
+  return pool->num_workers + 1;
+}
+
+// Calls 'hook' on each of the 'num_jobs' jobs of 'job_size' bytes starting at
+// 'jobs', with 'data2' as second argument. The jobs run by rounds of
+// WebPWorkerPoolSize(), the first job of a round on the calling thread, so
+// that job 'i' always runs on the same thread as job 'i % size'. Returns
+// false if any job failed.
+int WebPWorkerPoolRun(WebPWorkerPool* const pool, WebPWorkerHook hook,
+                      void* jobs, size_t job_size, int num_jobs, void* data2);
+
+// Stops the threads and releases the pool.
+void WebPWorkerPoolEnd(WebPWorkerPool* const pool);
+
+//------------------------------------------------------------------------------
+// Counters
+
+// Counters that jobs running in parallel increase and wait on, to follow each
+// other's progress. A counter is waited on by at most one thread at a time.
+typedef struct {
+  void* impl;             // platform-dependent lock and conditions
+  int* values;            // guarded by 'impl'
+  int num_counters;
+} WebPCounters;
+
+// Allocates 'num_counters' counters, starting at zero. Returns false in case
+// of error; WebPCountersEnd() must still be called.
+int WebPCountersInit(WebPCounters* const counters, int num_counters);
+
+// Sets all the counters back to zero. No thread may be waiting on them.
+void WebPCountersReset(WebPCounters* const counters);
+
+// Adds 'delta' to the counter 'index' and returns its previous value.
+int WebPCountersAdd(WebPCounters* const counters, int index, int delta);
+
+// Waits until the counter 'index' is at least 'value'. Without thread support,
+// the counter must already be there.
+void WebPCountersWait(WebPCounters* const counters, int index, int value);
+
+// Releases the counters.
+void WebPCountersEnd(WebPCounters* const counters);
+
 //------------------------------------------------------------------------------
 
 #ifdef __cplusplus
@@ -193,12 +193,72 @@ static int CheckSizeArgumentsOverflow(uint64_t nmemb, size_t size) {
   return 1;
 }
 
+//------------------------------------------------------------------------------
+// Allocator selection
+
+#if defined(WEBP_USE_THREAD) && defined(_MSC_VER)
+#define WEBP_THREAD_LOCAL __declspec(thread)
+#elif defined(WEBP_USE_THREAD)
+#define WEBP_THREAD_LOCAL __thread
+#else
+#define WEBP_THREAD_LOCAL
+#endif
+
+static WEBP_THREAD_LOCAL const WebPAllocator* current_allocator = NULL;
+
+const WebPAllocator* WebPSetAllocator(const WebPAllocator* allocator) {
+  const WebPAllocator* const previous = current_allocator;
+  current_allocator = allocator;
+  return previous;
+}
+
+const WebPAllocator* WebPGetAllocator(void) {
+  return current_allocator;
+}
+
+// Every block starts with this header, so that it goes back to its allocator
+// whichever thread frees it. The size keeps the blocks aligned like malloc().
+typedef struct {
+  const WebPAllocator* allocator;   // NULL for malloc()
+  size_t size;                      // including the header
+} BlockHeader;
+#define HEADER_SIZE ((sizeof(BlockHeader) + 15) & ~(size_t)15)
+
+static void* AllocBlock(size_t size, int zero) {
+  const WebPAllocator* const allocator = current_allocator;
+  uint8_t* mem;
+  if (size > WEBP_MAX_ALLOCABLE_MEMORY - HEADER_SIZE) return NULL;
+  size += HEADER_SIZE;
+  if (allocator == NULL) {
+    mem = (uint8_t*)(zero ? calloc(1, size) : malloc(size));
+  } else {
+    mem = (uint8_t*)allocator->Alloc(size, allocator->user_data);
+    if (mem != NULL && zero) memset(mem, 0, size);
+  }
+  if (mem == NULL) return NULL;
+  ((BlockHeader*)mem)->allocator = allocator;
+  ((BlockHeader*)mem)->size = size;
+  return mem + HEADER_SIZE;
+}
+
+static void FreeBlock(void* const ptr) {
+  uint8_t* const mem = (uint8_t*)ptr - HEADER_SIZE;
+  const BlockHeader header = *(const BlockHeader*)mem;
+  if (header.allocator == NULL) {
+    free(mem);
+  } else {
+    header.allocator->Free(mem, header.size, header.allocator->user_data);
+  }
+}
+
+//------------------------------------------------------------------------------
+
 void* WebPSafeMalloc(uint64_t nmemb, size_t size) {
   void* ptr;
   Increment(&num_malloc_calls);
   if (!CheckSizeArgumentsOverflow(nmemb, size)) return NULL;
   assert(nmemb * size > 0);
-  ptr = malloc((size_t)(nmemb * size));
+  ptr = AllocBlock((size_t)(nmemb * size), /*zero=*/0);
   AddMem(ptr, (size_t)(nmemb * size));
   return ptr;
 }
@@ -208,7 +268,7 @@ void* WebPSafeCalloc(uint64_t nmemb, size_t size) {
   Increment(&num_calloc_calls);
   if (!CheckSizeArgumentsOverflow(nmemb, size)) return NULL;
   assert(nmemb * size > 0);
-  ptr = calloc((size_t)nmemb, size);
+  ptr = AllocBlock((size_t)(nmemb * size), /*zero=*/1);
   AddMem(ptr, (size_t)(nmemb * size));
   return ptr;
 }
@@ -217,8 +277,8 @@ void WebPSafeFree(void* const ptr) {
   if (ptr != NULL) {
     Increment(&num_free_calls);
     SubMem(ptr);
+    FreeBlock(ptr);
   }
-  free(ptr);
 }
 
 // Public API functions.
@@ -247,9 +307,32 @@ void WebPCopyPlane(const uint8_t* src, int src_stride,
 void WebPCopyPixels(const WebPPicture* const src, WebPPicture* const dst) {
   assert(src != NULL && dst != NULL);
   assert(src->width == dst->width && src->height == dst->height);
-  assert(src->use_argb && dst->use_argb);
-  WebPCopyPlane((uint8_t*)src->argb, 4 * src->argb_stride, (uint8_t*)dst->argb,
-                4 * dst->argb_stride, 4 * src->width, src->height);
+  assert(src->use_argb == dst->use_argb);
+  if (src->use_argb) {
+    WebPCopyPlane((uint8_t*)src->argb, 4 * src->argb_stride,
+                  (uint8_t*)dst->argb, 4 * dst->argb_stride,
+                  4 * src->width, src->height);
+  } else {
+    const int uv_width = (src->width + 1) >> 1;
+    const int uv_height = (src->height + 1) >> 1;
+    WebPCopyPlane(src->y, src->y_stride, dst->y, dst->y_stride,
+                  src->width, src->height);
+    WebPCopyPlane(src->u, src->uv_stride, dst->u, dst->uv_stride,
+                  uv_width, uv_height);
+    WebPCopyPlane(src->v, src->uv_stride, dst->v, dst->uv_stride,
+                  uv_width, uv_height);
+    if (dst->a != NULL) {
+      if (src->a != NULL) {
+        WebPCopyPlane(src->a, src->a_stride, dst->a, dst->a_stride,
+                      src->width, src->height);
+      } else {
+        int y;
+        for (y = 0; y < src->height; ++y) {
+          memset(dst->a + y * dst->a_stride, 0xff, src->width);
+        }
+      }
+    }
+  }
 }
 
 //------------------------------------------------------------------------------
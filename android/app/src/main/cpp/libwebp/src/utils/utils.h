@@ -181,8 +181,9 @@ WEBP_EXTERN void WebPCopyPlane(const uint8_t* src, int src_stride,
                                uint8_t* dst, int dst_stride,
                                int width, int height);
 
-// Copy ARGB pixels from 'src' to 'dst' honoring strides. 'src' and 'dst' are
-// assumed to be already allocated and using ARGB data.
+// Copy pixels from 'src' to 'dst' honoring strides. 'src' and 'dst' are
+// assumed to be already allocated and using the same kind of samples (ARGB or
+// YUV420). If 'dst' has an alpha plane but 'src' doesn't, it is set to opaque.
 WEBP_EXTERN void WebPCopyPixels(const struct WebPPicture* const src,
                                 struct WebPPicture* const dst);
 
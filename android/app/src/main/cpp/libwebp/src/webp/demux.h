@@ -58,7 +58,7 @@
 extern "C" {
 #endif
 
-#define WEBP_DEMUX_ABI_VERSION 0x0107    // MAJOR(8b) + MINOR(8b)
+#define WEBP_DEMUX_ABI_VERSION 0x0108    // MAJOR(8b) + MINOR(8b)
 
 // Note: forward declaring enumerations is not allowed in (strict) C and C++,
 // the types are left here for reference.
@@ -257,6 +257,9 @@ struct WebPAnimDecoderOptions {
   // MODE_RGBA, MODE_BGRA, MODE_rgbA and MODE_bgrA.
   WEBP_CSP_MODE color_mode;
   int use_threads;           // If true, use multi-threaded decoding.
+  const WebPAllocator* allocator;  // If not NULL, allocates the memory of the
+                                   // decoder instead of the allocator of the
+                                   // calling thread.
   uint32_t padding[7];       // Padding for later use.
 };
 
@@ -22,7 +22,7 @@
 extern "C" {
 #endif
 
-#define WEBP_ENCODER_ABI_VERSION 0x0210  // MAJOR(8b) + MINOR(8b)
+#define WEBP_ENCODER_ABI_VERSION 0x0212  // MAJOR(8b) + MINOR(8b)
 
 // Note: forward declaring enumerations is not allowed in (strict) C and C++,
 // the types are left here for reference.
@@ -34,6 +34,8 @@ typedef struct WebPConfig WebPConfig;
 typedef struct WebPPicture WebPPicture;   // main structure for I/O
 typedef struct WebPAuxStats WebPAuxStats;
 typedef struct WebPMemoryWriter WebPMemoryWriter;
+typedef struct WebPEncoderScratch WebPEncoderScratch;  // opaque
+typedef struct WebPAnalysisCache WebPAnalysisCache;    // opaque
 
 // Return the encoder's version number, packed in hexadecimal using 8bits for
 // each of major/minor/revision. E.g: v2.5.7 is 0x020507.
@@ -138,6 +140,13 @@ struct WebPConfig {
                           // JPEG compression. Generally, the output size will
                           // be similar but the degradation will be lower.
   int thread_level;       // If non-zero, try and use multi-threaded encoding.
+                          // Values above 1 are the number of threads the
+                          // lossy encoder uses for a frame (at most 16). With
+                          // method >= 3, they also encode the macroblock rows
+                          // in parallel, which changes the output slightly
+                          // (but not with the number of threads). With
+                          // target_size or target_PSNR, they also try one
+                          // 'q' per thread at each pass of the search.
   int low_memory;         // If set, reduce memory usage (but increase CPU use).
 
   int near_lossless;      // Near lossless encoding [0 = max loss .. 100 = off
@@ -358,8 +367,17 @@ struct WebPPicture {
 
   uint32_t pad3[3];       // padding for later use
 
-  // Unused for now
-  uint8_t* pad4, *pad5;
+  // If not NULL, the encoder keeps its large buffers in this object instead of
+  // freeing them, so that the next WebPEncode() call with the same scratch
+  // reuses them. Copies and views of the picture share the scratch: it must
+  // not be used by two WebPEncode() calls at the same time.
+  WebPEncoderScratch* scratch;
+  // If not NULL, the lossy encoder records its macroblock analysis in this
+  // object, and the next WebPEncode() call with the same cache and dimensions
+  // reuses it for the macroblocks whose samples are unchanged. The segments
+  // are also computed starting from the previous ones, which makes the output
+  // depend on the pictures encoded before. Same sharing rules as 'scratch'.
+  WebPAnalysisCache* analysis_cache;
   uint32_t pad6[8];       // padding for later use
 
   // PRIVATE FIELDS
@@ -535,6 +553,27 @@ WEBP_EXTERN int WebPPictureHasTransparency(const WebPPicture* picture);
 // After this call, all alpha values are reset to 0xff.
 WEBP_EXTERN void WebPBlendAlpha(WebPPicture* picture, uint32_t background_rgb);
 
+//------------------------------------------------------------------------------
+// Scratch memory
+
+// Creates an empty scratch object, to be set as WebPPicture::scratch so that
+// successive WebPEncode() calls reuse the encoder's large buffers (hash chains,
+// token pages, ...) rather than allocate them anew. Returns NULL in case of
+// memory error.
+WEBP_NODISCARD WEBP_EXTERN WebPEncoderScratch* WebPEncoderScratchNew(void);
+
+// Releases the scratch object and the buffers it holds. No picture using it
+// may be encoded anymore.
+WEBP_EXTERN void WebPEncoderScratchDelete(WebPEncoderScratch* scratch);
+
+// Creates an empty analysis cache, to be set as WebPPicture::analysis_cache
+// when encoding successive similar pictures, such as the frames of a video.
+// Returns NULL in case of memory error.
+WEBP_NODISCARD WEBP_EXTERN WebPAnalysisCache* WebPAnalysisCacheNew(void);
+
+// Releases the analysis cache. No picture using it may be encoded anymore.
+WEBP_EXTERN void WebPAnalysisCacheDelete(WebPAnalysisCache* cache);
+
 //------------------------------------------------------------------------------
 // Main call
 
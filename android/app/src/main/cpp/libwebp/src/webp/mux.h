@@ -22,7 +22,7 @@
 extern "C" {
 #endif
 
-#define WEBP_MUX_ABI_VERSION 0x0109        // MAJOR(8b) + MINOR(8b)
+#define WEBP_MUX_ABI_VERSION 0x0113        // MAJOR(8b) + MINOR(8b)
 
 //------------------------------------------------------------------------------
 // Mux API
@@ -69,6 +69,7 @@ typedef struct WebPMux WebPMux;   // main opaque object.
 typedef struct WebPMuxFrameInfo WebPMuxFrameInfo;
 typedef struct WebPMuxAnimParams WebPMuxAnimParams;
 typedef struct WebPAnimEncoderOptions WebPAnimEncoderOptions;
+typedef struct WebPAnimEncoderFrameStats WebPAnimEncoderFrameStats;
 
 // Error codes
 typedef enum WEBP_NODISCARD WebPMuxError {
@@ -447,6 +448,46 @@ struct WebPAnimEncoderOptions {
   int allow_mixed;      // If true, use mixed compression mode; may choose
                         // either lossy and lossless for each frame.
   int verbose;          // If true, print info and warning messages to stderr.
+  int keep_yuv;         // If true, frames are kept in YUV(A) from input to
+                        // encoding instead of being converted to ARGB. Only
+                        // for lossy encoding; 'allow_mixed' is ignored and
+                        // blending is not used.
+  int candidate_threads;  // If > 1, number of threads encoding the candidate
+                          // sub-frames of each frame in parallel (max 8).
+  int keyframe_tolerance;  // If > 0, a frame past 'kmin' is only encoded as a
+                           // key-frame too if its predicted size makes it a
+                           // likely pick, instead of always. In [0..100]:
+                           // higher is faster, but may pick worse key-frames.
+  int merge_threshold;     // If > 0, lossy frames whose change from the
+                           // previous one has a PSNR of at least this many dB
+                           // in every 32x32 block are merged into it instead
+                           // of being encoded.
+  int scene_cut_threshold;  // If > 0, frames whose change covers most of the
+                            // canvas with a PSNR below this many dB are
+                            // scene cuts, encoded as key-frames.
+  int decimate_cost;       // If > 0, lossy frames are dropped, their duration
+                           // going to the previous frame, when their change
+                           // is predicted to take 1 kB for less than this many
+                           // pixels changed from 0 to 255 (in squared error).
+                           // Higher drops more frames, at most 3 in a row.
+  int max_buffered_frames;  // If > 0, at most this many frames wait for the
+                            // key-frame decision before being output, by
+                            // raising 'kmin' if needed. Bounds the memory
+                            // held by encoded frames.
+  int target_size;         // If > 0, byte budget of all the frames: the
+                           // quality of lossy frames is lowered as needed to
+                           // spread it over 'target_duration', up to the
+                           // quality of their config.
+  int target_duration;     // Expected duration of the animation in ms, needed
+                           // by 'target_size'.
+  int reuse_analysis;      // If true, lossy frames reuse the macroblock
+                           // analysis of the previous frame where their
+                           // samples are unchanged, and start their segments
+                           // from its ones. Faster on mostly static content,
+                           // with slightly different segments.
+  const WebPAllocator* allocator;  // If not NULL, allocates the memory of the
+                                   // encoder and of its output instead of the
+                                   // allocator of the calling thread.
 
   uint32_t padding[4];  // Padding for later use.
 };
@@ -491,6 +532,7 @@ static WEBP_INLINE WebPAnimEncoder* WebPAnimEncoderNew(
 //   enc - (in/out) object to which the frame is to be added.
 //   frame - (in/out) frame data in ARGB or YUV(A) format. If it is in YUV(A)
 //           format, it will be converted to ARGB, which incurs a small loss.
+//           If 'keep_yuv' is set, ARGB frames are converted to YUV(A) instead.
 //   timestamp_ms - (in) timestamp of this frame in milliseconds.
 //                       Duration of a frame would be calculated as
 //                       "timestamp of next frame - timestamp of this frame".
@@ -516,6 +558,74 @@ WEBP_NODISCARD WEBP_EXTERN int WebPAnimEncoderAdd(
 WEBP_NODISCARD WEBP_EXTERN int WebPAnimEncoderAssemble(WebPAnimEncoder* enc,
                                                        WebPData* webp_data);
 
+// Signature of a function receiving the bitstream of an animation encoder that
+// streams its output. It must write 'data_size' bytes of 'data' at byte
+// 'offset' of the output. The output is written in order, except for its first
+// 24 bytes (RIFF size and VP8X flags) which are written again at the end.
+// Returns false on error.
+typedef int (*WebPAnimEncoderWriterFunction)(const uint8_t* data,
+                                              size_t data_size, size_t offset,
+                                              void* user_data);
+
+// Makes 'enc' write each frame to 'writer' as soon as it is final, instead of
+// keeping the whole animation in memory until WebPAnimEncoderAssemble().
+// Must be called before adding the first frame. WebPAnimEncoderAssemble() then
+// writes the end of the bitstream, and sets 'webp_data->bytes' to NULL and
+// 'webp_data->size' to the total size written.
+// Chunks set with WebPAnimEncoderSetChunk() are written too, but an ICCP chunk
+// must be set before the first frame is written. A single frame animation is
+// not converted to a still image.
+// Returns:
+//   True on success.
+WEBP_EXTERN int WebPAnimEncoderSetWriter(
+    WebPAnimEncoder* enc, WebPAnimEncoderWriterFunction writer,
+    void* user_data);
+
+// Statistics about a frame of the animation, as it was written.
+struct WebPAnimEncoderFrameStats {
+  int is_key_frame;          // True if the frame was encoded as a key-frame.
+  int x_offset, y_offset;    // Rectangle of the canvas covered by the frame.
+  int width, height;
+  int duration;              // Duration of the frame, in ms. Identical input
+                             // frames are merged into one longer frame.
+  int num_candidates;        // Number of encodings tried for the frame,
+                             // as a sub-frame and as a key-frame.
+  int num_input_frames;      // Number of input frames the frame shows: the
+                             // ones merged or dropped follow the first.
+  // The encoding picked among the candidates:
+  int lossless;              // True if the frame is lossless.
+  WebPMuxAnimBlend blend_method;
+  WebPMuxAnimDispose dispose_method;
+  size_t size;               // Size of the encoded frame, in bytes.
+  // Encoded frames held by the encoder when the frame was output, including
+  // it, and their size in bytes. Undecided frames count both variants.
+  int buffered_frames;
+  size_t buffered_size;
+  float quality;             // Quality the frame was encoded with, lowered
+                             // to fit 'target_size' if set.
+  uint32_t pad[1];           // padding for later use
+};
+
+// Signature of a function receiving the statistics of each frame of an
+// animation encoder, in order, as the frame is output. 'stats' is only valid
+// for the duration of the call.
+typedef void (*WebPAnimEncoderFrameStatsFunction)(
+    const WebPAnimEncoderFrameStats* stats, void* user_data);
+
+// Makes 'enc' call 'hook' for each frame it outputs, during the
+// WebPAnimEncoderAdd() or WebPAnimEncoderAssemble() call that outputs it.
+// Passing a NULL 'hook' removes it.
+// Returns:
+//   True on success.
+WEBP_EXTERN int WebPAnimEncoderSetFrameStatsHook(
+    WebPAnimEncoder* enc, WebPAnimEncoderFrameStatsFunction hook,
+    void* user_data);
+
+// Returns the size in bytes of the frames 'enc' has output so far, or 0 if
+// 'enc' is NULL. Once the animation is assembled, it is what 'target_size'
+// applies to: the assembled file differs from it by a few bytes per frame.
+WEBP_EXTERN size_t WebPAnimEncoderGetFramesSize(const WebPAnimEncoder* enc);
+
 // Get error string corresponding to the most recent call using 'enc'. The
 // returned string is owned by 'enc' and is valid only until the next call to
 // WebPAnimEncoderAdd() or WebPAnimEncoderAssemble() or WebPAnimEncoderDelete().
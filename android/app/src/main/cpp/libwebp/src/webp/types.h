@@ -86,6 +86,59 @@ WEBP_NODISCARD WEBP_EXTERN void* WebPMalloc(size_t size);
 // Releases memory returned by the WebPDecode*() functions (from decode.h).
 WEBP_EXTERN void WebPFree(void* ptr);
 
+// Custom memory allocator. 'Alloc' returns 'size' bytes aligned like malloc(),
+// or NULL. 'Free' releases a block returned by 'Alloc' for the same 'size'.
+// Both may be called from any thread, and the allocator must stay valid until
+// all the memory it allocated is released.
+typedef struct WebPAllocator WebPAllocator;
+struct WebPAllocator {
+  void* (*Alloc)(size_t size, void* user_data);
+  void (*Free)(void* ptr, size_t size, void* user_data);
+  void* user_data;
+};
+
+// Makes the library allocate with 'allocator' on the calling thread, until the
+// next call. NULL restores malloc(). Worker threads of the library use the
+// allocator of the thread that gives them their job. Memory is always freed
+// through the allocator it came from, wherever WebPFree() is called.
+// Returns the previous allocator of the calling thread.
+WEBP_EXTERN const WebPAllocator* WebPSetAllocator(
+    const WebPAllocator* allocator);
+
+// Returns the allocator used on the calling thread, or NULL for malloc().
+WEBP_EXTERN const WebPAllocator* WebPGetAllocator(void);
+
+// Thread-safe memory arena, meant to hold the memory of one encoding or
+// decoding session. Blocks up to 1 MiB are carved from larger chunks and
+// recycled by size class, bigger ones are allocated on their own.
+typedef struct WebPArena WebPArena;
+
+// Creates an arena that holds at most 'limit' bytes, or any amount if 'limit'
+// is 0. Allocations that would exceed the limit fail. Returns NULL in case of
+// memory error.
+WEBP_NODISCARD WEBP_EXTERN WebPArena* WebPArenaNew(size_t limit);
+
+// Releases the arena and all its memory. Blocks allocated from it must not be
+// used anymore.
+WEBP_EXTERN void WebPArenaDelete(WebPArena* arena);
+
+// Returns the allocator drawing from 'arena', to pass to WebPSetAllocator() or
+// to a session's options.
+WEBP_EXTERN const WebPAllocator* WebPArenaGetAllocator(WebPArena* arena);
+
+// Memory accounting of an arena, in bytes.
+typedef struct WebPArenaStats WebPArenaStats;
+struct WebPArenaStats {
+  size_t in_use;     // requested by blocks not freed yet
+  size_t peak;       // highest 'in_use' so far
+  size_t reserved;   // taken from the system, counted against the limit
+  size_t failures;   // allocations refused because of the limit
+};
+
+// Fills 'stats' with the current accounting of 'arena'.
+WEBP_EXTERN void WebPArenaGetStats(WebPArena* arena,
+                                   WebPArenaStats* const stats);
+
 #ifdef __cplusplus
 }    // extern "C"
 #endif
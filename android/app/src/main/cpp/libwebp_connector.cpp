@@ -1,6 +1,22 @@
 #include <jni.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 #include <android/log.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 // libwebp headers
 #include "src/webp/encode.h"
@@ -14,17 +30,1031 @@
 #define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
 #define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
 
+// Byte budget search parameters.
+// Total number of encodes (including the one done while frames are added).
+static const int kMaxBudgetPasses = 4;
+// Quality below which we start dropping frames instead.
+static const float kMinBudgetQuality = 30.f;
+// Fraction of the budget we aim for, so the next pass doesn't land just above it.
+static const float kBudgetAim = 0.95f;
+// ln(size) change per quality point, until two passes give us a real estimate.
+static const float kDefaultLogSizeSlope = 0.025f;
+
+// Frames copied and waiting for (or being encoded by) the encoding thread, at most.
+// Adding a frame blocks once this many are in flight.
+static const size_t kMaxFramesInFlight = 3;
+// Threads encoding the candidate sub-frames of a frame in parallel, at most.
+static const int kMaxCandidateThreads = 4;
+// Threads encoding one frame when multi-threading is on, at most (see WebPConfig).
+static const int kMaxFrameThreads = 16;
+// Encoded frames the animation encoder holds while picking key-frames, at most.
+static const int kMaxBufferedFrames = 8;
+// Frames of the segments re-encoded in parallel, at least. Each one starts with a key-frame.
+static const int kMinSegmentFrames = 16;
+// Native memory a session may hold, including its queued and retained frames. Past it,
+// libwebp allocations of the session fail instead of growing the process.
+static const size_t kMaxSessionBytes = (size_t) 512 << 20;
+
+// A frame kept around so it can be re-encoded, in byte budget mode or if the session
+// retains its frames.
+struct CapturedFrame {
+    WebPPicture pic;
+    int timestamp_ms;
+    // Index of the frame in the session's FrameStore, or -1 if 'pic' owns its samples.
+    int stored;
+};
+
+// Writes all of 'data' at 'offset' of 'fd'.
+static bool writeAt(int fd, const uint8_t *data, size_t size, size_t offset) {
+    while (size > 0) {
+        const ssize_t written = pwrite(fd, data, size, (off_t) offset);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            LOGE("Failed to write output: %s", strerror(errno));
+            return false;
+        }
+        data += written;
+        size -= (size_t) written;
+        offset += (size_t) written;
+    }
+    return true;
+}
+
+// Converts the ARGB picture 'argb' into a new YUV(A)420 picture 'yuv', without
+// allocating ARGB samples for it.
+static bool copyToYuv(const WebPPicture *argb, WebPPicture *yuv) {
+    // The view borrows the ARGB samples, the conversion allocates the YUV ones.
+    if (!WebPPictureView(argb, 0, 0, argb->width, argb->height, yuv) ||
+        !WebPPictureARGBToYUVA(yuv, WEBP_YUV420)) {
+        WebPPictureFree(yuv);
+        return false;
+    }
+    yuv->argb = nullptr;
+    yuv->argb_stride = 0;
+    return true;
+}
+
+/**
+ * Keeps frames in YUV(A)420 in a temporary file instead of the heap, and hands them back
+ * as WebPPicture views into a mapping of that file. The file is unlinked as soon as it is
+ * created, so it goes away with the store, or with the process.
+ */
+class FrameStore {
+public:
+    ~FrameStore() {
+        if (mapping_ != nullptr) munmap(mapping_, mapped_size_);
+        if (fd_ >= 0) close(fd_);
+    }
+
+    // Creates the file in 'dir'.
+    bool open(const char *dir, int width, int height) {
+        std::string path = std::string(dir) + "/frames-XXXXXX";
+        fd_ = mkstemp(&path[0]);
+        if (fd_ < 0) return false;
+        unlink(path.c_str());
+        width_ = width;
+        height_ = height;
+        return true;
+    }
+
+    // Appends a lossy copy of 'pic', converted to YUV420 if it is ARGB. Invalidates the
+    // views handed out before.
+    bool append(const WebPPicture *pic) {
+        WebPPicture yuv;
+        if (!WebPPictureInit(&yuv)) return false;
+        if (pic->use_argb) {
+            if (!copyToYuv(pic, &yuv)) return false;
+            pic = &yuv;
+        }
+        const Entry entry = {size_, pic->a != nullptr};
+        const int uv_width = (width_ + 1) / 2;
+        const int uv_height = (height_ + 1) / 2;
+        // The planes are written at once, one after the other without padding.
+        buffer_.clear();
+        appendPlane(pic->y, pic->y_stride, width_, height_);
+        appendPlane(pic->u, pic->uv_stride, uv_width, uv_height);
+        appendPlane(pic->v, pic->uv_stride, uv_width, uv_height);
+        if (entry.has_alpha) appendPlane(pic->a, pic->a_stride, width_, height_);
+        WebPPictureFree(&yuv);
+        if (!writeAt(fd_, buffer_.data(), buffer_.size(), size_)) return false;
+        size_ += buffer_.size();
+        entries_.push_back(entry);
+        return true;
+    }
+
+    // Number of frames appended so far.
+    size_t count() const { return entries_.size(); }
+
+    // Sets 'pic' to a read-only view of frame 'index'. Valid until the next append().
+    bool view(size_t index, WebPPicture *pic) {
+        if (index >= entries_.size() || !map()) return false;
+        const Entry &entry = entries_[index];
+        const int uv_width = (width_ + 1) / 2;
+        const size_t y_size = (size_t) width_ * height_;
+        const size_t uv_size = (size_t) uv_width * ((height_ + 1) / 2);
+        uint8_t *y = mapping_ + entry.offset;
+        if (!WebPPictureInit(pic)) return false;
+        pic->width = width_;
+        pic->height = height_;
+        pic->use_argb = 0;
+        pic->colorspace = entry.has_alpha ? WEBP_YUV420A : WEBP_YUV420;
+        pic->y = y;
+        pic->u = y + y_size;
+        pic->v = y + y_size + uv_size;
+        pic->y_stride = width_;
+        pic->uv_stride = uv_width;
+        if (entry.has_alpha) {
+            pic->a = y + y_size + 2 * uv_size;
+            pic->a_stride = width_;
+        }
+        return true;
+    }
+
+private:
+    struct Entry {
+        size_t offset;
+        bool has_alpha;
+    };
+
+    void appendPlane(const uint8_t *plane, int stride, int width, int height) {
+        for (int y = 0; y < height; y++) {
+            const uint8_t *row = plane + (size_t) y * stride;
+            buffer_.insert(buffer_.end(), row, row + width);
+        }
+    }
+
+    // Maps the whole file, again if it grew since the last time.
+    bool map() {
+        if (mapping_ != nullptr && mapped_size_ == size_) return true;
+        if (mapping_ != nullptr) munmap(mapping_, mapped_size_);
+        void *mapping = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd_, 0);
+        mapping_ = mapping == MAP_FAILED ? nullptr : static_cast<uint8_t *>(mapping);
+        mapped_size_ = mapping_ == nullptr ? 0 : size_;
+        return mapping_ != nullptr;
+    }
+
+    int fd_ = -1;
+    int width_ = 0;
+    int height_ = 0;
+    size_t size_ = 0;
+    std::vector<Entry> entries_;
+    // The frame being appended.
+    std::vector<uint8_t> buffer_;
+    uint8_t *mapping_ = nullptr;
+    size_t mapped_size_ = 0;
+};
+
+// Statistics of an added frame, as it went through WebPAnimEncoderAdd().
+struct InputFrameStats {
+    int timestamp_ms;
+    int64_t add_us;  // Time spent in WebPAnimEncoderAdd().
+};
+
+// Statistics of a session, returned by nativeReleaseEncoder() and nativeReencode()
+// to tell where the time went: a producer waiting on a full queue means the encoder
+// is the bottleneck, a worker waiting on an empty one means decoding or GL is.
+struct SessionStats {
+    int64_t add_us = 0;            // Total time spent in WebPAnimEncoderAdd().
+    int64_t producer_wait_us = 0;  // Time frames waited for a free slot.
+    int64_t worker_idle_us = 0;    // Time the worker waited for frames.
+    int64_t assemble_us = 0;
+    int64_t budget_us = 0;         // Time spent re-encoding to fit the budget.
+    size_t peak_heap_bytes = 0;    // Most native memory the session held at once.
+    std::vector<InputFrameStats> input_frames;
+    // Frames of the output, which differ from the input ones when similar
+    // frames are merged, or frames are dropped by the encoder or to fit the budget.
+    std::vector<WebPAnimEncoderFrameStats> output_frames;
+};
+
+// A frame handed over to the encoding thread.
+struct QueuedFrame {
+    WebPPicture pic;
+    int timestamp_ms;
+    bool yuv;
+};
+
 // This struct will hold our encoder's state
 struct EncoderState {
+    // Serializes the calls made on this session.
+    std::mutex mutex;
+
+    // Frames are encoded on 'worker', so decoding the next one overlaps with encoding.
+    // The queue and the picture pool are guarded by 'queue_mutex'; everything below
+    // them is only touched by the worker until it has been joined.
+    std::thread worker;
+    std::mutex queue_mutex;
+    std::condition_variable queue_changed;
+    std::deque<QueuedFrame> queue;
+    // Pictures to copy the next frames into, recycled once they are encoded.
+    std::vector<WebPPicture> free_pics;
+    size_t frames_in_flight = 0;
+    bool closing = false;  // No more frames will be queued.
+    // Set to drop queued frames and abort the frame being encoded.
+    std::atomic<bool> aborted{false};
+
     WebPAnimEncoder *anim_encoder = nullptr;
     WebPConfig config;
+    WebPAnimEncoderOptions anim_options;
     int frame_width = 0;
     int frame_height = 0;
+    // If > 0, the assembled animation must not exceed this many bytes.
+    size_t target_bytes = 0;
+    // Keep the frames after the animation is finished, for nativeReencode().
+    bool retain_frames = false;
+    // Set once the animation is finished. Only a retained session outlives it.
+    bool finished = false;
+    // Only filled in byte budget mode or if 'retain_frames'.
+    std::vector<CapturedFrame> frames;
+    // If set, the frames above are kept in this file rather than on the heap when they
+    // are only encoded lossy.
+    std::unique_ptr<FrameStore> frame_store;
+    // File the animation is streamed to as frames are encoded. Owned by the session.
+    int output_fd = -1;
+    // Only read once the worker has been joined.
+    SessionStats stats;
+    // Holds all the libwebp memory of the session, see SessionAllocator. Freed last.
+    WebPArena *arena = nullptr;
+
+    // Lets the worker finish the queued frames (or drop them, if 'abort') and waits
+    // for it. Afterwards the encoder state can be used from the calling thread.
+    void stopWorker(bool abort) {
+        if (!worker.joinable()) return;
+        if (abort) aborted = true;
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            closing = true;
+        }
+        queue_changed.notify_all();
+        worker.join();
+    }
+
+    ~EncoderState() {
+        stopWorker(true);
+        for (QueuedFrame &frame: queue) {
+            WebPPictureFree(&frame.pic);
+        }
+        for (WebPPicture &pic: free_pics) {
+            WebPPictureFree(&pic);
+        }
+        for (CapturedFrame &frame: frames) {
+            WebPPictureFree(&frame.pic);
+        }
+        WebPAnimEncoderDelete(anim_encoder);
+        if (output_fd >= 0) close(output_fd);
+        WebPArenaDelete(arena);
+    }
 };
 
-// Use a static pointer to hold the state across JNI calls.
-// In a more complex app, you might pass a pointer back to Kotlin as a long.
-static EncoderState *state = nullptr;
+// Makes libwebp allocate from the session's arena on the calling thread while in scope.
+// Threads libwebp starts itself follow, and so do the session's animation encoders
+// through their options.
+class SessionAllocator {
+public:
+    explicit SessionAllocator(const EncoderState *s)
+            : previous_(WebPSetAllocator(WebPArenaGetAllocator(s->arena))) {}
+
+    ~SessionAllocator() { WebPSetAllocator(previous_); }
+
+private:
+    const WebPAllocator *previous_;
+};
+
+// Each encoder session is identified by an opaque handle owned by the Kotlin side.
+// Lookups hand out shared pointers, so a session destroyed on one thread stays alive
+// until the calls already running on it have returned.
+static std::mutex sessions_mutex;
+static std::unordered_map<jlong, std::shared_ptr<EncoderState>> sessions;
+static jlong next_handle = 1;
+
+static jlong registerSession(std::shared_ptr<EncoderState> session) {
+    std::lock_guard<std::mutex> lock(sessions_mutex);
+    const jlong handle = next_handle++;
+    sessions[handle] = std::move(session);
+    return handle;
+}
+
+static std::shared_ptr<EncoderState> getSession(jlong handle) {
+    std::lock_guard<std::mutex> lock(sessions_mutex);
+    auto it = sessions.find(handle);
+    return it == sessions.end() ? nullptr : it->second;
+}
+
+// Removes the session from the registry. It is freed once the caller drops it.
+static std::shared_ptr<EncoderState> takeSession(jlong handle) {
+    std::lock_guard<std::mutex> lock(sessions_mutex);
+    auto it = sessions.find(handle);
+    if (it == sessions.end()) return nullptr;
+    std::shared_ptr<EncoderState> session = std::move(it->second);
+    sessions.erase(it);
+    return session;
+}
+
+// Timestamp at which the last frame should end, assuming it lasts as long as
+// the average frame before it.
+static int endTimestamp(const std::vector<CapturedFrame> &frames) {
+    const int first = frames.front().timestamp_ms;
+    const int last = frames.back().timestamp_ms;
+    if (frames.size() < 2) return last + 1;
+    return last + (last - first) / (int) (frames.size() - 1);
+}
+
+// WebPAnimEncoderWriterFunction streaming the animation to the session's file.
+static int writeOutput(const uint8_t *data, size_t data_size, size_t offset, void *user_data) {
+    return writeAt(static_cast<EncoderState *>(user_data)->output_fd, data, data_size, offset);
+}
+
+/**
+ * Turns the thread level the config asks for into a thread count per frame. The cores
+ * left to the encoder are shared by the candidates of a frame, which mostly come in
+ * pairs (sub-frame and key-frame). Frames get no threads of their own when that leaves
+ * them less than two cores.
+ */
+static void spreadFrameThreads(WebPConfig *config, const WebPAnimEncoderOptions &options) {
+    if (config->thread_level <= 0) return;
+    const int cores = (int) std::thread::hardware_concurrency() - 1;
+    const int sharing = std::max(1, std::min(options.candidate_threads, 2));
+    const int threads = cores / sharing;
+    config->thread_level = (threads < 2) ? 0 : std::min(threads, kMaxFrameThreads);
+}
+
+static int64_t nowUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void sampleMemory(EncoderState *s) {
+    WebPArenaStats arena_stats;
+    WebPArenaGetStats(s->arena, &arena_stats);
+    s->stats.peak_heap_bytes = arena_stats.peak;
+    if (arena_stats.failures > 0) {
+        LOGE("%zu allocations failed over the %zu MiB session limit.",
+             arena_stats.failures, kMaxSessionBytes >> 20);
+    }
+}
+
+// WebPAnimEncoderFrameStatsFunction collecting the frames of an animation.
+static void collectFrameStats(const WebPAnimEncoderFrameStats *stats, void *user_data) {
+    static_cast<std::vector<WebPAnimEncoderFrameStats> *>(user_data)->push_back(*stats);
+}
+
+/**
+ * Creates the animation encoder when the first frame comes in. YUV frames are kept
+ * in YUV all the way for lossy encoding, instead of being converted to ARGB and back.
+ */
+static bool ensureAnimEncoder(EncoderState *s, bool yuv_frames) {
+    if (s->anim_encoder != nullptr) return true;
+    s->anim_options.keep_yuv = yuv_frames && !s->config.lossless;
+    s->anim_encoder = WebPAnimEncoderNew(s->frame_width, s->frame_height, &s->anim_options);
+    if (s->anim_encoder == nullptr) {
+        LOGE("Failed to create new WebPAnimEncoder.");
+        return false;
+    }
+    WebPAnimEncoderSetFrameStatsHook(s->anim_encoder, collectFrameStats,
+                                     &s->stats.output_frames);
+    if (!WebPAnimEncoderSetWriter(s->anim_encoder, writeOutput, s)) {
+        LOGE("Failed to set the output writer: %s", WebPAnimEncoderGetError(s->anim_encoder));
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Keeps a copy of an added frame in byte budget mode, in case the result doesn't fit,
+ * or if the session retains its frames. The encoder has converted 'pic' to the format
+ * it works in, so re-encoding it later doesn't need another conversion. Frames that
+ * are only encoded lossy are kept in YUV420, which is 2.7 times smaller than ARGB, and
+ * in the frame store if the session has one.
+ */
+static void captureFrame(EncoderState *s, const WebPPicture *pic, int timestamp_ms) {
+    if (s->target_bytes == 0 && !s->retain_frames) return;
+    const bool lossy_only = !s->config.lossless && !s->anim_options.allow_mixed;
+    // The pixels belong to the caller and are reused for the next frame.
+    CapturedFrame frame = {{}, timestamp_ms, -1};
+    bool ok = WebPPictureInit(&frame.pic);
+    if (ok && lossy_only && s->frame_store != nullptr) {
+        // 'pic' becomes a view into the store once all frames are in, see viewStoredFrames().
+        frame.stored = (int) s->frame_store->count();
+        ok = s->frame_store->append(pic);
+    } else if (ok && lossy_only && pic->use_argb) {
+        ok = copyToYuv(pic, &frame.pic);
+    } else if (ok) {
+        ok = WebPPictureCopy(pic, &frame.pic);
+    }
+    if (!ok) {
+        LOGE("Failed to keep frame at timestamp %d", timestamp_ms);
+        return;
+    }
+    s->frames.push_back(frame);
+}
+
+const char *getWebPErrorString(int error_code) {
+    switch (error_code) {
+        case VP8_ENC_OK:
+            return "OK";
+        case VP8_ENC_ERROR_OUT_OF_MEMORY:
+            return "OUT_OF_MEMORY";
+        case VP8_ENC_ERROR_BITSTREAM_OUT_OF_MEMORY:
+            return "BITSTREAM_OUT_OF_MEMORY";
+        case VP8_ENC_ERROR_NULL_PARAMETER:
+            return "NULL_PARAMETER";
+        case VP8_ENC_ERROR_INVALID_CONFIGURATION:
+            return "INVALID_CONFIGURATION";
+        case VP8_ENC_ERROR_BAD_DIMENSION:
+            return "BAD_DIMENSION";
+        case VP8_ENC_ERROR_PARTITION0_OVERFLOW:
+            return "PARTITION0_OVERFLOW";
+        case VP8_ENC_ERROR_PARTITION_OVERFLOW:
+            return "PARTITION_OVERFLOW";
+        case VP8_ENC_ERROR_BAD_WRITE:
+            return "BAD_WRITE";
+        case VP8_ENC_ERROR_FILE_TOO_BIG:
+            return "FILE_TOO_BIG";
+        case VP8_ENC_ERROR_USER_ABORT:
+            return "USER_ABORT";
+        default:
+            return "UNKNOWN_ERROR";
+    }
+}
+
+// Makes WebPEncode() give up on the frame being encoded once the session is aborted.
+static int abortHook(int /* percent */, const WebPPicture *picture) {
+    return !static_cast<const EncoderState *>(picture->user_data)->aborted;
+}
+
+/**
+ * Waits for a free slot and returns a picture to copy the next frame into, allocated
+ * for ARGB or YUV420 samples. Returns false if the session was aborted meanwhile.
+ */
+static bool acquirePicture(EncoderState *s, bool yuv, WebPPicture *pic) {
+    {
+        std::unique_lock<std::mutex> lock(s->queue_mutex);
+        const int64_t wait_start_us = nowUs();
+        s->queue_changed.wait(lock, [s] {
+            return s->frames_in_flight < kMaxFramesInFlight || s->aborted;
+        });
+        s->stats.producer_wait_us += nowUs() - wait_start_us;
+        if (s->aborted) return false;
+        if (s->free_pics.empty()) {
+            if (!WebPPictureInit(pic)) return false;
+        } else {
+            *pic = s->free_pics.back();
+            s->free_pics.pop_back();
+        }
+    }
+    // The encoder may have converted a recycled picture to the other format.
+    const bool allocated = yuv ? pic->y != nullptr : pic->argb != nullptr;
+    if (pic->use_argb == (int) yuv || !allocated) {
+        WebPPictureFree(pic);
+        pic->width = s->frame_width;
+        pic->height = s->frame_height;
+        pic->use_argb = !yuv;
+        pic->colorspace = WEBP_YUV420;
+        if (!WebPPictureAlloc(pic)) {
+            LOGE("Failed to allocate a frame.");
+            return false;
+        }
+    }
+    pic->progress_hook = abortHook;
+    pic->user_data = s;
+    return true;
+}
+
+// Hands a filled picture over to the encoding thread, which takes ownership of it.
+static void queueFrame(EncoderState *s, const WebPPicture *pic, int timestamp_ms, bool yuv) {
+    {
+        std::lock_guard<std::mutex> lock(s->queue_mutex);
+        s->queue.push_back({*pic, timestamp_ms, yuv});
+        s->frames_in_flight++;
+    }
+    s->queue_changed.notify_all();
+}
+
+// Body of the encoding thread: adds the queued frames to the animation until the
+// session is closed and the queue drained, or the session is aborted.
+static void encodeQueuedFrames(EncoderState *s) {
+    SessionAllocator allocator(s);
+    for (;;) {
+        QueuedFrame frame;
+        {
+            std::unique_lock<std::mutex> lock(s->queue_mutex);
+            const int64_t wait_start_us = nowUs();
+            s->queue_changed.wait(lock, [s] { return !s->queue.empty() || s->closing; });
+            s->stats.worker_idle_us += nowUs() - wait_start_us;
+            if (s->queue.empty() || s->aborted) return;
+            frame = s->queue.front();
+            s->queue.pop_front();
+        }
+
+        if (ensureAnimEncoder(s, frame.yuv)) {
+            const int64_t add_start_us = nowUs();
+            const bool added = WebPAnimEncoderAdd(s->anim_encoder, &frame.pic,
+                                                  frame.timestamp_ms, &s->config);
+            const int64_t add_us = nowUs() - add_start_us;
+            if (!added) {
+                const char *error_string = getWebPErrorString(frame.pic.error_code);
+                LOGE("Failed to add frame to WebPAnimEncoder at timestamp %d. Error: %s (%d)",
+                     frame.timestamp_ms, error_string, frame.pic.error_code);
+            } else {
+                captureFrame(s, &frame.pic, frame.timestamp_ms);
+            }
+            sampleMemory(s);
+            s->stats.add_us += add_us;
+            s->stats.input_frames.push_back({frame.timestamp_ms, add_us});
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(s->queue_mutex);
+            s->free_pics.push_back(frame.pic);
+            s->frames_in_flight--;
+        }
+        s->queue_changed.notify_all();
+    }
+}
+
+/**
+ * Encodes the captured frames 'kept[begin, end)' on their own, as an animation ending
+ * at 'end_timestamp_ms'.
+ */
+static bool encodeSegment(const EncoderState *s, const WebPConfig &config,
+                          const WebPAnimEncoderOptions &options, const std::vector<size_t> &kept,
+                          size_t begin, size_t end, int end_timestamp_ms, WebPData *out,
+                          std::vector<WebPAnimEncoderFrameStats> *frame_stats,
+                          std::vector<InputFrameStats> *input_frames) {
+    WebPAnimEncoder *encoder = WebPAnimEncoderNew(s->frame_width, s->frame_height, &options);
+    if (encoder == nullptr) return false;
+    WebPAnimEncoderSetFrameStatsHook(encoder, collectFrameStats, frame_stats);
+
+    bool ok = true;
+    for (size_t i = begin; i < end && ok; i++) {
+        const CapturedFrame &frame = s->frames[kept[i]];
+        WebPPicture pic = frame.pic;  // Shallow copy, the encoder doesn't modify it.
+        const int64_t add_start_us = nowUs();
+        ok = WebPAnimEncoderAdd(encoder, &pic, frame.timestamp_ms, &config);
+        if (input_frames != nullptr) {
+            input_frames->push_back({frame.timestamp_ms, nowUs() - add_start_us});
+        }
+    }
+    ok = ok && WebPAnimEncoderAdd(encoder, nullptr, end_timestamp_ms, nullptr);
+    ok = ok && WebPAnimEncoderAssemble(encoder, out);
+    if (!ok) {
+        LOGE("Re-encoding failed: %s", WebPAnimEncoderGetError(encoder));
+    }
+    WebPAnimEncoderDelete(encoder);
+    return ok;
+}
+
+/**
+ * Appends the frames of the segment 'data' to 'mux'. Fails if the segment starts with
+ * a frame that doesn't cover the canvas, as it would show through to the frames of the
+ * previous segment instead of a cleared canvas.
+ */
+static bool appendSegment(const EncoderState *s, const WebPData &data,
+                          const std::vector<WebPAnimEncoderFrameStats> &frame_stats,
+                          bool first, WebPMux *mux) {
+    if (!first && (frame_stats.empty() || frame_stats[0].x_offset != 0 ||
+                   frame_stats[0].y_offset != 0 || frame_stats[0].width != s->frame_width ||
+                   frame_stats[0].height != s->frame_height)) {
+        return false;
+    }
+    WebPMux *segment = WebPMuxCreate(&data, 0);
+    if (segment == nullptr) return false;
+    bool ok = true;
+    for (size_t i = 0; i < frame_stats.size() && ok; i++) {
+        WebPMuxFrameInfo frame;
+        ok = WebPMuxGetFrame(segment, (uint32_t) i + 1, &frame) == WEBP_MUX_OK;
+        if (!ok) break;
+        // A segment whose frames were all merged into one is a still image, without a
+        // duration.
+        frame.duration = frame_stats[i].duration;
+        ok = WebPMuxPushFrame(mux, &frame, 1) == WEBP_MUX_OK;
+        WebPDataClear(&frame.bitstream);
+    }
+    WebPMuxDelete(segment);
+    return ok;
+}
+
+/**
+ * Encodes the kept frames as segments of whole key-frame intervals on several threads,
+ * and stitches them together. Returns false if the frames can't be split this way, or
+ * if the segments couldn't be stitched.
+ */
+static bool encodeSegments(const EncoderState *s, const WebPConfig &config,
+                           const WebPAnimEncoderOptions &options, const std::vector<size_t> &kept,
+                           WebPData *out, std::vector<WebPAnimEncoderFrameStats> *frame_stats,
+                           std::vector<InputFrameStats> *input_frames) {
+    // Key-frames have to come at least every kmax frames for segments to start with one
+    // without making the animation bigger.
+    const int kmax = options.kmax;
+    if (options.minimize_size || kmax <= 0 || kmax == INT_MAX) return false;
+    const size_t segment_frames =
+            kmax == 1 ? kMinSegmentFrames
+                      : (size_t) kmax * ((kMinSegmentFrames + kmax - 1) / kmax);
+    const size_t segment_count = (kept.size() + segment_frames - 1) / segment_frames;
+    const int thread_count =
+            std::min((int) segment_count, (int) std::thread::hardware_concurrency());
+    if (segment_count < 2 || thread_count < 2) return false;
+    // A transparent first frame is cropped to its opaque area, see appendSegment(). The
+    // first frame of every segment is checked before encoding any.
+    for (size_t begin = 0; begin < kept.size(); begin += segment_frames) {
+        const WebPPicture &first = s->frames[kept[begin]].pic;
+        if (first.use_argb ? WebPPictureHasTransparency(&first) : first.a != nullptr) {
+            return false;
+        }
+    }
+
+    struct Segment {
+        WebPData data;
+        std::vector<WebPAnimEncoderFrameStats> frame_stats;
+        std::vector<InputFrameStats> input_frames;
+        bool ok = false;
+    };
+    std::vector<Segment> segments(segment_count);
+    // The segments already keep the threads busy.
+    WebPAnimEncoderOptions segment_options = options;
+    segment_options.candidate_threads = 0;
+    WebPConfig segment_config = config;
+    segment_config.thread_level = 0;
+    std::atomic<size_t> next_segment{0};
+    auto encodeNext = [&]() {
+        for (size_t i = next_segment++; i < segment_count; i = next_segment++) {
+            const size_t begin = i * segment_frames;
+            const size_t end = std::min(begin + segment_frames, kept.size());
+            const int end_timestamp_ms = end < kept.size()
+                                         ? s->frames[kept[end]].timestamp_ms
+                                         : endTimestamp(s->frames);
+            Segment &segment = segments[i];
+            WebPDataInit(&segment.data);
+            // Each segment gets the share of the byte budget of its part of the timeline.
+            WebPAnimEncoderOptions budget_options = segment_options;
+            if (options.target_size > 0) {
+                const int duration_ms = end_timestamp_ms - s->frames[kept[begin]].timestamp_ms;
+                budget_options.target_size =
+                        (int) ((int64_t) options.target_size * duration_ms / options.target_duration);
+                budget_options.target_duration = duration_ms;
+            }
+            segment.ok = encodeSegment(s, segment_config, budget_options, kept, begin, end,
+                                       end_timestamp_ms, &segment.data, &segment.frame_stats,
+                                       &segment.input_frames);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < thread_count; i++) threads.emplace_back(encodeNext);
+    encodeNext();
+    for (std::thread &thread: threads) thread.join();
+
+    WebPMux *mux = WebPMuxNew();
+    bool ok = mux != nullptr &&
+              WebPMuxSetCanvasSize(mux, s->frame_width, s->frame_height) == WEBP_MUX_OK &&
+              WebPMuxSetAnimationParams(mux, &options.anim_params) == WEBP_MUX_OK;
+    for (size_t i = 0; i < segment_count && ok; i++) {
+        ok = segments[i].ok && appendSegment(s, segments[i].data, segments[i].frame_stats,
+                                             i == 0, mux);
+    }
+    ok = ok && WebPMuxAssemble(mux, out) == WEBP_MUX_OK;
+    WebPMuxDelete(mux);
+    for (Segment &segment: segments) {
+        WebPDataClear(&segment.data);
+        if (!ok) continue;
+        frame_stats->insert(frame_stats->end(), segment.frame_stats.begin(),
+                            segment.frame_stats.end());
+        if (input_frames != nullptr) {
+            input_frames->insert(input_frames->end(), segment.input_frames.begin(),
+                                 segment.input_frames.end());
+        }
+    }
+    if (!ok) {
+        WebPDataClear(out);
+        LOGE("Failed to stitch the %zu re-encoded segments, re-encoding them as one.",
+             segment_count);
+    }
+    return ok;
+}
+
+/**
+ * Encodes the captured frames again with the given quality, keeping roughly
+ * 'keep_ratio' of them. Dropped frames are merged into the previous kept frame.
+ * The byte budget is spread over the frames as set by setRateControl() only if
+ * 'spread_budget' is true, otherwise every frame gets 'quality'.
+ * Long animations are encoded in parallel segments, see encodeSegments().
+ * 'input_frames', if set, receives the time spent on each kept frame.
+ */
+static bool reencodeFrames(const EncoderState *s, float quality, float keep_ratio,
+                           bool spread_budget, WebPData *out,
+                           std::vector<WebPAnimEncoderFrameStats> *frame_stats,
+                           std::vector<InputFrameStats> *input_frames = nullptr) {
+    WebPConfig config = s->config;
+    config.quality = quality;
+    std::vector<size_t> kept;
+    float kept_ratio = 0.f;
+    for (size_t i = 0; i < s->frames.size(); i++) {
+        // Always keep the first frame, then one out of every 1 / keep_ratio.
+        kept_ratio += keep_ratio;
+        if (i > 0 && kept_ratio < 1.f) continue;
+        if (kept_ratio >= 1.f) kept_ratio -= 1.f;
+        kept.push_back(i);
+    }
+
+    WebPAnimEncoderOptions options = s->anim_options;
+    if (!spread_budget) {
+        options.target_size = 0;
+        options.target_duration = 0;
+    }
+    // Frames kept in YUV are encoded as they are.
+    options.keep_yuv = !s->frames.front().pic.use_argb && !config.lossless;
+    if (encodeSegments(s, config, options, kept, out, frame_stats, input_frames)) return true;
+    return encodeSegment(s, config, options, kept, 0, kept.size(), endTimestamp(s->frames),
+                         out, frame_stats, input_frames);
+}
+
+/**
+ * Has the animation encoder spread the byte budget over the 'duration_ms' the frames
+ * last, by lowering their quality as it encodes them, down to kMinBudgetQuality. It
+ * aims a bit below the budget, and fitToBudget() deals with what it still misses.
+ */
+static void setRateControl(const EncoderState *s, int duration_ms, WebPConfig *config,
+                           WebPAnimEncoderOptions *options) {
+    if (s->target_bytes == 0 || duration_ms <= 0) return;
+    options->target_size = (int) std::min<double>(INT_MAX, s->target_bytes * kBudgetAim);
+    options->target_duration = duration_ms;
+    config->qmin = (int) std::min(kMinBudgetQuality, config->quality);
+}
+
+/**
+ * Returns the quality the frames were encoded with, averaged over their duration,
+ * or 'fallback' if they have none.
+ */
+static float meanQuality(const std::vector<WebPAnimEncoderFrameStats> &frame_stats,
+                         float fallback) {
+    double weighted_sum = 0.;
+    int64_t duration_ms = 0;
+    for (const WebPAnimEncoderFrameStats &frame: frame_stats) {
+        weighted_sum += (double) frame.quality * frame.duration;
+        duration_ms += frame.duration;
+    }
+    return duration_ms > 0 ? (float) (weighted_sum / (double) duration_ms) : fallback;
+}
+
+/**
+ * Makes 'data' (encoded with every frame, by the rate control if there was one)
+ * fit the byte budget by re-encoding the captured frames at a single quality.
+ * Models ln(size) as linear in quality and proportional to the number of kept
+ * frames, starting from the mean quality 'data' was encoded with, lowers quality
+ * down to kMinBudgetQuality and drops frames beyond that. If no pass fits, 'data'
+ * holds the smallest result. The output frame statistics follow it.
+ */
+static void fitToBudget(EncoderState *s, WebPData *data) {
+    const double aim = (double) s->target_bytes * kBudgetAim;
+    float quality = meanQuality(s->stats.output_frames, s->config.quality);
+    float keep_ratio = 1.f;
+    double slope = kDefaultLogSizeSlope;
+    // Last pass, expressed as the size it would have with every frame kept.
+    float last_quality = quality;
+    double last_full_size = (double) data->size;
+
+    for (int pass = 1; pass < kMaxBudgetPasses && data->size > s->target_bytes; pass++) {
+        float next_quality = quality - (float) (std::log(last_full_size / aim) / slope);
+        float next_keep_ratio = 1.f;
+        if (next_quality < kMinBudgetQuality) {
+            next_quality = kMinBudgetQuality;
+            const double full_size_at_min =
+                    last_full_size * std::exp(slope * (kMinBudgetQuality - last_quality));
+            next_keep_ratio = (float) std::fmin(1., aim / full_size_at_min);
+        }
+        quality = next_quality;
+        keep_ratio = next_keep_ratio;
+        LOGI("Budget pass %d: %zu > %zu bytes, trying quality %.1f keeping %.0f%% of frames",
+             pass, data->size, s->target_bytes, quality, keep_ratio * 100.f);
+
+        WebPData candidate;
+        WebPDataInit(&candidate);
+        std::vector<WebPAnimEncoderFrameStats> candidate_frames;
+        if (!reencodeFrames(s, quality, keep_ratio, false, &candidate, &candidate_frames)) {
+            break;
+        }
+
+        const double full_size = (double) candidate.size / keep_ratio;
+        if (quality != last_quality && full_size != last_full_size) {
+            const double measured =
+                    std::log(last_full_size / full_size) / (last_quality - quality);
+            if (measured > 0.) slope = measured;
+        }
+        last_quality = quality;
+        last_full_size = full_size;
+
+        if (candidate.size < data->size) {
+            WebPDataClear(data);
+            *data = candidate;
+            s->stats.output_frames.swap(candidate_frames);
+        } else {
+            WebPDataClear(&candidate);
+        }
+    }
+}
+
+// Fields of the config packed by WebPConfig.pack() in LibWebP.kt, in that order.
+enum ConfigField {
+    kLossless,
+    kQuality,
+    kMethod,
+    kImageHint,
+    kTargetSize,
+    kTargetPSNR,
+    kSegments,
+    kSnsStrength,
+    kFilterStrength,
+    kFilterSharpness,
+    kFilterType,
+    kAutofilter,
+    kAlphaCompression,
+    kAlphaFiltering,
+    kAlphaQuality,
+    kPass,
+    kShowCompressed,
+    kPreprocessing,
+    kPartitions,
+    kPartitionLimit,
+    kEmulateJpegSize,
+    kThreadLevel,
+    kLowMemory,
+    kNearLossless,
+    kExact,
+    // Animation encoder options
+    kKmin,
+    kKmax,
+    kMinimizeSize,
+    kAllowMixed,
+    kLoopCount,
+    kKeyframeTolerance,
+    kMergeThreshold,
+    kSceneCutThreshold,
+    kDecimateCost,
+    kReuseAnalysis,
+    kConfigFieldCount
+};
+
+// Number of 32-bit words of the mask of the fields that are set.
+static constexpr int kConfigMaskWords = (kConfigFieldCount + 31) / 32;
+
+/**
+ * Reads a config packed by WebPConfig.pack(): a mask of the fields that are set,
+ * in kConfigMaskWords words, followed by one value per field, floats as their bits. Fields that are not set
+ * keep their default.
+ */
+static bool unpackConfig(JNIEnv *env, jintArray packed, WebPConfig *config,
+                         WebPAnimEncoderOptions *options) {
+    constexpr int kPackedSize = kConfigMaskWords + kConfigFieldCount;
+    jint values[kPackedSize];
+    if (packed == nullptr || env->GetArrayLength(packed) != kPackedSize) return false;
+    env->GetIntArrayRegion(packed, 0, kPackedSize, values);
+    const jint *const fields = values + kConfigMaskWords;
+
+    auto isSet = [&](ConfigField field) {
+        return (static_cast<uint32_t>(values[field / 32]) >> (field % 32)) & 1;
+    };
+    auto updateInt = [&](ConfigField field, int &target) {
+        if (isSet(field)) target = fields[field];
+    };
+    auto updateFloat = [&](ConfigField field, float &target) {
+        if (isSet(field)) memcpy(&target, &fields[field], sizeof(target));
+    };
+
+    updateInt(kLossless, config->lossless);
+    updateFloat(kQuality, config->quality);
+    updateInt(kMethod, config->method);
+    if (isSet(kImageHint)) {
+        config->image_hint = static_cast<WebPImageHint>(fields[kImageHint]);
+    }
+    updateInt(kTargetSize, config->target_size);
+    updateFloat(kTargetPSNR, config->target_PSNR);
+    updateInt(kSegments, config->segments);
+    updateInt(kSnsStrength, config->sns_strength);
+    updateInt(kFilterStrength, config->filter_strength);
+    updateInt(kFilterSharpness, config->filter_sharpness);
+    updateInt(kFilterType, config->filter_type);
+    updateInt(kAutofilter, config->autofilter);
+    updateInt(kAlphaCompression, config->alpha_compression);
+    updateInt(kAlphaFiltering, config->alpha_filtering);
+    updateInt(kAlphaQuality, config->alpha_quality);
+    updateInt(kPass, config->pass);
+    updateInt(kShowCompressed, config->show_compressed);
+    updateInt(kPreprocessing, config->preprocessing);
+    updateInt(kPartitions, config->partitions);
+    updateInt(kPartitionLimit, config->partition_limit);
+    updateInt(kEmulateJpegSize, config->emulate_jpeg_size);
+    updateInt(kThreadLevel, config->thread_level);
+    updateInt(kLowMemory, config->low_memory);
+    updateInt(kNearLossless, config->near_lossless);
+    updateInt(kExact, config->exact);
+
+    // Animation encoder options. They are sanitized by WebPAnimEncoderNew().
+    updateInt(kKmin, options->kmin);
+    updateInt(kKmax, options->kmax);
+    updateInt(kMinimizeSize, options->minimize_size);
+    updateInt(kAllowMixed, options->allow_mixed);
+    updateInt(kLoopCount, options->anim_params.loop_count);
+    updateInt(kKeyframeTolerance, options->keyframe_tolerance);
+    updateInt(kMergeThreshold, options->merge_threshold);
+    updateInt(kSceneCutThreshold, options->scene_cut_threshold);
+    updateInt(kDecimateCost, options->decimate_cost);
+    updateInt(kReuseAnalysis, options->reuse_analysis);
+    return true;
+}
+
+// Layout of the statistics packed by packStats(), read by EncoderStats in LibWebP.kt.
+enum SessionStat {
+    kStatSize,
+    kStatInputFrames,
+    kStatOutputFrames,
+    kStatAddUs,
+    kStatProducerWaitUs,
+    kStatWorkerIdleUs,
+    kStatAssembleUs,
+    kStatBudgetUs,
+    kStatPeakHeapBytes,
+    kStatPeakBufferedFrames,
+    kStatPeakBufferedBytes,
+    kSessionStatCount
+};
+
+enum InputFrameStat {
+    kInputTimestampMs,
+    kInputAddUs,
+    kInputFrameStatCount
+};
+
+enum OutputFrameStat {
+    kOutputKeyFrame,
+    kOutputXOffset,
+    kOutputYOffset,
+    kOutputWidth,
+    kOutputHeight,
+    kOutputDuration,
+    kOutputCandidates,
+    kOutputLossless,
+    kOutputBlend,
+    kOutputDispose,
+    kOutputSize,
+    kOutputInputFrames,
+    kOutputQuality,
+    kOutputFrameStatCount
+};
+
+/**
+ * Packs the session statistics into a long array: the SessionStat values, then
+ * the InputFrameStat values of each added frame, then the OutputFrameStat values
+ * of each frame of the output.
+ */
+static jlongArray packStats(JNIEnv *env, const SessionStats &stats, size_t size) {
+    std::vector<jlong> packed(kSessionStatCount);
+    packed[kStatSize] = (jlong) size;
+    packed[kStatInputFrames] = (jlong) stats.input_frames.size();
+    packed[kStatOutputFrames] = (jlong) stats.output_frames.size();
+    packed[kStatAddUs] = stats.add_us;
+    packed[kStatProducerWaitUs] = stats.producer_wait_us;
+    packed[kStatWorkerIdleUs] = stats.worker_idle_us;
+    packed[kStatAssembleUs] = stats.assemble_us;
+    packed[kStatBudgetUs] = stats.budget_us;
+    packed[kStatPeakHeapBytes] = (jlong) stats.peak_heap_bytes;
+    packed[kStatPeakBufferedFrames] = 0;
+    packed[kStatPeakBufferedBytes] = 0;
+    for (const WebPAnimEncoderFrameStats &frame: stats.output_frames) {
+        packed[kStatPeakBufferedFrames] =
+                std::max(packed[kStatPeakBufferedFrames], (jlong) frame.buffered_frames);
+        packed[kStatPeakBufferedBytes] =
+                std::max(packed[kStatPeakBufferedBytes], (jlong) frame.buffered_size);
+    }
+    for (const InputFrameStats &frame: stats.input_frames) {
+        jlong values[kInputFrameStatCount];
+        values[kInputTimestampMs] = frame.timestamp_ms;
+        values[kInputAddUs] = frame.add_us;
+        packed.insert(packed.end(), values, values + kInputFrameStatCount);
+    }
+    for (const WebPAnimEncoderFrameStats &frame: stats.output_frames) {
+        jlong values[kOutputFrameStatCount];
+        values[kOutputKeyFrame] = frame.is_key_frame;
+        values[kOutputXOffset] = frame.x_offset;
+        values[kOutputYOffset] = frame.y_offset;
+        values[kOutputWidth] = frame.width;
+        values[kOutputHeight] = frame.height;
+        values[kOutputDuration] = frame.duration;
+        values[kOutputCandidates] = frame.num_candidates;
+        values[kOutputLossless] = frame.lossless;
+        values[kOutputBlend] = frame.blend_method;
+        values[kOutputDispose] = frame.dispose_method;
+        values[kOutputSize] = (jlong) frame.size;
+        values[kOutputInputFrames] = frame.num_input_frames;
+        values[kOutputQuality] = std::lround(frame.quality);
+        packed.insert(packed.end(), values, values + kOutputFrameStatCount);
+    }
+
+    jlongArray result = env->NewLongArray((jsize) packed.size());
+    if (result == nullptr) {
+        LOGE("Could not create the stats array.");
+        return nullptr;
+    }
+    env->SetLongArrayRegion(result, 0, (jsize) packed.size(), packed.data());
+    return result;
+}
 
 
 extern "C" {
@@ -120,148 +1150,73 @@ Java_de_loicezt_stickers_video_LibWebP_nativeDecode(
     return JNI_TRUE;
 }
 
-JNIEXPORT jboolean JNICALL
+JNIEXPORT jlong JNICALL
 Java_de_loicezt_stickers_video_LibWebP_nativeInitEncoder(
         JNIEnv *env,
         jobject /* this */,
         jint width,
         jint height,
-        jobject configJava) {
-
-    if (state != nullptr) {
-        LOGE("Encoder already initialized. Please release it first.");
-        return JNI_FALSE;
-    }
-
-    state = new EncoderState();
+        jintArray packedConfig,
+        jint targetBytes,
+        jint durationMs,
+        jboolean retainFrames,
+        jstring frameCacheDir,
+        jint outputFd) {
+
+    auto state = std::make_shared<EncoderState>();
+    // The session owns the file from now on, even if initialization fails.
+    state->output_fd = outputFd;
     state->frame_width = width;
     state->frame_height = height;
-
-    jclass configClass = env->GetObjectClass(configJava);
+    state->target_bytes = targetBytes > 0 ? (size_t) targetBytes : 0;
+    state->retain_frames = retainFrames;
+    state->arena = WebPArenaNew(kMaxSessionBytes);
+    if (state->arena == nullptr) {
+        LOGE("Failed to create the session's memory arena.");
+        return 0;
+    }
+    if (frameCacheDir != nullptr) {
+        const char *dir = env->GetStringUTFChars(frameCacheDir, nullptr);
+        state->frame_store = std::make_unique<FrameStore>();
+        if (dir == nullptr || !state->frame_store->open(dir, width, height)) {
+            // Not fatal, the frames are kept on the heap instead.
+            LOGE("Failed to create a frame store: %s", strerror(errno));
+            state->frame_store.reset();
+        }
+        if (dir != nullptr) env->ReleaseStringUTFChars(frameCacheDir, dir);
+    }
 
     if (!WebPConfigInit(&state->config)) {
         LOGE("Failed to initialize WebPConfig.");
-        delete state;
-        state = nullptr;
-        return JNI_FALSE;
+        return 0;
+    }
+    // The encoder itself is created with the first frame, once we know whether frames
+    // come in as YUV or BGRA.
+    if (!WebPAnimEncoderOptionsInit(&state->anim_options)) {
+        LOGE("Failed to initialize WebPAnimEncoderOptions.");
+        return 0;
+    }
+    if (!unpackConfig(env, packedConfig, &state->config, &state->anim_options)) {
+        LOGE("Invalid packed config");
+        return 0;
     }
-    // --- Helper lambdas to reduce boilerplate for JNI calls ---
-
-    // Helper to update an 'int' field in the C struct from a Java 'Integer'.
-    auto updateInt = [&](const char *fieldName, int &targetField) {
-        jfieldID fid = env->GetFieldID(configClass, fieldName, "Ljava/lang/Integer;");
-        if (fid == nullptr) return; // Field not found, skip.
-        jobject fieldObj = env->GetObjectField(configJava, fid);
-        if (fieldObj != nullptr) {
-            jclass intClass = env->FindClass("java/lang/Integer");
-            jmethodID mid = env->GetMethodID(intClass, "intValue", "()I");
-            targetField = env->CallIntMethod(fieldObj, mid);
-            env->DeleteLocalRef(intClass);
-            env->DeleteLocalRef(fieldObj);
-        }
-    };
-
-    // Helper to update a 'float' field in the C struct from a Java 'Float'.
-    auto updateFloat = [&](const char *fieldName, float &targetField) {
-        jfieldID fid = env->GetFieldID(configClass, fieldName, "Ljava/lang/Float;");
-        if (fid == nullptr) return;
-        jobject fieldObj = env->GetObjectField(configJava, fid);
-        if (fieldObj != nullptr) {
-            jclass floatClass = env->FindClass("java/lang/Float");
-            jmethodID mid = env->GetMethodID(floatClass, "floatValue", "()F");
-            targetField = env->CallFloatMethod(fieldObj, mid);
-            env->DeleteLocalRef(floatClass);
-            env->DeleteLocalRef(fieldObj);
-        }
-    };
-
-    // Helper to update an 'int' field in the C struct from a Java 'Boolean'.
-    auto updateBoolean = [&](const char *fieldName, int &targetField) {
-        jfieldID fid = env->GetFieldID(configClass, fieldName, "Ljava/lang/Boolean;");
-        if (fid == nullptr) return;
-        jobject fieldObj = env->GetObjectField(configJava, fid);
-        if (fieldObj != nullptr) {
-            jclass boolClass = env->FindClass("java/lang/Boolean");
-            jmethodID mid = env->GetMethodID(boolClass, "booleanValue", "()Z");
-            // Assigns 1 for true, 0 for false.
-            targetField = env->CallBooleanMethod(fieldObj, mid);
-            env->DeleteLocalRef(boolClass);
-            env->DeleteLocalRef(fieldObj);
-        }
-    };
-
-    // Helper to update an enum field in the C struct from a Java Enum.
-    // ⚠️ IMPORTANT: Replace "Lcom/yourpackage/WebPImageHint;" with the correct path to your enum class.
-    const char *webPImageHintSignature = "Lde/loicezt/stickers/video/WebPImageHint;";
-    auto updateEnum = [&](const char *fieldName, WebPImageHint &targetField) {
-        jfieldID fid = env->GetFieldID(configClass, fieldName, webPImageHintSignature);
-        if (fid == nullptr) return;
-        jobject fieldObj = env->GetObjectField(configJava, fid);
-        if (fieldObj != nullptr) {
-            jclass enumClass = env->GetObjectClass(fieldObj);
-            jmethodID mid = env->GetMethodID(enumClass, "ordinal", "()I");
-            // Get the enum's ordinal value and cast it to the C enum type.
-            targetField = static_cast<WebPImageHint>(env->CallIntMethod(fieldObj, mid));
-            env->DeleteLocalRef(enumClass);
-            env->DeleteLocalRef(fieldObj);
-        }
-    };
-
-
-    // --- Map and Update Each Field ---
-    // The first argument is the Kotlin field name (camelCase).
-    // The second argument is a reference to the C struct field (snake_case).
-
-    updateBoolean("lossless", state->config.lossless);
-    updateFloat("quality", state->config.quality);
-    updateInt("method", state->config.method);
-    updateEnum("imageHint", state->config.image_hint);
-    updateInt("targetSize", state->config.target_size);
-    updateFloat("targetPSNR", state->config.target_PSNR);
-    updateInt("segments", state->config.segments);
-    updateInt("snsStrength", state->config.sns_strength);
-    updateInt("filterStrength", state->config.filter_strength);
-    updateInt("filterSharpness", state->config.filter_sharpness);
-    updateInt("filterType", state->config.filter_type);
-    updateInt("autofilter", state->config.autofilter);
-    updateInt("alphaCompression", state->config.alpha_compression);
-    updateInt("alphaFiltering", state->config.alpha_filtering);
-    updateInt("alphaQuality", state->config.alpha_quality);
-    updateInt("pass", state->config.pass);
-    updateInt("showCompressed", state->config.show_compressed);
-    updateInt("preprocessing", state->config.preprocessing);
-    updateInt("partitions", state->config.partitions);
-    updateInt("partitionLimit", state->config.partition_limit);
-    updateInt("emulateJpegSize", state->config.emulate_jpeg_size);
-    updateInt("threadLevel", state->config.thread_level);
-    updateInt("lowMemory", state->config.low_memory);
-    updateInt("nearLossless", state->config.near_lossless);
-    updateInt("exact", state->config.exact);
-
-    // Clean up the local reference to the class object.
-    env->DeleteLocalRef(configClass);
 
     if (!WebPValidateConfig(&state->config)) {
         LOGE("Invalid config");
-        delete state;
-        state = nullptr;
-        return JNI_FALSE;
+        return 0;
     }
 
-    // 2. Setup the animation encoder
-    WebPAnimEncoderOptions anim_options;
-    anim_options.verbose = 1;
-    WebPAnimEncoderOptionsInit(&anim_options);
-    state->anim_encoder = WebPAnimEncoderNew(width, height, &anim_options);
-    if (state->anim_encoder == nullptr) {
-        LOGE("Failed to create new WebPAnimEncoder.");
-        delete state;
-        state = nullptr;
-        return JNI_FALSE;
-    }
+    // Leave a core to the decoder and the GL readback feeding the encoder.
+    state->anim_options.candidate_threads =
+            std::min(kMaxCandidateThreads, (int) std::thread::hardware_concurrency() - 1);
+    state->anim_options.max_buffered_frames = kMaxBufferedFrames;
+    spreadFrameThreads(&state->config, state->anim_options);
+    state->anim_options.allocator = WebPArenaGetAllocator(state->arena);
+    setRateControl(state.get(), durationMs, &state->config, &state->anim_options);
+    state->worker = std::thread(encodeQueuedFrames, state.get());
 
     LOGI("Native encoder initialized successfully for %dx%d.", width, height);
-    return JNI_TRUE;
+    return registerSession(std::move(state));
 }
 
 
@@ -269,15 +1224,19 @@ JNIEXPORT void JNICALL
 Java_de_loicezt_stickers_video_LibWebP_nativeAddFrameYuv(
         JNIEnv *env,
         jobject /* this */,
+        jlong handle,
         jobject y_buffer, jint y_stride,
         jobject u_buffer, jint u_stride,
         jobject v_buffer, jint v_stride,
         jint timestamp_ms) {
 
-    if (state == nullptr || state->anim_encoder == nullptr) {
+    std::shared_ptr<EncoderState> state = getSession(handle);
+    if (state == nullptr) {
         LOGE("Cannot add frame. Encoder not initialized.");
         return;
     }
+    std::lock_guard<std::mutex> lock(state->mutex);
+    SessionAllocator allocator(state.get());
 
     // Get direct pointers to the pixel data for each plane
     auto *y_pixels = static_cast<uint8_t *>(env->GetDirectBufferAddress(y_buffer));
@@ -289,60 +1248,23 @@ Java_de_loicezt_stickers_video_LibWebP_nativeAddFrameYuv(
         return;
     }
 
-    // --- KEY CHANGE: Manually set up the YUV picture from the planes ---
+    // Copy the planes into a YUV picture for the encoding thread. The planes are owned
+    // by the MediaCodec Image, which is closed in Kotlin as soon as we return.
     WebPPicture pic;
-    if (!WebPPictureInit(&pic)) {
-        LOGE("Failed to init WebPPicture");
-        return;
+    if (!acquirePicture(state.get(), true, &pic)) return;
+    const int uv_width = (state->frame_width + 1) / 2;
+    const int uv_height = (state->frame_height + 1) / 2;
+    for (int y = 0; y < state->frame_height; y++) {
+        memcpy(pic.y + y * pic.y_stride, y_pixels + y * y_stride, state->frame_width);
     }
-    pic.width = state->frame_width;
-    pic.height = state->frame_height;
-    pic.use_argb = 0; // We are providing YUV data
-
-    // Set pointers to the Y, U, and V planes
-    pic.y = y_pixels;
-    pic.u = u_pixels;
-    pic.v = v_pixels;
-
-    // Set the stride for each plane
-    pic.y_stride = y_stride;
-    pic.uv_stride = u_stride; // For YUV420, U and V strides are the same
-
-    // 4. Add the YUV picture to the animation encoder
-    if (!WebPAnimEncoderAdd(state->anim_encoder, &pic, timestamp_ms, &state->config)) {
-        LOGE("Failed to add YUV frame to WebPAnimEncoder at timestamp %d", timestamp_ms);
+    // For YUV420, U and V strides are the same
+    for (int y = 0; y < uv_height; y++) {
+        memcpy(pic.u + y * pic.uv_stride, u_pixels + y * u_stride, uv_width);
+        memcpy(pic.v + y * pic.uv_stride, v_pixels + y * v_stride, uv_width);
     }
 
-    // WebPPictureFree(&pic) is NOT needed here because we didn't allocate memory with it.
-    // The memory is owned by the MediaCodec Image, which we closed in Kotlin.
-}
-const char *getWebPErrorString(int error_code) {
-    switch (error_code) {
-        case VP8_ENC_OK:
-            return "OK";
-        case VP8_ENC_ERROR_OUT_OF_MEMORY:
-            return "OUT_OF_MEMORY";
-        case VP8_ENC_ERROR_BITSTREAM_OUT_OF_MEMORY:
-            return "BITSTREAM_OUT_OF_MEMORY";
-        case VP8_ENC_ERROR_NULL_PARAMETER:
-            return "NULL_PARAMETER";
-        case VP8_ENC_ERROR_INVALID_CONFIGURATION:
-            return "INVALID_CONFIGURATION";
-        case VP8_ENC_ERROR_BAD_DIMENSION:
-            return "BAD_DIMENSION";
-        case VP8_ENC_ERROR_PARTITION0_OVERFLOW:
-            return "PARTITION0_OVERFLOW";
-        case VP8_ENC_ERROR_PARTITION_OVERFLOW:
-            return "PARTITION_OVERFLOW";
-        case VP8_ENC_ERROR_BAD_WRITE:
-            return "BAD_WRITE";
-        case VP8_ENC_ERROR_FILE_TOO_BIG:
-            return "FILE_TOO_BIG";
-        case VP8_ENC_ERROR_USER_ABORT:
-            return "USER_ABORT";
-        default:
-            return "UNKNOWN_ERROR";
-    }
+    // 4. Queue the YUV picture for the animation encoder
+    queueFrame(state.get(), &pic, timestamp_ms, true);
 }
 
 // --- NEW: Helper function to log the entire WebPConfig struct ---
@@ -382,13 +1304,17 @@ JNIEXPORT void JNICALL
 Java_de_loicezt_stickers_video_LibWebP_nativeAddFrame(
         JNIEnv *env,
         jobject /* this */,
+        jlong handle,
         jobject frameBuffer,
         jint timestampMs) {
 
-    if (state == nullptr || state->anim_encoder == nullptr) {
+    std::shared_ptr<EncoderState> state = getSession(handle);
+    if (state == nullptr) {
         LOGE("Cannot add frame. Encoder not initialized.");
         return;
     }
+    std::lock_guard<std::mutex> lock(state->mutex);
+    SessionAllocator allocator(state.get());
 
     // Get a direct pointer to the pixel data from the Java ByteBuffer
     auto *pixels = static_cast<uint8_t *>(env->GetDirectBufferAddress(frameBuffer));
@@ -396,70 +1322,234 @@ Java_de_loicezt_stickers_video_LibWebP_nativeAddFrame(
         LOGE("Failed to get direct buffer address.");
         return;
     }
-
-    // 3. Create a WebPPicture and import the pixels
-    WebPPicture pic;
-    if (!WebPPictureInit(&pic)) {
-        LOGE("Failed to init WebPPicture");
+    const jlong frame_size = (jlong) state->frame_width * state->frame_height * 4;
+    if (env->GetDirectBufferCapacity(frameBuffer) < frame_size) {
+        LOGE("Frame buffer is too small.");
         return;
     }
-    pic.width = state->frame_width;
-    pic.height = state->frame_height;
-    pic.use_argb = 1; // We are providing RGBA data
 
-    // Import the RGBA data. The stride is the number of bytes per row.
-    WebPPictureImportRGBA(&pic, pixels, state->frame_width * 4);
+    // 3. Copy the pixels into a picture for the encoding thread, as the caller reuses
+    // the buffer for the next frame. This blocks while too many frames are in flight.
+    WebPPicture pic;
+    if (!acquirePicture(state.get(), false, &pic)) return;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // BGRA bytes already are the 0xAARRGGBB words WebPPicture uses, so a plain copy
+    // does instead of importing (converting) them.
+    for (int y = 0; y < state->frame_height; y++) {
+        memcpy(pic.argb + y * pic.argb_stride, pixels + y * state->frame_width * 4,
+               state->frame_width * 4);
+    }
+#else
+    WebPPictureImportBGRA(&pic, pixels, state->frame_width * 4);
+#endif
 
-    // 4. Add the picture to the animation encoder
+    // 4. Queue the picture for the animation encoder
     //logWebPConfig(&state->config);
-    if (!WebPAnimEncoderAdd(state->anim_encoder, &pic, timestampMs, &state->config)) {
-        const char *error_string = getWebPErrorString(pic.error_code);
-        LOGE("Failed to add frame to WebPAnimEncoder at timestamp %d. Error: %s (%d)",
-             timestampMs, error_string, pic.error_code);
-    } else {
-        LOGI("Added frame at Timestamp %d", timestampMs);
-    }
+    queueFrame(state.get(), &pic, timestampMs, false);
+}
 
-    WebPPictureFree(&pic); // Free the picture memory
+/**
+ * Points the captured frames kept in the frame store to their samples. No frame is
+ * captured anymore, so the views stay valid until the session goes away.
+ */
+static bool viewStoredFrames(EncoderState *s) {
+    for (CapturedFrame &frame: s->frames) {
+        if (frame.stored < 0) continue;
+        if (!s->frame_store->view((size_t) frame.stored, &frame.pic)) {
+            LOGE("Failed to map the stored frames: %s", strerror(errno));
+            return false;
+        }
+    }
+    return true;
 }
 
-JNIEXPORT jbyteArray JNICALL
-Java_de_loicezt_stickers_video_LibWebP_nativeReleaseEncoder(
-        JNIEnv *env,
-        jobject /* this */) {
+/**
+ * Fits the animation 'data' to the byte budget if there is one, writes it to the
+ * session's file unless it already is there ('data' only holding its size), and
+ * returns the session statistics packed by packStats(), or null on failure.
+ */
+static jlongArray fitAndPackStats(JNIEnv *env, EncoderState *s, WebPData *data) {
+    SessionStats &stats = s->stats;
+    if (s->target_bytes > 0 && data->size > s->target_bytes) {
+        const int64_t budget_start_us = nowUs();
+        fitToBudget(s, data);
+        LOGI("Size after fitting to the %zu bytes budget: %zu bytes",
+             s->target_bytes, data->size);
+        stats.budget_us = nowUs() - budget_start_us;
+    }
+    // Re-encoded animations are assembled in memory.
+    const size_t size = data->size;
+    if (data->bytes != nullptr) {
+        const bool ok = ftruncate(s->output_fd, 0) == 0 &&
+                        writeAt(s->output_fd, data->bytes, data->size, 0);
+        WebPDataClear(data);
+        if (!ok) return nullptr;
+    }
 
+    LOGI("Encoded %zu frames into %zu in %.2fs (queue waits: producer %.2fs, worker %.2fs), "
+         "assembled in %.2fs, fit to budget in %.2fs, peak memory %zu KiB",
+         stats.input_frames.size(), stats.output_frames.size(), stats.add_us / 1e6,
+         stats.producer_wait_us / 1e6, stats.worker_idle_us / 1e6, stats.assemble_us / 1e6,
+         stats.budget_us / 1e6, stats.peak_heap_bytes / 1024);
+    return packStats(env, stats, size);
+}
 
-    if (state == nullptr) { /* ... error handling ... */ return nullptr; }
+/**
+ * Finishes the animation streamed to the session's file, fitting it to the byte budget
+ * if there is one, and returns the session statistics packed by packStats(), or null on
+ * failure. The worker must have been stopped.
+ */
+static jlongArray finishAnimation(JNIEnv *env, EncoderState *s) {
+    if (!ensureAnimEncoder(s, false)) return nullptr;  // No frame was added.
+    s->finished = true;
+    if (!viewStoredFrames(s)) return nullptr;
+    SessionStats &stats = s->stats;
 
     // Assemble the animation
-    WebPAnimEncoderAdd(state->anim_encoder, nullptr, 0, nullptr);
+    const int64_t assemble_start_us = nowUs();
+    if (s->frames.empty()) {
+        WebPAnimEncoderAdd(s->anim_encoder, nullptr, 0, nullptr);
+    } else {
+        WebPAnimEncoderAdd(s->anim_encoder, nullptr, endTimestamp(s->frames), nullptr);
+    }
+    // The frames already are in the file, this only writes its end. 'webp_data' just
+    // holds the size.
     WebPData webp_data;
     WebPDataInit(&webp_data);
-    if (!WebPAnimEncoderAssemble(state->anim_encoder, &webp_data)) {
-        LOGE("Failed to assemble final WebP animation.");
-        WebPAnimEncoderDelete(state->anim_encoder);
-        delete state;
-        state = nullptr;
+    if (!WebPAnimEncoderAssemble(s->anim_encoder, &webp_data)) {
+        LOGE("Failed to assemble final WebP animation: %s",
+             WebPAnimEncoderGetError(s->anim_encoder));
         return nullptr;
     }
-
+    stats.assemble_us = nowUs() - assemble_start_us;
+    sampleMemory(s);
     LOGI("Successfully assembled WebP data. Size: %zu bytes", webp_data.size);
+    if (s->anim_options.target_size > 0) {
+        LOGI("Rate control: the frames take %zu bytes for a target of %d bytes.",
+             WebPAnimEncoderGetFramesSize(s->anim_encoder), s->anim_options.target_size);
+    }
+    return fitAndPackStats(env, s, &webp_data);
+}
 
-    // --- NEW: Create a Java byte array and copy the data into it ---
-    jbyteArray byteArray = env->NewByteArray(webp_data.size);
-    void *temp = env->GetPrimitiveArrayCritical(byteArray, nullptr);
-    memcpy(temp, webp_data.bytes, webp_data.size);
-    env->ReleasePrimitiveArrayCritical(byteArray, temp, 0);
-    // --- End of new code ---
+/**
+ * Finishes the animation streamed to the session's file and returns the session
+ * statistics packed by packStats(), or null on failure. The session is freed, unless
+ * it retains its frames: it then stays around for nativeReencode() until
+ * nativeDestroyEncoder().
+ */
+JNIEXPORT jlongArray JNICALL
+Java_de_loicezt_stickers_video_LibWebP_nativeReleaseEncoder(
+        JNIEnv *env,
+        jobject /* this */,
+        jlong handle) {
+
+    std::shared_ptr<EncoderState> state = getSession(handle);
+    if (state == nullptr) {
+        LOGE("Cannot release encoder. Encoder not initialized.");
+        return nullptr;
+    }
+    if (!state->retain_frames) takeSession(handle);
+    std::lock_guard<std::mutex> lock(state->mutex);
+    SessionAllocator allocator(state.get());
+    // Wait for the queued frames to be encoded.
+    state->stopWorker(false);
+    // Only the captured frames are needed from now on.
+    for (WebPPicture &pic: state->free_pics) {
+        WebPPictureFree(&pic);
+    }
+    state->free_pics.clear();
+    jlongArray stats = finishAnimation(env, state.get());
+    LOGI("Native encoder released.");
+    return stats;
+}
+
+/**
+ * Encodes the frames retained by a finished session again with another config,
+ * without the decoding and GL work that produced them, and writes the animation to
+ * 'outputFd', which the session owns from now on. Returns the statistics of the new
+ * animation, packed by packStats(), or null on failure.
+ */
+JNIEXPORT jlongArray JNICALL
+Java_de_loicezt_stickers_video_LibWebP_nativeReencode(
+        JNIEnv *env,
+        jobject /* this */,
+        jlong handle,
+        jintArray packedConfig,
+        jint targetBytes,
+        jint outputFd) {
+
+    std::shared_ptr<EncoderState> state = getSession(handle);
+    if (state == nullptr || !state->retain_frames) {
+        LOGE("Cannot re-encode. The session doesn't retain its frames.");
+        close(outputFd);
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(state->mutex);
+    SessionAllocator allocator(state.get());
+    if (!state->finished || state->frames.empty()) {
+        LOGE("Cannot re-encode. The session has no finished animation.");
+        close(outputFd);
+        return nullptr;
+    }
 
-    // Cleanup
-    WebPDataClear(&webp_data);
+    WebPConfig config;
+    WebPAnimEncoderOptions options;
+    if (!WebPConfigInit(&config) || !WebPAnimEncoderOptionsInit(&options) ||
+        !unpackConfig(env, packedConfig, &config, &options) || !WebPValidateConfig(&config)) {
+        LOGE("Invalid config");
+        close(outputFd);
+        return nullptr;
+    }
+    options.candidate_threads = state->anim_options.candidate_threads;
+    options.max_buffered_frames = state->anim_options.max_buffered_frames;
+    options.allocator = state->anim_options.allocator;
+    spreadFrameThreads(&config, options);
+
+    // Start over from the retained frames, into the new file.
+    close(state->output_fd);
+    state->output_fd = outputFd;
+    state->config = config;
+    state->anim_options = options;
+    state->target_bytes = targetBytes > 0 ? (size_t) targetBytes : 0;
+    setRateControl(state.get(), endTimestamp(state->frames) - state->frames.front().timestamp_ms,
+                   &state->config, &state->anim_options);
     WebPAnimEncoderDelete(state->anim_encoder);
-    delete state;
-    state = nullptr;
+    state->anim_encoder = nullptr;
+    state->stats = SessionStats();
 
-    LOGI("Native encoder released.");
-    return byteArray; // Return the raw data to Kotlin
+    EncoderState *s = state.get();
+    SessionStats &stats = s->stats;
+    // Like the budget passes, this is assembled in memory, in parallel segments if the
+    // animation is long enough.
+    WebPData webp_data;
+    WebPDataInit(&webp_data);
+    if (!reencodeFrames(s, s->config.quality, 1.f, true, &webp_data, &stats.output_frames,
+                        &stats.input_frames)) {
+        return nullptr;
+    }
+    for (const InputFrameStats &frame: stats.input_frames) stats.add_us += frame.add_us;
+    sampleMemory(s);
+    LOGI("Re-encoded %zu retained frames into %zu bytes.", s->frames.size(), webp_data.size);
+    return fitAndPackStats(env, s, &webp_data);
+}
+
+/**
+ * Discards an encoder session without assembling it, e.g. after a cancelled export.
+ */
+JNIEXPORT void JNICALL
+Java_de_loicezt_stickers_video_LibWebP_nativeDestroyEncoder(
+        JNIEnv * /* env */,
+        jobject /* this */,
+        jlong handle) {
+
+    std::shared_ptr<EncoderState> state = takeSession(handle);
+    if (state == nullptr) return;
+    // Wait for calls still running on the session before it goes away.
+    std::lock_guard<std::mutex> lock(state->mutex);
+    // Drop the queued frames and stop the frame being encoded.
+    state->stopWorker(true);
+    LOGI("Native encoder destroyed.");
 }
 
 } // extern "C"
\ No newline at end of file
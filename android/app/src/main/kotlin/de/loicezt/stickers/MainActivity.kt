@@ -33,7 +33,7 @@ class MainActivity : FlutterActivity() {
         super.configureFlutterEngine(flutterEngine)
 
         cropAndScale = CropAndScale()
-        overlayAndEncode = OverlayAndEncode()
+        overlayAndEncode = OverlayAndEncode(cacheDir)
 
         // 1. Setup the MethodChannel to receive commands from Flutter
         MethodChannel(
@@ -66,7 +66,8 @@ class MainActivity : FlutterActivity() {
                             overlayFile,
                             outputFile,
                             WebPConfig.fromMap(args["config"]!! as Map<*, *>),
-                            args["fps"]!! as Int
+                            args["fps"]!! as Int,
+                            args["maxSize"] as? Int ?: 0
                         )
                         result.success(null)
                     } catch (e: NullPointerException) {
@@ -136,12 +137,17 @@ class MainActivity : FlutterActivity() {
 
                     eventScope = CoroutineScope(Dispatchers.Main + SupervisorJob())
                     eventScope?.launch {
-                        overlayAndEncode.status.combine(overlayAndEncode.progress) { status, progress ->
+                        combine(
+                            overlayAndEncode.status,
+                            overlayAndEncode.progress,
+                            overlayAndEncode.stats
+                        ) { status, progress, stats ->
                             mapOf(
                                 "status" to status.name,
                                 "progress" to progress.progress,
                                 "currentFrame" to progress.currentFrame,
-                                "totalFrames" to progress.totalFrames
+                                "totalFrames" to progress.totalFrames,
+                                "stats" to stats?.toMap()
                             )
                         }.collect { update ->
                             events.success(update)
@@ -160,6 +166,8 @@ class MainActivity : FlutterActivity() {
     override fun onDestroy() {
         super.onDestroy()
         cropAndScale.release()
+        // Frees the frames kept for re-encoding the last export
+        overlayAndEncode.release()
         scope.cancel()
     }
 }
@@ -0,0 +1,19 @@
+package de.loicezt.stickers.video
+
+/**
+ * Where the time of an export went, to tell whether it is bound by decoding, GL or the encoder.
+ * Times are in microseconds.
+ * @param decodeWaitUs Time spent waiting for the decoder to output frames.
+ * @param glUs Time spent drawing the overlay and reading the frames back.
+ * @param addFrameUs Time spent handing frames over to the encoder, which blocks when it is behind.
+ * @param encoder The statistics of the encoder session.
+ */
+data class ExportStats(
+    val decodeWaitUs: Long, val glUs: Long, val addFrameUs: Long, val encoder: EncoderStats
+) {
+    fun toMap(): Map<String, Any> = encoder.toMap() + mapOf(
+        "decodeWaitUs" to decodeWaitUs,
+        "glUs" to glUs,
+        "addFrameUs" to addFrameUs
+    )
+}
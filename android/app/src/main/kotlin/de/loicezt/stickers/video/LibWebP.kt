@@ -1,9 +1,9 @@
 package de.loicezt.stickers.video
 
-import androidx.annotation.Keep
+import android.os.ParcelFileDescriptor
+import java.io.File
 import java.nio.ByteBuffer
 
-@Keep
 enum class WebPImageHint {
     DEFAULT,
     PICTURE,
@@ -12,7 +12,6 @@ enum class WebPImageHint {
     LAST
 }
 
-@Keep
 data class WebPConfig(
     val lossless: Boolean?,
     val quality: Float?,
@@ -39,7 +38,74 @@ data class WebPConfig(
     val lowMemory: Int?,
     val nearLossless: Int?,
     val exact: Int?,
+    // Animation encoder options
+    val kmin: Int?,
+    val kmax: Int?,
+    val minimizeSize: Int?,
+    val allowMixed: Int?,
+    val loopCount: Int?,
+    val keyframeTolerance: Int?,
+    val mergeThreshold: Int?,
+    val sceneCutThreshold: Int?,
+    val decimateCost: Int?,
+    val reuseAnalysis: Int?,
 ){
+    /**
+     * Packs the config for the native encoder: a mask of the fields that are set, in as many
+     * 32-bit words as needed, then one value per field in declaration order, floats as their bits.
+     * The layout must match ConfigField in libwebp_connector.cpp.
+     */
+    fun pack(): IntArray {
+        fun boolToInt(value: Boolean?): Int? = value?.let { if (it) 1 else 0 }
+
+        val values = listOf(
+            boolToInt(lossless),
+            quality?.toRawBits(),
+            method,
+            imageHint?.ordinal,
+            targetSize,
+            targetPSNR?.toRawBits(),
+            segments,
+            snsStrength,
+            filterStrength,
+            filterSharpness,
+            filterType,
+            autofilter,
+            alphaCompression,
+            alphaFiltering,
+            alphaQuality,
+            pass,
+            showCompressed,
+            preprocessing,
+            partitions,
+            partitionLimit,
+            emulateJpegSize,
+            threadLevel,
+            lowMemory,
+            nearLossless,
+            exact,
+            kmin,
+            kmax,
+            minimizeSize,
+            allowMixed,
+            loopCount,
+            keyframeTolerance,
+            mergeThreshold,
+            sceneCutThreshold,
+            decimateCost,
+            reuseAnalysis
+        )
+        val maskWords = (values.size + 31) / 32
+        val packed = IntArray(maskWords + values.size)
+        values.forEachIndexed { i, value ->
+            if (value != null) {
+                packed[i / 32] = packed[i / 32] or (1 shl (i % 32))
+                packed[maskWords + i] = value
+            }
+        }
+        return packed
+    }
+
     companion object {
         fun fromMap(map: Map<*, *>): WebPConfig {
             fun boolToInt(value: Any?): Int? = (value as? Boolean)?.let { if (it) 1 else 0 }
@@ -79,7 +145,143 @@ data class WebPConfig(
                 threadLevel = boolToInt(map["threadLevel"]),
                 lowMemory = boolToInt(map["lowMemory"]),
                 nearLossless = map["nearLossless"] as? Int,
-                exact = boolToInt(map["exact"])
+                exact = boolToInt(map["exact"]),
+                kmin = map["kmin"] as? Int,
+                kmax = map["kmax"] as? Int,
+                minimizeSize = boolToInt(map["minimizeSize"]),
+                allowMixed = boolToInt(map["allowMixed"]),
+                loopCount = map["loopCount"] as? Int,
+                keyframeTolerance = map["keyframeTolerance"] as? Int,
+                mergeThreshold = map["mergeThreshold"] as? Int,
+                sceneCutThreshold = map["sceneCutThreshold"] as? Int,
+                decimateCost = map["decimateCost"] as? Int,
+                reuseAnalysis = boolToInt(map["reuseAnalysis"])
+            )
+        }
+    }
+}
+
+/**
+ * Statistics of an encoder session, to tell whether an export is bound by the encoder or by
+ * what feeds it. Times are in microseconds.
+ * @property producerWaitUs Time addFrame() blocked because the encoder was behind.
+ * @property workerIdleUs Time the encoder waited for the next frame.
+ * @property peakBufferedFrames Most encoded frames held at once while picking key-frames.
+ * @property peakBufferedBytes Most bytes of encoded frames held at once.
+ */
+data class EncoderStats(
+    val size: Long,
+    val addUs: Long,
+    val producerWaitUs: Long,
+    val workerIdleUs: Long,
+    val assembleUs: Long,
+    val budgetUs: Long,
+    val peakHeapBytes: Long,
+    val peakBufferedFrames: Long,
+    val peakBufferedBytes: Long,
+    val inputFrames: List<InputFrame>,
+    val outputFrames: List<OutputFrame>,
+) {
+    /** An added frame. [addUs] is the time it took to encode it. */
+    data class InputFrame(val timestampMs: Int, val addUs: Long)
+
+    /**
+     * A frame of the animation. Similar frames are merged, and frames may be dropped by the
+     * encoder or to fit the byte budget, so these don't match the input frames one to one.
+     * [candidates] is the number of encodings tried, the smallest one was kept.
+     * [inputFrames] is the number of input frames it shows, 0 if it only extends the previous one.
+     */
+    data class OutputFrame(
+        val keyFrame: Boolean,
+        val xOffset: Int,
+        val yOffset: Int,
+        val width: Int,
+        val height: Int,
+        val durationMs: Int,
+        val candidates: Int,
+        val lossless: Boolean,
+        val blend: Boolean,
+        val disposeToBackground: Boolean,
+        val size: Long,
+        val inputFrames: Int,
+        val quality: Int,
+    )
+
+    fun toMap(): Map<String, Any> = mapOf(
+        "size" to size,
+        "addUs" to addUs,
+        "producerWaitUs" to producerWaitUs,
+        "workerIdleUs" to workerIdleUs,
+        "assembleUs" to assembleUs,
+        "budgetUs" to budgetUs,
+        "peakHeapBytes" to peakHeapBytes,
+        "peakBufferedFrames" to peakBufferedFrames,
+        "peakBufferedBytes" to peakBufferedBytes,
+        "inputFrames" to inputFrames.map {
+            mapOf("timestampMs" to it.timestampMs, "addUs" to it.addUs)
+        },
+        "outputFrames" to outputFrames.map {
+            mapOf(
+                "keyFrame" to it.keyFrame,
+                "xOffset" to it.xOffset,
+                "yOffset" to it.yOffset,
+                "width" to it.width,
+                "height" to it.height,
+                "durationMs" to it.durationMs,
+                "candidates" to it.candidates,
+                "lossless" to it.lossless,
+                "blend" to it.blend,
+                "disposeToBackground" to it.disposeToBackground,
+                "size" to it.size,
+                "inputFrames" to it.inputFrames,
+                "quality" to it.quality
+            )
+        }
+    )
+
+    companion object {
+        // Layout of the packed stats, must match packStats() in libwebp_connector.cpp.
+        private const val SESSION_STAT_COUNT = 11
+        private const val INPUT_FRAME_STAT_COUNT = 2
+        private const val OUTPUT_FRAME_STAT_COUNT = 13
+
+        fun fromPacked(packed: LongArray): EncoderStats {
+            val inputCount = packed[1].toInt()
+            val outputCount = packed[2].toInt()
+            val outputStart = SESSION_STAT_COUNT + inputCount * INPUT_FRAME_STAT_COUNT
+            return EncoderStats(
+                size = packed[0],
+                addUs = packed[3],
+                producerWaitUs = packed[4],
+                workerIdleUs = packed[5],
+                assembleUs = packed[6],
+                budgetUs = packed[7],
+                peakHeapBytes = packed[8],
+                peakBufferedFrames = packed[9],
+                peakBufferedBytes = packed[10],
+                inputFrames = List(inputCount) { i ->
+                    val at = SESSION_STAT_COUNT + i * INPUT_FRAME_STAT_COUNT
+                    InputFrame(packed[at].toInt(), packed[at + 1])
+                },
+                outputFrames = List(outputCount) { i ->
+                    val at = outputStart + i * OUTPUT_FRAME_STAT_COUNT
+                    OutputFrame(
+                        keyFrame = packed[at] != 0L,
+                        xOffset = packed[at + 1].toInt(),
+                        yOffset = packed[at + 2].toInt(),
+                        width = packed[at + 3].toInt(),
+                        height = packed[at + 4].toInt(),
+                        durationMs = packed[at + 5].toInt(),
+                        candidates = packed[at + 6].toInt(),
+                        lossless = packed[at + 7] != 0L,
+                        // WEBP_MUX_BLEND is 0, WEBP_MUX_DISPOSE_BACKGROUND is 1.
+                        blend = packed[at + 8] == 0L,
+                        disposeToBackground = packed[at + 9] == 1L,
+                        size = packed[at + 10],
+                        inputFrames = packed[at + 11].toInt(),
+                        quality = packed[at + 12].toInt()
+                    )
+                }
             )
         }
     }
@@ -103,7 +305,71 @@ class LibWebP {
     external fun nativeDecode(data: ByteArray, outBuffer: ByteBuffer, stride: Int): Boolean
 
 
-    external fun nativeAddFrameYuv(
+    /**
+     * Handle of the native encoder session owned by this object, or 0 if there is none.
+     * Each LibWebP object has its own session, so several animations can be encoded in parallel.
+     */
+    @Volatile
+    private var encoderHandle = 0L
+
+    // Whether the session outlives releaseEncoder(), for reencode().
+    private var retainFrames = false
+
+    /**
+     * Initializes the WebP encoder with output settings.
+     * @param width The width of the frames.
+     * @param height The height of the frames.
+     * @param targetBytes If > 0, the maximum size of the animation. The encoder spreads it over
+     * [durationMs] as it goes, lowering the quality of the frames. Frames are also kept in memory
+     * so that quality and frame rate can be lowered further without decoding the video again.
+     * @param durationMs The expected duration of the animation, for [targetBytes].
+     * @param retainFrames Keep the frames once the animation is finished, so that [reencode]
+     * can encode them again with another config. They are freed by [destroyEncoder].
+     * @param frameCacheDir If set, the frames kept for re-encoding are written to a temporary file
+     * in this directory, in YUV420, instead of being held in memory. Only applies to lossy encoding.
+     * @param outputFile The file the animation is written to, frame by frame as they are encoded.
+     * It is truncated first.
+     * @return True if initialization was successful.
+     */
+    @Synchronized
+    fun initEncoder(
+        width: Int,
+        height: Int,
+        config: WebPConfig,
+        targetBytes: Int,
+        durationMs: Int,
+        outputFile: File,
+        retainFrames: Boolean = false,
+        frameCacheDir: File? = null
+    ): Boolean {
+        check(encoderHandle == 0L) { "Encoder already initialized. Please release it first." }
+        this.retainFrames = retainFrames
+        encoderHandle = nativeInitEncoder(
+            width, height, config.pack(), targetBytes, durationMs, retainFrames,
+            frameCacheDir?.absolutePath, openOutput(outputFile)
+        )
+        return encoderHandle != 0L
+    }
+
+    // The native session takes ownership of the descriptor.
+    private fun openOutput(outputFile: File): Int = ParcelFileDescriptor.open(
+        outputFile,
+        ParcelFileDescriptor.MODE_WRITE_ONLY or ParcelFileDescriptor.MODE_CREATE or
+                ParcelFileDescriptor.MODE_TRUNCATE
+    ).detachFd()
+
+    /**
+     * Adds a single BGRA frame to the WebP animation.
+     * The frame is copied and encoded on a native thread, so this returns as soon as it is queued,
+     * blocking only while a few frames are already waiting to be encoded.
+     * @param frameBuffer A direct ByteBuffer containing the BGRA pixel data. It can be reused as soon
+     * as this returns.
+     * @param timestampMs The timestamp for this frame in milliseconds.
+     */
+    fun addFrame(frameBuffer: ByteBuffer, timestampMs: Int) =
+        nativeAddFrame(encoderHandle, frameBuffer, timestampMs)
+
+    fun addFrameYuv(
         yBuffer: ByteBuffer,
         yStride: Int,
         uBuffer: ByteBuffer,
@@ -111,35 +377,82 @@ class LibWebP {
         vBuffer: ByteBuffer,
         vStride: Int,
         timestampMs: Int
-    )
+    ) = nativeAddFrameYuv(encoderHandle, yBuffer, yStride, uBuffer, uStride, vBuffer, vStride, timestampMs)
 
     /**
-     * Initializes the WebP encoder with output settings.
-     * @param path The full path to the output .webp file.
-     * @param width The width of the frames.
-     * @param height The height of the frames.
-     * @return True if initialization was successful.
+     * Waits for the queued frames to be encoded, finishes writing the animation to the output
+     * file and frees the encoder session, unless it retains its frames.
+     * @return The statistics of the session, including the size of the WebP file, if successful,
+     * otherwise null.
      */
-    external fun nativeInitEncoder(
-        width: Int, height: Int, config: WebPConfig
-    ): Boolean
+    @Synchronized
+    fun releaseEncoder(): EncoderStats? {
+        val handle = encoderHandle
+        if (!retainFrames) encoderHandle = 0L
+        return nativeReleaseEncoder(handle)?.let { EncoderStats.fromPacked(it) }
+    }
 
     /**
-     * Adds a single RGBA frame to the WebP animation.
-     * @param frameBuffer A direct ByteBuffer containing the RGBA pixel data.
-     * @param timestampMs The timestamp for this frame in milliseconds.
+     * Encodes the frames retained by a released session again with another config, without
+     * decoding or compositing anything. Can be called several times, each call replaces the
+     * previous output.
+     * @param targetBytes If > 0, the maximum size of the animation, as in [initEncoder].
+     * @param outputFile The file the animation is written to. It is truncated first.
+     * @return The statistics of the new animation if successful, otherwise null.
      */
-    external fun nativeAddFrame(frameBuffer: ByteBuffer, timestampMs: Int)
+    @Synchronized
+    fun reencode(config: WebPConfig, targetBytes: Int, outputFile: File): EncoderStats? {
+        check(encoderHandle != 0L && retainFrames) { "No retained frames to re-encode." }
+        return nativeReencode(encoderHandle, config.pack(), targetBytes, openOutput(outputFile))
+            ?.let { EncoderStats.fromPacked(it) }
+    }
 
     /**
-     * Finalizes the WebP file, writes it to disk, and cleans up resources.
-     * @return The path to the output file if successful, otherwise null.
+     * Frees the encoder session without assembling anything, dropping the frames not encoded yet,
+     * or the retained ones. Does nothing if there is none.
      */
-    external fun nativeReleaseEncoder(): ByteArray?
+    @Synchronized
+    fun destroyEncoder() {
+        if (encoderHandle == 0L) return
+        nativeDestroyEncoder(encoderHandle)
+        encoderHandle = 0L
+    }
+
+    private external fun nativeInitEncoder(
+        width: Int,
+        height: Int,
+        packedConfig: IntArray,
+        targetBytes: Int,
+        durationMs: Int,
+        retainFrames: Boolean,
+        frameCacheDir: String?,
+        outputFd: Int
+    ): Long
+
+    private external fun nativeAddFrame(handle: Long, frameBuffer: ByteBuffer, timestampMs: Int)
+
+    private external fun nativeAddFrameYuv(
+        handle: Long,
+        yBuffer: ByteBuffer,
+        yStride: Int,
+        uBuffer: ByteBuffer,
+        uStride: Int,
+        vBuffer: ByteBuffer,
+        vStride: Int,
+        timestampMs: Int
+    )
+
+    private external fun nativeReleaseEncoder(handle: Long): LongArray?
+
+    private external fun nativeReencode(
+        handle: Long, packedConfig: IntArray, targetBytes: Int, outputFd: Int
+    ): LongArray?
+
+    private external fun nativeDestroyEncoder(handle: Long)
 
     companion object {
         init {
             System.loadLibrary("stickers")
         }
     }
-}
\ No newline at end of file
+}
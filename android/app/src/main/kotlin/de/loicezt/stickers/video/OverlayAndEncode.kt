@@ -26,7 +26,11 @@ import java.util.concurrent.TimeoutException
 import kotlin.math.min
 
 
-class OverlayAndEncode {
+/**
+ * Composites an overlay over a video and encodes the result as an animated WebP.
+ * @param cacheDir Directory for the temporary file the composited frames are kept in.
+ */
+class OverlayAndEncode(private val cacheDir: File) {
 
     enum class State {
         IDLE, RUNNING, SUCCESS, FAILED, CANCELLED
@@ -38,6 +42,10 @@ class OverlayAndEncode {
     private val _progress = MutableStateFlow(ProgressState())
     val progress = _progress.asStateFlow()
 
+    // Statistics of the last successful export
+    private val _stats = MutableStateFlow<ExportStats?>(null)
+    val stats = _stats.asStateFlow()
+
     private val scope = CoroutineScope(Dispatchers.Default + SupervisorJob())
     private var encodeJob: Job? = null
 
@@ -53,6 +61,9 @@ class OverlayAndEncode {
      * @param outputFile The destination file for the animated WebP.
      * @param config Configuration for the WebP encoder.
      * @param maxFps The maximum frames per second for the output. If null, uses original FPS.
+     * Ignored if [config] enables decimation: the encoder then gets every frame and picks the
+     * ones worth keeping itself.
+     * @param maxSizeBytes If > 0, the encoder lowers quality and frame rate to stay below this size.
      */
     // MODIFIED: Added maxFps parameter
     fun start(
@@ -60,7 +71,8 @@ class OverlayAndEncode {
         overlayFile: File,
         outputFile: File,
         config: WebPConfig,
-        maxFps: Int
+        maxFps: Int,
+        maxSizeBytes: Int
     ) {
         if (_status.value == State.RUNNING) {
             Log.w(LOG_TAG, "Encoding is already in progress. Ignoring new request.")
@@ -70,13 +82,15 @@ class OverlayAndEncode {
         encodeJob = scope.launch {
             _status.value = State.RUNNING
             _progress.value = ProgressState()
+            _stats.value = null
             try {
                 // MODIFIED: Pass maxFps to the encoding function
-                val webpData = doOverlayAndEncode(videoFile, overlayFile, config, maxFps)
-                if (webpData != null) {
-                    outputFile.writeBytes(webpData)
+                // The animation is written to outputFile as it is encoded
+                val stats = doOverlayAndEncode(videoFile, overlayFile, outputFile, config, maxFps, maxSizeBytes)
+                if (stats != null && stats.encoder.size > 0) {
+                    _stats.value = stats
                     _status.value = State.SUCCESS
-                    Log.d(LOG_TAG, "Encoding finished successfully.")
+                    Log.d(LOG_TAG, "Encoding finished successfully (${stats.encoder.size} bytes).")
                 } else {
                     throw IllegalStateException("Encoding produced no data.")
                 }
@@ -105,14 +119,16 @@ class OverlayAndEncode {
     private suspend fun doOverlayAndEncode(
         videoFile: File,
         overlayFile: File,
+        outputFile: File,
         config: WebPConfig,
-        maxFps: Int
-    ): ByteArray? {
+        maxFps: Int,
+        maxSizeBytes: Int
+    ): ExportStats? {
         val extractor = MediaExtractor()
         var decoder: MediaCodec? = null
         val glProcessor = OverlayGL()
         val webpEncoder = LibWebP()
-        var webpData: ByteArray? = null
+        var stats: ExportStats? = null
         var overlayBitmap: Bitmap? = null
 
         return withContext(Dispatchers.IO) {
@@ -137,7 +153,10 @@ class OverlayAndEncode {
                 } else {
                     30
                 }
-                val targetFrameRate = maxFps.let { min(it, originalFrameRate) } ?: originalFrameRate
+                // With decimation the encoder drops the frames that aren't worth their size
+                val decimate = (config.decimateCost ?: 0) > 0
+                val targetFrameRate =
+                    if (decimate) originalFrameRate else min(maxFps, originalFrameRate)
                 val totalFrames = ((durationUs / 1_000_000.0) * targetFrameRate).toInt()
                 _progress.value = ProgressState(totalFrames = totalFrames)
 
@@ -156,7 +175,15 @@ class OverlayAndEncode {
                 overlayBitmap.copyPixelsFromBuffer(pixelBufferForOverlay)
 
                 glProcessor.setup(OUTPUT_DIMENSION, OUTPUT_DIMENSION, videoWidth, videoHeight)
-                webpEncoder.nativeInitEncoder(OUTPUT_DIMENSION, OUTPUT_DIMENSION, config)
+                // The frames kept to fit the byte budget are written to a file rather than held in
+                // memory.
+                if (!webpEncoder.initEncoder(
+                        OUTPUT_DIMENSION, OUTPUT_DIMENSION, config, maxSizeBytes,
+                        (durationUs / 1000).toInt(), outputFile, frameCacheDir = cacheDir
+                    )
+                ) {
+                    throw IllegalStateException("Failed to initialize the WebP encoder.")
+                }
 
                 decoder = MediaCodec.createDecoderByType(inputFormat.getString(MediaFormat.KEY_MIME)!!)
                 decoder.configure(inputFormat, glProcessor.decoderInputSurface, null, 0)
@@ -170,7 +197,12 @@ class OverlayAndEncode {
                     ByteBuffer.allocateDirect(OUTPUT_DIMENSION * OUTPUT_DIMENSION * 4)
 
                 var lastProcessedTimestampUs = -1L
-                val frameIntervalUs = 1_000_000L / targetFrameRate
+                val frameIntervalUs = if (decimate) 0L else 1_000_000L / targetFrameRate
+                val startTimeNs = System.nanoTime()
+                // Time spent in each stage, in ns
+                var decodeWaitNs = 0L
+                var glNs = 0L
+                var addFrameNs = 0L
 
                 while (!isDecoderOutputDone && currentCoroutineContext().isActive) {
                     if (!isInputDone) {
@@ -212,13 +244,19 @@ class OverlayAndEncode {
 
                         if (processThisFrame) {
                             try {
+                                val frameStartNs = System.nanoTime()
                                 glProcessor.awaitNewFrame()
+                                val frameDecodedNs = System.nanoTime()
                                 glProcessor.drawFrame(overlayBitmap)
                                 glProcessor.readPixels(pixelBufferForReadback)
+                                val frameReadNs = System.nanoTime()
 
                                 val timestampMs =
                                     (decoderBufferInfo.presentationTimeUs / 1000).toInt()
-                                webpEncoder.nativeAddFrame(pixelBufferForReadback, timestampMs)
+                                webpEncoder.addFrame(pixelBufferForReadback, timestampMs)
+                                decodeWaitNs += frameDecodedNs - frameStartNs
+                                glNs += frameReadNs - frameDecodedNs
+                                addFrameNs += System.nanoTime() - frameReadNs
 
                                 currentFrame++
                                 val progressPercentage =
@@ -232,14 +270,24 @@ class OverlayAndEncode {
                         }
                     }
                 }
-                webpData = webpEncoder.nativeReleaseEncoder()
+                stats = webpEncoder.releaseEncoder()?.let {
+                    ExportStats(decodeWaitNs / 1000, glNs / 1000, addFrameNs / 1000, it)
+                }
+                // Throughput of the whole pipeline, to compare encoder settings
+                val elapsedS = (System.nanoTime() - startTimeNs) / 1e9
+                Log.d(LOG_TAG, "Encoded $currentFrame frames in %.2fs (%.1f fps)".format(
+                    elapsedS, currentFrame / elapsedS))
+                Log.d(LOG_TAG, "Decode wait %.2fs, GL %.2fs, adding frames %.2fs".format(
+                    decodeWaitNs / 1e9, glNs / 1e9, addFrameNs / 1e9))
             } finally {
+                // Only does something if we didn't get to releaseEncoder(), e.g. on cancellation
+                webpEncoder.destroyEncoder()
                 extractor.release()
                 decoder?.stop(); decoder?.release()
                 glProcessor.release()
                 overlayBitmap?.recycle()
             }
-            webpData
+            stats
         }
     }
 }
\ No newline at end of file
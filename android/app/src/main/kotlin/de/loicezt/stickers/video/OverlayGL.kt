@@ -141,6 +141,11 @@ class OverlayGL : SurfaceTexture.OnFrameAvailableListener {
         GLES20.glBindFramebuffer(GLES20.GL_FRAMEBUFFER, 0)
     }
 
+    /**
+     * Reads back the composited frame. The shaders swap red and blue, so the buffer holds
+     * BGRA bytes, which is the little-endian layout of libwebp's ARGB pixels. This lets the
+     * encoder use the buffer as is instead of converting it.
+     */
     fun readPixels(buffer: ByteBuffer) {
         buffer.order(ByteOrder.nativeOrder())
         GLES20.glBindFramebuffer(GLES20.GL_FRAMEBUFFER, fboHandle)
@@ -332,7 +337,7 @@ class OverlayGL : SurfaceTexture.OnFrameAvailableListener {
         varying vec2 vTexCoord;
         uniform samplerExternalOES sTexture;
         void main() {
-            gl_FragColor = texture2D(sTexture, vTexCoord);
+            gl_FragColor = texture2D(sTexture, vTexCoord).bgra;
         }
     """.trimIndent()
 
@@ -352,7 +357,7 @@ class OverlayGL : SurfaceTexture.OnFrameAvailableListener {
         varying vec2 vTexCoord;
         uniform sampler2D sTexture;
         void main() {
-            gl_FragColor = texture2D(sTexture, vTexCoord);
+            gl_FragColor = texture2D(sTexture, vTexCoord).bgra;
         }
     """.trimIndent()
 }
\ No newline at end of file
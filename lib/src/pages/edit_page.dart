@@ -558,65 +558,59 @@ class _EditPageState extends State<EditPage> {
     final output = File("$mediaCacheDir/exported_${DateTime.now().millisecondsSinceEpoch}.webp");
     Stopwatch sw = Stopwatch()..start();
     Uint8List? data;
-    double quality = 60;
-    int fps = 24;
-
-    for (int attempt = 0; attempt < 3; attempt++) {
-      if (context.mounted) {
-        switch (attempt) {
-          case 0:
-            _message = AppLocalizations.of(context)!.firstAttempt;
-          case 1:
-            _message = AppLocalizations.of(context)!.secondAttempt;
-          case 2:
-            _message = AppLocalizations.of(context)!.thirdAttempt;
-        }
-      }
-      setState(() {});
-      var config = WebPConfig(
-        lossless: false,
-        quality: quality,
-        alphaCompression: 1,
-        method: 4,
-      );
-      await service.start(
-          videoFile: _source.path, overlayFile: out.path, outputFile: output.path, config: config, fps: fps);
-      await for (final update in service.progressStream) {
-        if (update.status == Status.SUCCESS) {
-          break;
-        } else if (update.status == Status.RUNNING) {
-          _exportProgress = update.progress;
-          setState(() {});
-        } else if (update.status == Status.FAILED) {
-          if (context.mounted) {
-            showDialog(
-              context: context,
-              builder: (context) {
-                return ErrorDialog(
-                  title: AppLocalizations.of(context)!.exportWebpFailed,
-                  message: AppLocalizations.of(context)!.exportWebpFailedMsg,
-                );
-              },
-            );
-          }
-        }
-      }
-      print("Exported WebP in ${sw.elapsedMilliseconds}ms");
-      data = await output.readAsBytes();
-      print("Output size: ${data.lengthInBytes / 1024}kiB");
-      if (data.lengthInBytes / 1024 < 500) {
+
+    _message = "";
+    setState(() {});
+    const config = WebPConfig(
+      lossless: false,
+      quality: 60,
+      alphaCompression: 1,
+      method: 4,
+      // Video frames that only differ by compression noise aren't worth encoding
+      mergeThreshold: 40,
+      sceneCutThreshold: 15,
+      // The encoder picks the frame rate: it drops frames whose change isn't worth its size
+      decimateCost: 200,
+      // Sticker videos are mostly static around the subject
+      reuseAnalysis: true,
+    );
+    // The native encoder spreads the size budget over the frames as it encodes them, and only lowers
+    // quality/fps again from the kept frames if the result is still too big
+    await service.start(
+        videoFile: _source.path,
+        overlayFile: out.path,
+        outputFile: output.path,
+        config: config,
+        fps: 24,
+        maxSize: 500 * 1024);
+    EncodeStats? stats;
+    await for (final update in service.progressStream) {
+      if (update.status == Status.SUCCESS) {
+        stats = update.stats;
         break;
-      } else {
-        print("Result is ${data.lengthInBytes / 500 / 1024} times too big");
-        if (data.lengthInBytes / 1024 > 550) {
-          // If the sticker is really too large, the only solution is to drop frames
-          fps = (fps / (data.lengthInBytes / 1024) * 550).round();
+      } else if (update.status == Status.RUNNING) {
+        _exportProgress = update.progress;
+        setState(() {});
+      } else if (update.status == Status.FAILED) {
+        if (context.mounted) {
+          showDialog(
+            context: context,
+            builder: (context) {
+              return ErrorDialog(
+                title: AppLocalizations.of(context)!.exportWebpFailed,
+                message: AppLocalizations.of(context)!.exportWebpFailedMsg,
+              );
+            },
+          );
         }
-        quality -= 20;
-        print("New configuration: q=$quality fps=$fps");
       }
     }
-    if (data!.lengthInBytes / 1024 > 500) {
+    print("Exported WebP in ${sw.elapsedMilliseconds}ms");
+    print("Export stats: $stats");
+    // The encoder streams the animation to the file, check its size before reading it.
+    final size = await output.length();
+    print("Output size: ${size / 1024}kiB");
+    if (size / 1024 > 500) {
       if (!context.mounted) throw Exception();
       Navigator.of(context).pop();
       showDialog(
@@ -638,6 +632,7 @@ class _EditPageState extends State<EditPage> {
       );
       throw Exception("Sticker too large");
     }
+    data = await output.readAsBytes();
     return data;
   }
 
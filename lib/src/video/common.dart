@@ -7,11 +7,15 @@ class Progress {
   final int currentFrame;
   final int totalFrames;
 
+  /// Statistics of the export, once it succeeded.
+  final EncodeStats? stats;
+
   Progress({
     this.status = Status.IDLE,
     this.progress = 0.0,
     this.currentFrame = 0,
     this.totalFrames = 0,
+    this.stats,
   });
 
   @override
@@ -20,6 +24,109 @@ class Progress {
   }
 }
 
+/// An added frame, and the time it took to encode it.
+class InputFrameStats {
+  final int timestampMs;
+  final int addUs;
+
+  InputFrameStats.fromMap(Map map)
+      : timestampMs = map['timestampMs'] as int,
+        addUs = map['addUs'] as int;
+}
+
+/// A frame of the animation. Similar frames are merged, and frames may be dropped by the encoder
+/// or to fit the size budget, so these don't match the input frames one to one.
+class OutputFrameStats {
+  final bool keyFrame;
+  final int xOffset;
+  final int yOffset;
+  final int width;
+  final int height;
+  final int durationMs;
+
+  /// Number of encodings tried, the smallest one was kept.
+  final int candidates;
+  final bool lossless;
+  final bool blend;
+  final bool disposeToBackground;
+  final int size;
+
+  /// Number of input frames shown by this frame, 0 if it only extends the previous one.
+  final int inputFrames;
+
+  /// Quality the frame was encoded with, lowered by the encoder to fit the size budget.
+  final int quality;
+
+  OutputFrameStats.fromMap(Map map)
+      : keyFrame = map['keyFrame'] as bool,
+        xOffset = map['xOffset'] as int,
+        yOffset = map['yOffset'] as int,
+        width = map['width'] as int,
+        height = map['height'] as int,
+        durationMs = map['durationMs'] as int,
+        candidates = map['candidates'] as int,
+        lossless = map['lossless'] as bool,
+        blend = map['blend'] as bool,
+        disposeToBackground = map['disposeToBackground'] as bool,
+        size = map['size'] as int,
+        inputFrames = map['inputFrames'] as int,
+        quality = map['quality'] as int;
+}
+
+/// Where the time of an export went, to tell whether it is bound by decoding, GL or the encoder.
+/// Times are in microseconds.
+class EncodeStats {
+  final int size;
+  final int decodeWaitUs;
+  final int glUs;
+
+  /// Time spent handing frames over to the encoder, which blocks when it is behind.
+  final int addFrameUs;
+
+  /// Time spent encoding frames.
+  final int addUs;
+
+  /// Time frames waited for the encoder to have room for them.
+  final int producerWaitUs;
+
+  /// Time the encoder waited for the next frame.
+  final int workerIdleUs;
+  final int assembleUs;
+  final int budgetUs;
+  final int peakHeapBytes;
+
+  /// Most encoded frames the encoder held at once while picking key-frames, and their size.
+  final int peakBufferedFrames;
+  final int peakBufferedBytes;
+  final List<InputFrameStats> inputFrames;
+  final List<OutputFrameStats> outputFrames;
+
+  EncodeStats.fromMap(Map map)
+      : size = map['size'] as int,
+        decodeWaitUs = map['decodeWaitUs'] as int,
+        glUs = map['glUs'] as int,
+        addFrameUs = map['addFrameUs'] as int,
+        addUs = map['addUs'] as int,
+        producerWaitUs = map['producerWaitUs'] as int,
+        workerIdleUs = map['workerIdleUs'] as int,
+        assembleUs = map['assembleUs'] as int,
+        budgetUs = map['budgetUs'] as int,
+        peakHeapBytes = map['peakHeapBytes'] as int,
+        peakBufferedFrames = map['peakBufferedFrames'] as int,
+        peakBufferedBytes = map['peakBufferedBytes'] as int,
+        inputFrames = (map['inputFrames'] as List).map((e) => InputFrameStats.fromMap(e as Map)).toList(),
+        outputFrames = (map['outputFrames'] as List).map((e) => OutputFrameStats.fromMap(e as Map)).toList();
+
+  @override
+  String toString() {
+    return 'EncodeStats{size: $size, inputFrames: ${inputFrames.length}, outputFrames: ${outputFrames.length}, '
+        'decodeWaitUs: $decodeWaitUs, glUs: $glUs, addFrameUs: $addFrameUs, addUs: $addUs, '
+        'producerWaitUs: $producerWaitUs, workerIdleUs: $workerIdleUs, assembleUs: $assembleUs, '
+        'budgetUs: $budgetUs, peakHeapBytes: $peakHeapBytes, peakBufferedFrames: $peakBufferedFrames, '
+        'peakBufferedBytes: $peakBufferedBytes}';
+  }
+}
+
 enum WebPImageHint {
   defaultHint,
   picture,
@@ -54,6 +161,57 @@ class WebPConfig {
   final int? nearLossless;
   final bool? exact;
 
+  // Animation encoder options, see WebPAnimEncoderOptions.
+  /// Minimum distance between key-frames. Only used if [kmax] > 1.
+  final int? kmin;
+
+  /// Maximum distance between key-frames. 0 disables key-frames, 1 makes every frame one.
+  final int? kmax;
+
+  /// Tries every way to encode each frame to get the smallest output. Slow.
+  final bool? minimizeSize;
+
+  /// Lets each frame pick lossy or lossless compression.
+  final bool? allowMixed;
+
+  /// Number of times the animation plays, 0 meaning forever.
+  final int? loopCount;
+
+  /// If above 0, frames are only encoded as key-frame candidates when their
+  /// predicted size makes them likely picks, instead of always. From 0 to 100,
+  /// higher is faster but may pick slightly worse key-frames.
+  final int? keyframeTolerance;
+
+  /// If above 0, lossy frames that differ from the previous one by less than
+  /// this PSNR, in dB, are merged into it instead of being encoded.
+  final int? mergeThreshold;
+
+  /// If above 0, frames that change most of the picture with a PSNR below this,
+  /// in dB, are scene cuts and are encoded as key-frames.
+  final int? sceneCutThreshold;
+
+  /// If above 0, lossy frames whose change isn't worth its size are dropped and the previous
+  /// frame lasts longer instead: those predicted to take 1 kB for less than this many pixels
+  /// of full change. Higher drops more frames, but never more than 3 in a row.
+  final int? decimateCost;
+
+  /// If true, lossy frames reuse the analysis of the previous frame where the picture is
+  /// unchanged, and start their segments from its ones. Faster on mostly static videos, at the
+  /// cost of slightly different segments.
+  final bool? reuseAnalysis;
+
+  /// Fast lossy settings for previews: a quick method and a single encode per frame.
+  static const fast = WebPConfig(
+    lossless: false,
+    quality: 50,
+    method: 1,
+    alphaCompression: 1,
+    kmin: 0,
+    kmax: 0,
+    minimizeSize: false,
+    allowMixed: false,
+  );
+
   const WebPConfig({
     this.lossless,
     this.quality,
@@ -80,6 +238,16 @@ class WebPConfig {
     this.lowMemory,
     this.nearLossless,
     this.exact,
+    this.kmin,
+    this.kmax,
+    this.minimizeSize,
+    this.allowMixed,
+    this.loopCount,
+    this.keyframeTolerance,
+    this.mergeThreshold,
+    this.sceneCutThreshold,
+    this.decimateCost,
+    this.reuseAnalysis,
   });
 
   Map<String, dynamic> toMap() {
@@ -109,6 +277,16 @@ class WebPConfig {
       'lowMemory': lowMemory,
       'nearLossless': nearLossless,
       'exact': exact,
+      'kmin': kmin,
+      'kmax': kmax,
+      'minimizeSize': minimizeSize,
+      'allowMixed': allowMixed,
+      'loopCount': loopCount,
+      'keyframeTolerance': keyframeTolerance,
+      'mergeThreshold': mergeThreshold,
+      'sceneCutThreshold': sceneCutThreshold,
+      'decimateCost': decimateCost,
+      'reuseAnalysis': reuseAnalysis,
     }..removeWhere((key, value) => value == null);
   }
 }
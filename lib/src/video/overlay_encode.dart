@@ -35,6 +35,7 @@ class OverlayAndEncodeService {
         progress: (data['progress'] as num?)?.toDouble() ?? 0.0,
         currentFrame: data['currentFrame'] as int? ?? 0,
         totalFrames: data['totalFrames'] as int? ?? 0,
+        stats: data['stats'] is Map ? EncodeStats.fromMap(data['stats'] as Map) : null,
       );
       _progressController.add(progress);
     }
@@ -48,12 +49,18 @@ class OverlayAndEncodeService {
   }
 
   /// Calls the native method to start the overlay and encoding process.
+  ///
+  /// If [maxSize] is set, the native encoder lowers quality and frame rate on its own
+  /// until the output is at most [maxSize] bytes, without decoding the video again.
+  /// [fps] caps the frame rate, unless [config] sets [WebPConfig.decimateCost]: the
+  /// encoder then gets every frame and drops those that aren't worth their size.
   Future<void> start({
     required String videoFile,
     required String overlayFile,
     required String outputFile,
     required WebPConfig config,
     required int fps,
+    int? maxSize,
   }) async {
     try {
       // The method name 'startOverlay' and the argument keys must match
@@ -65,6 +72,7 @@ class OverlayAndEncodeService {
           'overlayFile': overlayFile,
           'outputFile': outputFile,
           'fps': fps,
+          'maxSize': maxSize,
           'config': config.toMap(),
         },
       );